@@ -0,0 +1,135 @@
+/*
+ * bcal as a bash loadable builtin
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * enable -f ./bcal.so bcal
+ * bcal [-v var] [-s bytes] [-c N] [-f loc] [expr] [N unit]
+ *
+ * The arguments are those of bcal -m and the output is stored in var,
+ * REPLY by default, without the trailing newlines as $(bcal -m ...)
+ * would have it. The evaluator is built from src/bcal.c with
+ * BCAL_BUILTIN defined, and each call starts without r or variables.
+ */
+
+#include "loadables.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define BCAL_ARGS 16
+
+extern int bcal_eval(char **args, int n, const char **out, size_t *outlen,
+		     const char **err, size_t *errlen);
+extern void bcal_free(void);
+
+static int bcal_builtin(WORD_LIST *list)
+{
+	char *args[BCAL_ARGS], *var = "REPLY", *val;
+	const char *out, *err;
+	size_t outlen, errlen;
+	int n = 0, ret;
+
+	if (list && STREQ(list->word->word, "--help")) {
+		builtin_help();
+		return EX_USAGE;
+	}
+
+	if (list && STREQ(list->word->word, "-v")) {
+		if (!list->next) {
+			builtin_usage();
+			return EX_USAGE;
+		}
+
+		var = list->next->word->word;
+		list = list->next->next;
+	}
+
+	if (!legal_identifier(var)) {
+		sh_invalidid(var);
+		return EXECUTION_FAILURE;
+	}
+
+	for (; list; list = list->next) {
+		if (n == BCAL_ARGS) {
+			builtin_error("too many arguments");
+			return EXECUTION_FAILURE;
+		}
+
+		/* bc runs as a child, it's no faster than bcal -b */
+		if (STREQ(list->word->word, "-b")) {
+			builtin_error("-b: not supported");
+			return EX_USAGE;
+		}
+
+		args[n++] = list->word->word;
+	}
+
+	if (!n) {
+		builtin_usage();
+		return EX_USAGE;
+	}
+
+	ret = bcal_eval(args, n, &out, &outlen, &err, &errlen);
+
+	if (errlen) {
+		fwrite(err, 1, errlen, stderr);
+		fflush(stderr);
+	}
+
+	while (outlen && out[outlen - 1] == '\n')
+		--outlen;
+
+	val = (char *)xmalloc(outlen + 1);
+	memcpy(val, out, outlen);
+	val[outlen] = '\0';
+
+	if (!bind_variable(var, val, 0)) {
+		free(val);
+		return EXECUTION_FAILURE;
+	}
+
+	free(val);
+	return ret ? EXECUTION_FAILURE : EXECUTION_SUCCESS;
+}
+
+void bcal_builtin_unload(char *name)
+{
+	bcal_free();
+}
+
+static char *bcal_doc[] = {
+	"Storage expression calculator.",
+	"",
+	"Evaluate an expression, a unit conversion, -c N or -f loc with the",
+	"arguments of `bcal -m' and store the output in VAR, REPLY by default.",
+	"",
+	"Exit Status:",
+	"Returns success unless the input is invalid.",
+	NULL
+};
+
+struct builtin bcal_struct = {
+	"bcal",
+	bcal_builtin,
+	BUILTIN_ENABLED,
+	bcal_doc,
+	"bcal [-v var] [-s bytes] [-c N] [-f loc] [expr] [N unit]",
+	0
+};
@@ -0,0 +1,70 @@
+/*
+ * Counted allocations
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every allocation of bcal goes through these wrappers, which count the
+ * calls and the bytes requested. --stats takes the difference of the
+ * counters across a phase. Memory allocated within libraries (readline,
+ * stdio, zlib, zstd) is not counted.
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	unsigned long long calls;
+	unsigned long long bytes;
+} t_alloc;
+
+/* Updated by the threads of -j too */
+static t_alloc allocs;
+
+static inline void mem_count(size_t size)
+{
+	__atomic_fetch_add(&allocs.calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&allocs.bytes, size, __ATOMIC_RELAXED);
+}
+
+static inline void *mem_malloc(size_t size)
+{
+	mem_count(size);
+	return malloc(size);
+}
+
+static inline void *mem_calloc(size_t n, size_t size)
+{
+	mem_count(n * size);
+	return calloc(n, size);
+}
+
+/* Counts the new size, as realloc(3) may move the block */
+static inline void *mem_realloc(void *ptr, size_t size)
+{
+	mem_count(size);
+	return realloc(ptr, size);
+}
+
+static inline char *mem_strdup(const char *str)
+{
+	mem_count(strlen(str) + 1);
+	return strdup(str);
+}
@@ -0,0 +1,119 @@
+/*
+ * Shared memory request rings of bcal --shm
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Layout of the segment, version 2, all fields in host byte order:
+ *
+ *   t_shmhdr              header, 320 bytes
+ *   t_shmreq[slots]       request ring, 128 bytes a slot
+ *   t_shmresp[slots]      response slots, 64 bytes a slot
+ *
+ * bcal creates the segment and sets magic last, once the rings are ready.
+ * Callers check magic, version and the slot sizes before using it.
+ *
+ * The request ring is a bounded queue with a sequence number per slot
+ * (Vyukov). The slot for position pos is [pos & (slots - 1)]. It is free
+ * for the producer at pos when its seq is pos, and holds data for the
+ * consumer at pos when its seq is pos + 1. A producer claims pos by a
+ * compare and swap of reqhead from pos to pos + 1, fills the slot and
+ * stores seq = pos + 1 with release ordering. bcal, the only consumer,
+ * reads the slot and stores seq = pos + slots with release ordering.
+ *
+ * Requests may be produced by several threads or processes. The response
+ * to the request at pos goes to response slot [pos & (slots - 1)], so each
+ * caller waits on the position it claimed and never sees the response of
+ * another. bcal writes it once the slot's seq is pos and stores
+ * seq = pos + 1. The caller reads it and stores seq = pos + slots to free
+ * the slot for the request a lap later.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define BCAL_SHM_MAGIC 0x6c616362 /* "bcal" */
+#define BCAL_SHM_VERSION 2
+#define BCAL_SHM_EXPR_LEN 72
+
+/* Requests, -> results */
+enum {
+	BCAL_SHM_EXPR = 1, /* expr[len] -> val[0] low, val[1] high 64 bits, unit */
+	BCAL_SHM_LBA,      /* arg[0] byte address, arg[1] sector size or 0 (512)
+			      -> val[0] LBA, val[1] offset */
+	BCAL_SHM_CHS2LBA,  /* arg[0..2] C, H, S, arg[3] geometry -> val[0] LBA */
+	BCAL_SHM_LBA2CHS,  /* arg[0] LBA, arg[3] geometry -> val[0..2] C, H, S */
+	BCAL_SHM_ALIGN,    /* arg[0] offset, arg[1] alignment
+			      -> val[0] aligned down, val[1] aligned up */
+};
+
+/* Geometry is MAX_HEAD << 32 | MAX_SECTOR, 0 is the default of bcal */
+#define BCAL_SHM_GEOMETRY(mh, ms) ((uint64_t)(mh) << 32 | (uint32_t)(ms))
+
+/* Status of a response */
+enum {
+	BCAL_SHM_OK,
+	BCAL_SHM_EOP,    /* unknown op or malformed request */
+	BCAL_SHM_EINVAL, /* invalid expression or argument */
+	BCAL_SHM_ERANGE, /* result out of range */
+};
+
+/* bcal is serving while state is UP */
+enum {
+	BCAL_SHM_DOWN,
+	BCAL_SHM_UP,
+};
+
+typedef struct {
+	uint64_t pos;
+	char pad[56];
+} t_shmpos;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;    /* per ring, a power of 2 */
+	uint32_t reqsz;    /* sizeof(t_shmreq) */
+	uint32_t respsz;   /* sizeof(t_shmresp) */
+	uint32_t state;
+	uint64_t pid;      /* of bcal */
+	char pad[32];
+	t_shmpos reqhead;  /* next request to produce */
+	t_shmpos reqtail;  /* next request to consume */
+	t_shmpos resphead; /* responses produced */
+	t_shmpos rsvd;
+} t_shmhdr;
+
+typedef struct {
+	uint64_t seq;
+	uint64_t tag;      /* returned in the response */
+	uint32_t op;
+	uint32_t len;      /* of expr */
+	uint64_t arg[4];
+	char expr[BCAL_SHM_EXPR_LEN];
+} t_shmreq;
+
+typedef struct {
+	uint64_t seq;
+	uint64_t tag;
+	uint32_t status;
+	uint32_t unit;     /* val is in bytes */
+	uint64_t val[4];
+	uint64_t rsvd;
+} t_shmresp;
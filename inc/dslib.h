@@ -4,7 +4,14 @@
 #include<stdlib.h>
 #include<string.h>
 
+#include "alloc.h"
+
+#ifdef WIDE_BITS
+/* Fits a '0b' prefixed binary literal of WIDE_BITS digits */
+#define NUM_LEN (WIDE_BITS + 3)
+#else
 #define NUM_LEN 63
+#endif
 
 typedef struct data {
 	char p[NUM_LEN];
@@ -21,9 +28,33 @@ typedef struct queue {
 	struct queue *link;
 } queue;
 
+/*
+ * Released nodes are kept for reuse, so the evaluator stops allocating
+ * once the stacks and queues have been as deep as the expressions need.
+ */
+static stack *stack_pool;
+static queue *queue_pool;
+
+static void stack_release(stack *node)
+{
+	node->link = stack_pool;
+	stack_pool = node;
+}
+
+static void queue_release(queue *node)
+{
+	node->link = queue_pool;
+	queue_pool = node;
+}
+
 static void push(stack **top, Data d)
 {
-	stack *new = (stack *)malloc(sizeof(stack));
+	stack *new = stack_pool;
+
+	if (new)
+		stack_pool = new->link;
+	else
+		new = (stack *)mem_malloc(sizeof(stack));
 
 	new->d = d;
 	new->link = NULL;
@@ -45,13 +76,18 @@ static void pop(stack **top, Data *d)
 		stack *tmp = *top;
 		*top = (*top)->link;
 		*d = tmp->d;
-		free(tmp);
+		stack_release(tmp);
 	}
 }
 
 static void enqueue(queue **front, queue **rear, Data d)
 {
-	queue *new = (queue *)malloc(sizeof(queue));
+	queue *new = queue_pool;
+
+	if (new)
+		queue_pool = new->link;
+	else
+		new = (queue *)mem_malloc(sizeof(queue));
 
 	new->d = d;
 	new->link = NULL;
@@ -75,13 +111,13 @@ static void dequeue(queue **front, queue **rear, Data *d)
 		if (*front == *rear) {
 			tmp = *front;
 			*d = tmp->d;
-			free(tmp);
+			queue_release(tmp);
 			*front = *rear = NULL;
 		} else {
 			tmp = *front;
 			*front = (*front)->link;
 			*d = tmp->d;
-			free(tmp);
+			queue_release(tmp);
 		}
 	}
 }
@@ -109,7 +145,7 @@ static void emptystack(stack **top)
 	while (*top != NULL) {
 		tmp = *top;
 		*top = (*top)->link;
-		free(tmp);
+		stack_release(tmp);
 	}
 }
 
@@ -120,7 +156,7 @@ static void cleanqueue(queue **front)
 	while (*front != NULL) {
 		tmp = *front;
 		*front = (*front)->link;
-		free(tmp);
+		queue_release(tmp);
 	}
 }
 
@@ -0,0 +1,523 @@
+/*
+ * Fixed width multiword unsigned integers for bcal wide mode
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef WIDE_BITS
+#error "WIDE_BITS must be defined to 256 or 512"
+#endif
+
+#if WIDE_BITS != 256 && WIDE_BITS != 512
+#error "WIDE_BITS must be 256 or 512"
+#endif
+
+#ifndef __SIZEOF_INT128__
+#error "wide mode needs __uint128_t"
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define WIDE_LIMBS (WIDE_BITS / 64)
+/* Binary digits with a space between octets, '0b' prefix and '\0' */
+#define WIDE_BUF_LEN (WIDE_BITS + (WIDE_BITS >> 3) + 3)
+
+typedef unsigned long long limb_t;
+
+/* Little-endian array of 64-bit limbs */
+typedef struct {
+	limb_t l[WIDE_LIMBS];
+} wuint_t;
+
+static inline void wide_set(wuint_t *v, __uint128_t n)
+{
+	memset(v, 0, sizeof(*v));
+	v->l[0] = (limb_t)n;
+	v->l[1] = (limb_t)(n >> 64);
+}
+
+static inline bool wide_iszero(const wuint_t *v)
+{
+	limb_t acc = 0;
+
+	for (int i = 0; i < WIDE_LIMBS; ++i)
+		acc |= v->l[i];
+
+	return !acc;
+}
+
+/* Number of limbs in use, 0 for zero */
+static inline int wide_len(const wuint_t *v)
+{
+	int n = WIDE_LIMBS;
+
+	while (n && !v->l[n - 1])
+		--n;
+
+	return n;
+}
+
+static inline int wide_cmp(const wuint_t *a, const wuint_t *b)
+{
+	for (int i = WIDE_LIMBS - 1; i >= 0; --i)
+		if (a->l[i] != b->l[i])
+			return a->l[i] > b->l[i] ? 1 : -1;
+
+	return 0;
+}
+
+/* Add with carry in and carry out */
+static inline limb_t wide_addc(limb_t a, limb_t b, limb_t cin, limb_t *cout)
+{
+#if defined(__x86_64__)
+	unsigned long long r;
+
+	*cout = _addcarry_u64((unsigned char)cin, a, b, &r);
+	return r;
+#else
+	limb_t r;
+	limb_t c = __builtin_add_overflow(a, b, &r);
+
+	c |= __builtin_add_overflow(r, cin, &r);
+	*cout = c;
+	return r;
+#endif
+}
+
+/* Subtract with borrow in and borrow out */
+static inline limb_t wide_subb(limb_t a, limb_t b, limb_t bin, limb_t *bout)
+{
+#if defined(__x86_64__)
+	unsigned long long r;
+
+	*bout = _subborrow_u64((unsigned char)bin, a, b, &r);
+	return r;
+#else
+	limb_t r;
+	limb_t c = __builtin_sub_overflow(a, b, &r);
+
+	c |= __builtin_sub_overflow(r, bin, &r);
+	*bout = c;
+	return r;
+#endif
+}
+
+/* 64x64 -> 128-bit product, high limb returned in hi */
+static inline limb_t wide_mulx(limb_t a, limb_t b, limb_t *hi)
+{
+#if defined(__x86_64__) && defined(__BMI2__)
+	unsigned long long h;
+	limb_t lo = _mulx_u64(a, b, &h);
+
+	*hi = h;
+	return lo;
+#else
+	__uint128_t p = (__uint128_t)a * b;
+
+	*hi = (limb_t)(p >> 64);
+	return (limb_t)p;
+#endif
+}
+
+/* c = a + b, returns false on overflow */
+static inline bool wide_add(const wuint_t *a, const wuint_t *b, wuint_t *c)
+{
+	limb_t carry = 0;
+
+	for (int i = 0; i < WIDE_LIMBS; ++i)
+		c->l[i] = wide_addc(a->l[i], b->l[i], carry, &carry);
+
+	return !carry;
+}
+
+/* c = a - b, returns false if b > a */
+static inline bool wide_sub(const wuint_t *a, const wuint_t *b, wuint_t *c)
+{
+	limb_t borrow = 0;
+
+	for (int i = 0; i < WIDE_LIMBS; ++i)
+		c->l[i] = wide_subb(a->l[i], b->l[i], borrow, &borrow);
+
+	return !borrow;
+}
+
+/* c = a * b (schoolbook, truncated to WIDE_BITS), returns false on overflow */
+static inline bool wide_mul(const wuint_t *a, const wuint_t *b, wuint_t *c)
+{
+	wuint_t r = {{0}};
+	int na = wide_len(a), nb = wide_len(b);
+	bool ok = true;
+
+	for (int i = 0; i < na; ++i) {
+		limb_t carry = 0, hi, lo, c1, c2;
+
+		if (!a->l[i])
+			continue;
+
+		for (int j = 0; j < nb; ++j) {
+			if (i + j >= WIDE_LIMBS) {
+				if (b->l[j])
+					ok = false;
+				continue;
+			}
+
+			lo = wide_mulx(a->l[i], b->l[j], &hi);
+			lo = wide_addc(lo, carry, 0, &c1);
+			r.l[i + j] = wide_addc(r.l[i + j], lo, 0, &c2);
+			carry = hi + c1 + c2; /* cannot overflow */
+		}
+
+		if (carry) {
+			if (i + nb < WIDE_LIMBS)
+				r.l[i + nb] = carry;
+			else
+				ok = false;
+		}
+	}
+
+	*c = r;
+	return ok;
+}
+
+/* v = v * m + add, returns false on overflow */
+static inline bool wide_muladd_small(wuint_t *v, limb_t m, limb_t add)
+{
+	limb_t carry = add, hi, lo, c;
+
+	for (int i = 0; i < WIDE_LIMBS; ++i) {
+		lo = wide_mulx(v->l[i], m, &hi);
+		v->l[i] = wide_addc(lo, carry, 0, &c);
+		carry = hi + c;
+	}
+
+	return !carry;
+}
+
+/* Divide v in place by d, returns the remainder */
+static inline limb_t wide_divmod_small(wuint_t *v, limb_t d)
+{
+	__uint128_t rem = 0;
+
+	for (int i = wide_len(v) - 1; i >= 0; --i) {
+		__uint128_t cur = (rem << 64) | v->l[i];
+
+		v->l[i] = (limb_t)(cur / d);
+		rem = cur % d;
+	}
+
+	return (limb_t)rem;
+}
+
+/* c = a << n, returns false if set bits are shifted out */
+static inline bool wide_shl(const wuint_t *a, unsigned int n, wuint_t *c)
+{
+	wuint_t r = {{0}};
+	unsigned int limbs = n >> 6, bits = n & 63;
+
+	if (wide_iszero(a)) {
+		*c = r;
+		return true;
+	}
+
+	if (n >= WIDE_BITS)
+		return false;
+
+	for (int i = WIDE_LIMBS - 1; i >= 0; --i) {
+		limb_t cur = a->l[i];
+
+		if (!cur)
+			continue;
+
+		/* Bits moving past the top limb mean overflow */
+		if ((unsigned int)i + limbs >= WIDE_LIMBS)
+			return false;
+		if (bits && (unsigned int)i + limbs + 1 >= WIDE_LIMBS && (cur >> (64 - bits)))
+			return false;
+
+		r.l[i + limbs] |= cur << bits;
+		if (bits && (unsigned int)i + limbs + 1 < WIDE_LIMBS)
+			r.l[i + limbs + 1] |= cur >> (64 - bits);
+	}
+
+	*c = r;
+	return true;
+}
+
+/* c = a >> n */
+static inline void wide_shr(const wuint_t *a, unsigned int n, wuint_t *c)
+{
+	wuint_t r = {{0}};
+	unsigned int limbs = n >> 6, bits = n & 63;
+
+	if (n < WIDE_BITS) {
+		for (unsigned int i = limbs; i < WIDE_LIMBS; ++i) {
+			r.l[i - limbs] |= a->l[i] >> bits;
+			if (bits && i - limbs)
+				r.l[i - limbs - 1] |= a->l[i] << (64 - bits);
+		}
+	}
+
+	*c = r;
+}
+
+/*
+ * q = a / b, r = a % b using Knuth's algorithm D on 64-bit limbs
+ * Returns false if b is zero.
+ */
+static inline bool wide_divmod(const wuint_t *a, const wuint_t *b, wuint_t *q, wuint_t *r)
+{
+	int m = wide_len(a), n = wide_len(b), s;
+	limb_t un[WIDE_LIMBS + 1], vn[WIDE_LIMBS];
+	wuint_t quot = {{0}}, rem = {{0}};
+
+	if (!n)
+		return false;
+
+	if (m < n) {
+		*r = *a;
+		memset(q, 0, sizeof(*q));
+		return true;
+	}
+
+	if (n == 1) {
+		quot = *a;
+		rem.l[0] = wide_divmod_small(&quot, b->l[0]);
+		*q = quot;
+		*r = rem;
+		return true;
+	}
+
+	/* Normalize so that the top limb of the divisor has its top bit set */
+	s = __builtin_clzll(b->l[n - 1]);
+	for (int i = n - 1; i > 0; --i)
+		vn[i] = (b->l[i] << s) | (s ? b->l[i - 1] >> (64 - s) : 0);
+	vn[0] = b->l[0] << s;
+
+	un[m] = s ? a->l[m - 1] >> (64 - s) : 0;
+	for (int i = m - 1; i > 0; --i)
+		un[i] = (a->l[i] << s) | (s ? a->l[i - 1] >> (64 - s) : 0);
+	un[0] = a->l[0] << s;
+
+	for (int j = m - n; j >= 0; --j) {
+		__uint128_t num = ((__uint128_t)un[j + n] << 64) | un[j + n - 1];
+		__uint128_t qhat = num / vn[n - 1];
+		__uint128_t rhat = num - qhat * vn[n - 1];
+		__int128 t, k;
+
+		/* qhat is at most 2 too large, correct it using the next limb */
+		while (qhat >> 64 || qhat * vn[n - 2] > ((rhat << 64) | un[j + n - 2])) {
+			--qhat;
+			rhat += vn[n - 1];
+			if (rhat >> 64)
+				break;
+		}
+
+		/* Multiply and subtract */
+		k = 0;
+		for (int i = 0; i < n; ++i) {
+			__uint128_t p = qhat * vn[i];
+
+			t = (__int128)un[i + j] - k - (__int128)(limb_t)p;
+			un[i + j] = (limb_t)t;
+			k = (__int128)(limb_t)(p >> 64) - (t >> 64);
+		}
+
+		t = (__int128)un[j + n] - k;
+		un[j + n] = (limb_t)t;
+
+		/* Subtracted too much, add one divisor back */
+		if (t < 0) {
+			limb_t carry = 0;
+
+			--qhat;
+			for (int i = 0; i < n; ++i)
+				un[i + j] = wide_addc(un[i + j], vn[i], carry, &carry);
+			un[j + n] += carry;
+		}
+
+		quot.l[j] = (limb_t)qhat;
+	}
+
+	/* Unnormalize the remainder */
+	for (int i = 0; i < n; ++i)
+		rem.l[i] = (un[i] >> s) | (s ? un[i + 1] << (64 - s) : 0);
+
+	*q = quot;
+	*r = rem;
+	return true;
+}
+
+/* Converts to long double, for IEC/SI representation */
+static inline long double wide_to_ld(const wuint_t *v)
+{
+	long double val = 0;
+
+	for (int i = WIDE_LIMBS - 1; i >= 0; --i)
+		val = val * 18446744073709551616.0L + (long double)v->l[i];
+
+	return val;
+}
+
+/* Converts a non-negative long double, returns false on overflow */
+static inline bool wide_from_ld(long double val, wuint_t *v)
+{
+	memset(v, 0, sizeof(*v));
+
+	for (int i = WIDE_LIMBS - 1; i >= 0; --i) {
+		long double scale = 1;
+
+		for (int j = 0; j < i; ++j)
+			scale *= 18446744073709551616.0L;
+
+		long double limb = val / scale;
+
+		if (limb >= 18446744073709551616.0L)
+			return false;
+
+		v->l[i] = (limb_t)limb;
+		val -= (long double)v->l[i] * scale;
+		if (val < 0)
+			val = 0;
+	}
+
+	return true;
+}
+
+/*
+ * Parses a '0b' binary, '0x' hex or decimal string of digits
+ * Returns false on invalid characters or overflow.
+ */
+static inline bool wide_parse(const char *str, wuint_t *v)
+{
+	unsigned int base = 10, shift = 0, digit;
+
+	memset(v, 0, sizeof(*v));
+
+	if (!str || !*str)
+		return false;
+
+	if (str[0] == '0' && (str[1] == 'b' || str[1] == 'B'))
+		base = 2, shift = 1;
+	else if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+		base = 16, shift = 4;
+
+	if (base != 10) {
+		str += 2;
+		if (!*str)
+			return false;
+	}
+
+	for (; *str; ++str) {
+		char ch = *str;
+
+		if (ch >= '0' && ch <= '9')
+			digit = ch - '0';
+		else if (base == 16 && ch >= 'a' && ch <= 'f')
+			digit = ch - 'a' + 10;
+		else if (base == 16 && ch >= 'A' && ch <= 'F')
+			digit = ch - 'A' + 10;
+		else
+			return false;
+
+		if (digit >= base)
+			return false;
+
+		if (shift) {
+			if (v->l[WIDE_LIMBS - 1] >> (64 - shift))
+				return false;
+			wide_shl(v, shift, v);
+			v->l[0] |= digit;
+		} else if (!wide_muladd_small(v, 10, digit))
+			return false;
+	}
+
+	return true;
+}
+
+/* Decimal representation, returns a pointer into buf */
+static inline char *wide_tostr(const wuint_t *v, char *buf, size_t len)
+{
+	static const limb_t chunk = 10000000000000000000ULL; /* 10^19 */
+	wuint_t tmp = *v;
+	char *loc = buf + len - 1;
+
+	*loc = '\0';
+
+	do {
+		limb_t rem = wide_divmod_small(&tmp, chunk);
+		bool last = wide_iszero(&tmp);
+
+		for (int i = 0; i < 19 && (!last || rem); ++i) {
+			*--loc = (char)('0' + rem % 10);
+			rem /= 10;
+		}
+	} while (!wide_iszero(&tmp));
+
+	if (!*loc)
+		*--loc = '0';
+
+	return loc;
+}
+
+/* Hex representation with '0x' prefix and no leading zeros */
+static inline char *wide_tohex(const wuint_t *v, char *buf)
+{
+	static const char hexdigits[] = "0123456789abcdef";
+	char *p = buf;
+	bool lead = true;
+
+	*p++ = '0';
+	*p++ = 'x';
+
+	for (int i = WIDE_BITS - 4; i >= 0; i -= 4) {
+		unsigned int nibble = (unsigned int)(v->l[i >> 6] >> (i & 63)) & 0xf;
+
+		if (lead && !nibble && i)
+			continue;
+
+		lead = false;
+		*p++ = hexdigits[nibble];
+	}
+
+	*p = '\0';
+	return buf;
+}
+
+/* Binary representation with octets separated by a space */
+static inline char *wide_tobin(const wuint_t *v, char *buf)
+{
+	char *p = buf;
+	int top = WIDE_BITS - 1;
+
+	while (top > 0 && !((v->l[top >> 6] >> (top & 63)) & 1))
+		--top;
+
+	for (int i = top; i >= 0; --i) {
+		*p++ = (char)('0' + ((v->l[i >> 6] >> (i & 63)) & 1));
+		if (i && !(i & 7))
+			*p++ = ' ';
+	}
+
+	*p = '\0';
+	return buf;
+}
@@ -20,18 +20,47 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#ifndef BCAL_BUILTIN
 #include <readline/history.h>
 #include <readline/readline.h>
+#endif
+#include "bcal_shm.h"
 #include "dslib.h"
 #include "log.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WIDE_BITS
+#include "wideint.h"
+#endif
 
 #define SECTOR_SIZE 512 /* 0x200 */
 #define MAX_HEAD 16 /* 0x10 */
@@ -41,6 +70,8 @@
 #define FLOAT_WIDTH 40
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define MAX_BITS 128
+#define BIN_BUF_LEN (MAX_BITS + (MAX_BITS >> 3)) /* bits, a blank per byte, NUL */
+#define HEX_BUF_LEN ((MAX_BITS >> 2) + 3) /* 0x, nibbles, NUL */
 #define ALIGNMENT_MASK_4BIT 0xF
 #define ELEMENTS(x) (sizeof(x) / sizeof(*(x)))
 
@@ -52,10 +83,20 @@ typedef long double maxfloat_t;
 
 #ifdef __SIZEOF_INT128__
 typedef __uint128_t maxuint_t;
+#define FITS_U64(x) (!((x) >> 64))
 #else
 typedef __uint64_t maxuint_t;
+#define FITS_U64(x) (true)
 #endif
 
+#define UINT_BITS (sizeof(maxuint_t) << 3)
+
+/* Operand with unit flag */
+typedef struct {
+	maxuint_t v;
+	char unit;
+} t_val;
+
 /* CHS representation */
 typedef struct {
 	ulong c;
@@ -73,21 +114,35 @@ typedef struct {
 	uchar loglvl  : 2;
 } settings;
 
+#ifndef BCAL_BUILTIN
 static char *VERSION = "2.4";
+#endif
 static char *units[] = {"b", "kib", "mib", "gib", "tib", "kb", "mb", "gb", "tb"};
+/* Size of each of the units above, in bytes */
+static const ull unitsz[] = {1, 1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40,
+			     1000, 1000000, 1000000000, 1000000000000};
 static char *logarr[] = {"ERROR", "WARNING", "INFO", "DEBUG"};
 
 static char *FAILED = "1";
 static char *PASSED = "\0";
 static char *curexpr = NULL;
+#ifndef BCAL_BUILTIN
 static char prompt[8] = "bcal> ";
+#endif
 
 static char uint_buf[UINT_BUF_LEN];
 static char float_buf[FLOAT_BUF_LEN];
 
 static Data lastres = {"\0", 0};
+static ull resgen; /* bumped when a result is stored in r */
 static settings cfg = {0, 0, 0, 0, 0, INFO};
 
+/*
+ * Output and messages go to fout and ferr, stdout and stderr unless a
+ * request of --serve or --coproc is being captured
+ */
+static FILE *fout, *ferr;
+
 static const char* const error_strings[] = {
 	"is undefined",
 	"Missing operator"
@@ -103,18 +158,250 @@ static void debug_log(const char *func, int level, const char *format, ...)
 	va_start(ap, format);
 
 	if (level <= cfg.loglvl) {
+		/*
+		 * Keep the order of results and errors in merged output,
+		 * info and debug messages are not worth a flush each
+		 */
+		if (level <= WARNING)
+			fflush(fout);
+
 		if (cfg.loglvl == DEBUG) {
-			fprintf(stderr, "%s(), %s: ", func, logarr[level]);
-			vfprintf(stderr, format, ap);
+			fprintf(ferr, "%s(), %s: ", func, logarr[level]);
+			vfprintf(ferr, format, ap);
 		} else {
-			fprintf(stderr, "%s: ", logarr[level]);
-			vfprintf(stderr, format, ap);
+			fprintf(ferr, "%s: ", logarr[level]);
+			vfprintf(ferr, format, ap);
 		}
 	}
 
 	va_end(ap);
 }
 
+/*
+ * Phase timings and allocations of --stats
+ * Durations go into log-linear buckets, 16 per power of 2 as in an HDR
+ * histogram, so percentiles are within 1/16. Without --stats a phase
+ * costs a branch.
+ */
+enum {
+	ST_FIXEXPR,
+	ST_POSTFIX,
+	ST_EVAL,
+	ST_UNITCONV,
+	ST_BC,
+	ST_OUTPUT,
+	ST_REQUEST,
+	ST_PHASES,
+};
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LEN ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+	ull count;
+	ull total; /* ns */
+	ull max;
+	ull calls; /* allocations */
+	ull bytes;
+	ull peak;  /* most bytes allocated in one pass */
+	ull allocating; /* passes which allocated */
+	ull hist[HIST_LEN];
+} t_phase;
+
+/* Start of a phase */
+typedef struct {
+	ull ns;
+	ull calls;
+	ull bytes;
+} t_mark;
+
+static t_phase *stats; /* NULL without --stats */
+static volatile sig_atomic_t stats_dump;
+
+static ull now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ull)ts.tv_sec * 1000000000ULL + (ull)ts.tv_nsec;
+}
+
+static inline t_mark stats_start(void)
+{
+	t_mark m = {0, 0, 0};
+
+	if (stats) {
+		m.calls = __atomic_load_n(&allocs.calls, __ATOMIC_RELAXED);
+		m.bytes = __atomic_load_n(&allocs.bytes, __ATOMIC_RELAXED);
+		m.ns = now_ns();
+	}
+
+	return m;
+}
+
+/* Values below HIST_SUB have a bucket each */
+static uint hist_idx(ull ns)
+{
+	uint msb;
+
+	if (ns < HIST_SUB)
+		return (uint)ns;
+
+	msb = 63 - (uint)__builtin_clzll(ns);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       (uint)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static void stats_add(uint phase, const t_mark *start)
+{
+	t_phase *ph = &stats[phase];
+	ull ns = now_ns() - start->ns;
+	ull calls = __atomic_load_n(&allocs.calls, __ATOMIC_RELAXED) - start->calls;
+	ull bytes = __atomic_load_n(&allocs.bytes, __ATOMIC_RELAXED) - start->bytes;
+
+	++ph->count;
+	ph->total += ns;
+	if (ns > ph->max)
+		ph->max = ns;
+	++ph->hist[hist_idx(ns)];
+
+	if (calls) {
+		ph->calls += calls;
+		ph->bytes += bytes;
+		if (bytes > ph->peak)
+			ph->peak = bytes;
+		++ph->allocating;
+	}
+}
+
+static inline void stats_end(uint phase, t_mark start)
+{
+	if (stats)
+		stats_add(phase, &start);
+}
+
+/* Run the statements as a timed phase */
+#define STATS_TIME(phase, ...) \
+	do { \
+		t_mark stats_t0 = stats_start(); \
+		__VA_ARGS__; \
+		stats_end(phase, stats_t0); \
+	} while (0)
+
+#ifndef BCAL_BUILTIN
+static const char * const phase_names[ST_PHASES] = {
+	"fixexpr", "infix2postfix", "eval", "unitconv", "bc", "output", "request",
+};
+
+/* Lowest value of bucket i */
+static ull hist_low(uint i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	return (ull)(HIST_SUB + (i & (HIST_SUB - 1))) << ((i >> HIST_SUB_BITS) - 1);
+}
+
+/* Highest value in the bucket which holds the value at fraction */
+static ull stats_pct(const t_phase *ph, double fraction)
+{
+	ull rank = (ull)(fraction * (double)ph->count), seen = 0;
+
+	for (uint i = 0; i < HIST_LEN; ++i) {
+		seen += ph->hist[i];
+		if (seen > rank) {
+			ull high = i + 1 < HIST_LEN ? hist_low(i + 1) - 1 : ph->max;
+
+			return high < ph->max ? high : ph->max;
+		}
+	}
+
+	return ph->max;
+}
+
+static void stats_report(void)
+{
+	/* No escapes in minimal output */
+	const char *bold = cfg.minimal ? "" : "\033[1m", *plain = cfg.minimal ? "" : "\033[0m";
+	const t_phase *ph;
+	double f;
+
+	if (!stats)
+		return;
+
+	fflush(stdout);
+	fprintf(stderr, "%sSTATS%s (us)\n", bold, plain);
+	fprintf(stderr, " %-14s %10s %12s %9s %9s %9s %9s %9s\n",
+		"phase", "count", "total", "mean", "p50", "p99", "p999", "max");
+
+	for (uint i = 0; i < ST_PHASES; ++i) {
+		ph = &stats[i];
+		if (!ph->count)
+			continue;
+
+		fprintf(stderr, " %-14s %10llu %12.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+			phase_names[i], ph->count, ph->total / 1e3,
+			ph->total / 1e3 / (double)ph->count, stats_pct(ph, 0.5) / 1e3,
+			stats_pct(ph, 0.99) / 1e3, stats_pct(ph, 0.999) / 1e3, ph->max / 1e3);
+	}
+
+	fprintf(stderr, "\n%sALLOCATIONS%s (peak: bytes of one pass)\n", bold, plain);
+	fprintf(stderr, " %-14s %10s %12s %12s %12s\n", "phase", "calls", "bytes", "peak", "allocating");
+	for (uint i = 0; i < ST_PHASES; ++i) {
+		ph = &stats[i];
+		if (ph->count)
+			fprintf(stderr, " %-14s %10llu %12llu %12llu %12llu\n",
+				phase_names[i], ph->calls, ph->bytes, ph->peak, ph->allocating);
+	}
+
+	/* Percentile ladder of the requests of batch and server modes */
+	ph = &stats[ST_REQUEST];
+	if (ph->count < 2)
+		return;
+
+	fprintf(stderr, "\n%sREQUEST LATENCY%s\n %12s %12s %12s\n", bold, plain,
+		"value (us)", "percentile", "count");
+	for (f = 0.5; (1 - f) * (double)ph->count >= 1; f = 1 - (1 - f) / 2)
+		fprintf(stderr, " %12.3f %12.6f %12llu\n", stats_pct(ph, f) / 1e3, f,
+			(ull)(f * (double)ph->count));
+	fprintf(stderr, " %12.3f %12.6f %12llu\n", ph->max / 1e3, 1.0, ph->count);
+}
+
+/* Report on SIGUSR1, at a point where the output is not captured */
+static void stats_poll(void)
+{
+	if (stats_dump) {
+		stats_dump = 0;
+		stats_report();
+	}
+}
+
+static void stats_signal(int sig)
+{
+	stats_dump = 1;
+}
+
+static int stats_init(void)
+{
+	struct sigaction sa;
+
+	stats = (t_phase *)mem_calloc(ST_PHASES, sizeof(t_phase));
+	if (!stats) {
+		log(ERROR, "out of memory\n");
+		return -1;
+	}
+
+	/* Blocking reads are restarted, epoll_wait(2) and poll(2) are not */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	atexit(stats_report);
+	return 0;
+}
+#endif
+
 /*
  * Just a safe strncpy(3)
  * Always null ('\0') terminates if both src and dest are valid pointers.
@@ -198,13 +485,15 @@ static void remove_commas(char *str)
  * Try to evaluate en expression using bc
  * If argument is NULL, global curexpr is picked
  */
-static int try_bc(char *expr)
+static int bc_eval(char *expr)
 {
+	static char buffer[128];
 	pid_t pid;
 	int pipe_pc[2], pipe_cp[2];
 	size_t len;
 	ssize_t ret;
 	char *ptr = cfg.calc ? "calc" : "bc";
+	struct sigaction sa, oldsa;
 
 	remove_commas(expr);
 
@@ -217,96 +506,71 @@ static int try_bc(char *expr)
 
 	log(DEBUG, "expression: \"%s\"\n", expr);
 
-	if (program_exit(expr))
-		exit(0);
-
-	if (pipe(pipe_pc) == -1 || pipe(pipe_cp) == -1) {
-		log(ERROR, "pipe()!\n");
-		exit(EXIT_FAILURE);
+	if (pipe(pipe_pc) == -1) {
+		log(ERROR, "pipe()! [%s]\n", strerror(errno));
+		return -1;
 	}
 
-	pid = fork();
-
-	if (pid == -1) {
-		log(ERROR, "fork() failed!\n");
+	if (pipe(pipe_cp) == -1) {
+		log(ERROR, "pipe()! [%s]\n", strerror(errno));
+		close(pipe_pc[0]);
+		close(pipe_pc[1]);
 		return -1;
 	}
 
-	if (pid == 0) { /* child */
-		close(STDOUT_FILENO);
-		close(STDIN_FILENO);
-		close(pipe_pc[1]); // Close writing end
-		close(pipe_cp[0]); // Close reading end
+	/* A write to a bc which has exited fails with EPIPE */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, &oldsa);
 
+	pid = fork();
+	if (pid == 0) { /* child */
 		dup2(pipe_pc[0], STDIN_FILENO); // Take stdin from parent
 		dup2(pipe_cp[1], STDOUT_FILENO); // Give stdout to parent
 		dup2(pipe_cp[1], STDERR_FILENO); // Give stderr to parent
-
-		int ret = execlp(ptr, ptr, (char*) NULL);
-		log(ERROR, "execlp() failed!\n");
-		exit(ret);
-	}
-
-	if (!cfg.calc) {
-		/* parent */
-		if (write(pipe_pc[1], "scale=10\n", 9) != 9) {
-			log(ERROR, "write(1)! [%s]\n", strerror(errno));
-			exit(-1);
-		}
+		close(pipe_pc[0]);
+		close(pipe_pc[1]);
+		close(pipe_cp[0]);
+		close(pipe_cp[1]);
+		sigaction(SIGPIPE, &oldsa, NULL);
+
+		execlp(ptr, ptr, (char *)NULL);
+		/* No output tells the parent, exit handlers are not run */
+		_exit(127);
 	}
 
-	if (write(pipe_pc[1], "r=", 2) != 2) {
-		log(ERROR, "write(2)! [%s]\n", strerror(errno));
-		exit(-1);
-	}
+	close(pipe_pc[0]);
+	close(pipe_cp[1]);
 
-	if (lastres.p[0]) {
-		ret = (ssize_t)strlen(lastres.p);
-		if (write(pipe_pc[1], lastres.p, ret) != ret) {
-			log(ERROR, "write(3)! [%s]\n", strerror(errno));
-			exit(-1);
-		}
+	if (pid == -1) {
+		log(ERROR, "fork() failed! [%s]\n", strerror(errno));
+		ret = -1;
+	} else if (dprintf(pipe_pc[1], "%sr=%s\n%s\n", cfg.calc ? "" : "scale=10\n",
+			   lastres.p[0] ? lastres.p : "0", expr) < 0 && errno != EPIPE) {
+		log(ERROR, "write()! [%s]\n", strerror(errno));
+		ret = -1;
 	} else {
-		if (write(pipe_pc[1], "0", 1) != 1) {
-			log(ERROR, "write(4)! [%s]\n", strerror(errno));
-			exit(-1);
-		}
-	}
-
-	if (write(pipe_pc[1], "\n", 1) != 1) {
-		log(ERROR, "write(5)! [%s]\n", strerror(errno));
-		exit(-1);
-	}
-
-	ret = (ssize_t)strlen(expr);
-	if (write(pipe_pc[1], expr, ret) != ret) {
-		log(ERROR, "write(6)! [%s]\n", strerror(errno));
-		exit(-1);
-	}
-
-	if (write(pipe_pc[1], "\n", 1) != 1) {
-		log(ERROR, "write(7)! [%s]\n", strerror(errno));
-		exit(-1);
-	}
-
-	static char buffer[128];
-
-	ret = read(pipe_cp[0], buffer, sizeof(buffer) - 1);
-	if (ret == -1) {
-		log(ERROR, "read()! [%s]\n", strerror(errno));
-		exit(-1);
+		/* If bc could not be run, there is no output */
+		ret = read(pipe_cp[0], buffer, sizeof(buffer) - 1);
+		if (ret == -1)
+			log(ERROR, "read()! [%s]\n", strerror(errno));
+		else if (!ret)
+			log(ERROR, "%s failed\n", ptr);
 	}
 
-	if (write(pipe_pc[1], "quit\n", 5) != 5) {
-		log(ERROR, "write(7)! [%s]\n", strerror(errno));
-		exit(-1);
+	/* bc quits at the end of its input, calc is stopped */
+	close(pipe_pc[1]);
+	close(pipe_cp[0]);
+	if (pid != -1) {
+		if (cfg.calc)
+			kill(pid, SIGTERM);
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+			;
 	}
 
-	if (cfg.calc)
-		kill(pid, SIGTERM);
-
-	close(pipe_cp[0]);
-	close(pipe_pc[1]);
+	sigaction(SIGPIPE, &oldsa, NULL);
+	if (ret <= 0)
+		return -1;
 
 	buffer[ret] = '\0';
 
@@ -315,7 +579,7 @@ static int try_bc(char *expr)
 		while (isspace(*ptr)) /* calc results have space before them */
 			++ptr;
 
-		printf("%s", ptr); /* Print the result/error */
+		fprintf(fout, "%s", ptr); /* Print the result/error */
 
 		/* Detect common error conditions for calc and stop */
 		if (cfg.calc)
@@ -344,6 +608,7 @@ static int try_bc(char *expr)
 		}
 #endif
 		lastres.unit = 0;
+		++resgen;
 		log(DEBUG, "result: %s %d\n", lastres.p, lastres.unit);
 		return 0;
 	}
@@ -352,31 +617,76 @@ static int try_bc(char *expr)
 	return -1;
 }
 
-static void binprint(maxuint_t n)
+static int try_bc(char *expr)
 {
-	int count = MAX_BITS - 1;
-	int pos = MAX_BITS + (MAX_BITS >> 2) - 1;
-	char binstr[MAX_BITS + (MAX_BITS >> 2) + 1] = {0};
+	int ret;
 
-	if (!n) {
-		printf("0");
-		return;
-	}
+	STATS_TIME(ST_BC, ret = bc_eval(expr));
+	return ret;
+}
 
-	while (n && count >= 0) {
-		binstr[pos] = "01"[n & 1];
-		--pos;
-		n >>= 1;
-		if (n && count && !(count & 7)) {
-			binstr[pos] = ' ';
-			--pos;
-		}
-		--count;
+/* Binary in groups of 8 bits from a byte table, returns the start in buf */
+static char *binstr(maxuint_t n, char *buf)
+{
+	static char bits[256][8];
+	char *pch = buf + BIN_BUF_LEN - 1;
+
+	if (!bits[1][7])
+		for (int i = 0; i < 256; ++i)
+			for (int k = 0; k < 8; ++k)
+				bits[i][k] = "01"[(i >> (7 - k)) & 1];
+
+	*pch = '\0';
+	for (;;) {
+		pch -= 8;
+		memcpy(pch, bits[(uchar)n], 8);
+		n >>= 8;
+		if (!n)
+			break;
+		*--pch = ' ';
 	}
 
-	++pos;
+	/* No leading zeros in the first group */
+	while (*pch == '0' && pch[1] != ' ' && pch[1] != '\0')
+		++pch;
+
+	return pch;
+}
+
+/* Hex with a 0x prefix from a byte table, returns the start in buf */
+static char *hexstr(maxuint_t n, char *buf)
+{
+	static const char hex[] =
+		"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+		"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+		"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+		"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+		"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+		"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+		"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+		"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+	char *pch = buf + HEX_BUF_LEN - 1;
+
+	*pch = '\0';
+	do {
+		pch -= 2;
+		memcpy(pch, hex + 2 * (uint)(uchar)n, 2);
+		n >>= 8;
+	} while (n);
+
+	if (*pch == '0' && pch[1] != '\0')
+		++pch;
+
+	*--pch = 'x';
+	*--pch = '0';
+	return pch;
+}
+
+static void binprint(maxuint_t n)
+{
+	char buf[BIN_BUF_LEN];
 
-	printf("%s", binstr + pos);
+	fprintf(fout, "%s", binstr(n, buf));
 }
 
 static char *getstr_u128(maxuint_t n, char *buf)
@@ -411,20 +721,17 @@ static char *getstr_f128(maxfloat_t val, char *buf)
 
 static void printval(maxfloat_t val, char *unit)
 {
-	if (val - (maxuint_t)val == 0) // NOLINT
-		printf("%40s %s\n", getstr_u128((maxuint_t)val, uint_buf), unit);
+	if (val < (maxfloat_t)(maxuint_t)-1 && val - (maxuint_t)val == 0) // NOLINT
+		fprintf(fout, "%40s %s\n", getstr_u128((maxuint_t)val, uint_buf), unit);
 	else
-		printf("%s %s\n", getstr_f128(val, float_buf), unit);
+		fprintf(fout, "%s %s\n", getstr_f128(val, float_buf), unit);
 }
 
 static void printhex_u128(maxuint_t n)
 {
-	ull high = (ull)(n >> (sizeof(maxuint_t) << 2));
+	char buf[HEX_BUF_LEN];
 
-	if (high)
-		printf("0x%llx%llx", high, (ull)n);
-	else
-		printf("0x%llx", (ull)n);
+	fprintf(fout, "%s", hexstr(n, buf));
 }
 
 /* This function adds check for binary input to strtoul() */
@@ -504,8 +811,8 @@ static maxuint_t strtouquad(char *token, char **pch)
 	}
 
 	char *ptr;
-	maxuint_t val = 0, prevval = 0;
-	uint base = 10, multiplier = 0, digit, bits_used = 0;
+	maxuint_t val = 0;
+	uint base = 10, multiplier = 0, digit;
 	uint max_bit_len = sizeof(maxuint_t) << 3;
 
 	if (token[0] == '0') {
@@ -533,14 +840,14 @@ static maxuint_t strtouquad(char *token, char **pch)
 			return 0;
 
 		while (*ptr) {
-			if (bits_used == max_bit_len || !ischarvalid(*ptr, base, &digit)) {
+			/* Fail if the next digit would shift out set bits */
+			if ((val >> (max_bit_len - multiplier)) || !ischarvalid(*ptr, base, &digit)) {
 				*pch = FAILED;
 				return 0;
 			}
 
 			val = (val << multiplier) + digit;
 
-			++bits_used;
 			++ptr;
 		}
 
@@ -561,70 +868,74 @@ static maxuint_t strtouquad(char *token, char **pch)
 			return 0;
 		}
 
-		val = (val * 10) + digit;
-
-		/* Try to to detect overflow */
-		if (val < prevval) {
+		/* Detect overflow */
+		if (__builtin_mul_overflow(val, 10, &val) ||
+		    __builtin_add_overflow(val, digit, &val)) {
 			*pch = FAILED;
 			return 0;
 		}
 
-		prevval = val;
 		++ptr;
 	}
 
 	return val;
 }
 
-static maxuint_t convertbyte(char *buf, int *ret)
+/* Print a byte count in IEC and SI units */
+static void printiecsi(maxfloat_t bytes)
 {
 	maxfloat_t val;
-	char *pch;
-	/* Convert and print in bytes (cannot be in float) */
-	maxuint_t bytes = strtouquad(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
 
 	/* Convert and print in IEC standard units */
 
-	printf("\n            IEC standard (base 2)\n\n");
-	val = (maxfloat_t)bytes / 1024;
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
+	val = bytes / 1024;
 	printval(val, "KiB");
 
-	val = (maxfloat_t)bytes / (1 << 20);
+	val = bytes / (1 << 20);
 	printval(val, "MiB");
 
-	val = (maxfloat_t)bytes / (1 << 30);
+	val = bytes / (1 << 30);
 	printval(val, "GiB");
 
-	val = (maxfloat_t)bytes / ((unsigned long long)1 << 40);
+	val = bytes / ((unsigned long long)1 << 40);
 	printval(val, "TiB");
 
 	/* Convert and print in SI standard values */
 
-	printf("\n            SI standard (base 10)\n\n");
-	val = (maxfloat_t)bytes / 1000;
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
+	val = bytes / 1000;
 	printval(val, "kB");
 
-	val = (maxfloat_t)bytes / 1000000;
+	val = bytes / 1000000;
 	printval(val, "MB");
 
-	val = (maxfloat_t)bytes / 1000000000;
+	val = bytes / 1000000000;
 	printval(val, "GB");
 
-	val = (maxfloat_t)bytes / 1000000000000;
+	val = bytes / 1000000000000;
 	printval(val, "TB");
+}
+
+static maxuint_t convertbyte(char *buf, int *ret)
+{
+	char *pch;
+	/* Convert and print in bytes (cannot be in float) */
+	maxuint_t bytes = strtouquad(buf, &pch);
+	if (*pch) {
+		*ret = -1;
+		return 0;
+	}
+
+	*ret = 0;
+
+	if (cfg.minimal) {
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
+		return bytes;
+	}
+
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
+	printiecsi((maxfloat_t)bytes);
 
 	return bytes;
 }
@@ -643,13 +954,13 @@ static maxuint_t convertkib(char *buf, int *ret)
 	maxuint_t bytes = (maxuint_t)(kib * 1024);
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	printval(kib, "KiB");
 
 	val = kib / 1024;
@@ -661,7 +972,7 @@ static maxuint_t convertkib(char *buf, int *ret)
 	val = kib / (1 << 30);
 	printval(val, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	val = kib * 1024 / 1000;
 	printval(val, "kB");
 
@@ -691,13 +1002,13 @@ static maxuint_t convertmib(char *buf, int *ret)
 	maxuint_t bytes = (maxuint_t)(mib * (1 << 20));
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	val = mib * 1024;
 	printval(val, "KiB");
 
@@ -709,7 +1020,7 @@ static maxuint_t convertmib(char *buf, int *ret)
 	val = mib / (1 << 20);
 	printval(val, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	val = mib * (1 << 20) / 1000;
 	printval(val, "kB");
 
@@ -739,13 +1050,13 @@ static maxuint_t convertgib(char *buf, int *ret)
 	maxuint_t bytes = (maxuint_t)(gib * (1 << 30));
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	val = gib * (1 << 20);
 	printval(val, "KiB");
 
@@ -757,7 +1068,7 @@ static maxuint_t convertgib(char *buf, int *ret)
 	val = gib / 1024;
 	printval(val, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	val = gib * (1 << 30) / 1000;
 	printval(val, "kB");
 
@@ -787,13 +1098,13 @@ static maxuint_t converttib(char *buf, int *ret)
 	maxuint_t bytes = (maxuint_t)(tib * ((maxuint_t)1 << 40));
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	val = tib * (1 << 30);
 	printval(val, "KiB");
 
@@ -805,7 +1116,7 @@ static maxuint_t converttib(char *buf, int *ret)
 
 	printval(tib, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	val = tib * ((maxuint_t)1 << 40) / 1000;
 	printval(val, "kB");
 
@@ -835,13 +1146,13 @@ static maxuint_t convertkb(char *buf, int *ret)
 	maxuint_t bytes = (maxuint_t)(kb * 1000);
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	val = kb * 1000 / 1024;
 	printval(val, "KiB");
 
@@ -854,7 +1165,7 @@ static maxuint_t convertkb(char *buf, int *ret)
 	val = kb * 1000 / ((maxuint_t)1 << 40);
 	printval(val, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	printval(kb, "kB");
 
 	val = kb / 1000;
@@ -883,13 +1194,13 @@ static maxuint_t convertmb(char *buf, int *ret)
 	maxuint_t bytes = (maxuint_t)(mb * 1000000);
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	val = mb * 1000000 / 1024;
 	printval(val, "KiB");
 
@@ -902,7 +1213,7 @@ static maxuint_t convertmb(char *buf, int *ret)
 	val = mb * 1000000 / ((maxuint_t)1 << 40);
 	printval(val, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	val = mb * 1000;
 	printval(val, "kB");
 
@@ -931,13 +1242,13 @@ static maxuint_t convertgb(char *buf, int *ret)
 	maxuint_t bytes = (maxuint_t)(gb * 1000000000);
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	val = gb * 1000000000 / 1024;
 	printval(val, "KiB");
 
@@ -950,7 +1261,7 @@ static maxuint_t convertgb(char *buf, int *ret)
 	val = gb * 1000000000 / ((maxuint_t)1 << 40);
 	printval(val, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	val = gb * 1000000;
 	printval(val, "kB");
 
@@ -979,13 +1290,13 @@ static maxuint_t converttb(char *buf, int *ret)
 	maxuint_t bytes = (__uint128_t)(tb * 1000000000000);
 
 	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
+		fprintf(fout, "%s B\n", getstr_u128(bytes, uint_buf));
 		return bytes;
 	}
 
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
+	fprintf(fout, "%40s B\n", getstr_u128(bytes, uint_buf));
 
-	printf("\n            IEC standard (base 2)\n\n");
+	fprintf(fout, "\n            IEC standard (base 2)\n\n");
 	val = tb * 1000000000000 / 1024;
 	printval(val, "KiB");
 
@@ -998,7 +1309,7 @@ static maxuint_t converttb(char *buf, int *ret)
 	val = tb * 1000000000000 / ((maxuint_t)1 << 40);
 	printval(val, "TiB");
 
-	printf("\n            SI standard (base 10)\n\n");
+	fprintf(fout, "\n            SI standard (base 10)\n\n");
 	val = tb * 1000000000;
 	printval(val, "kB");
 
@@ -1085,8 +1396,8 @@ static bool chs2lba(char *chs, maxuint_t *lba)
 
 	*lba += param[2] - 1; /* S - 1 */
 
-	printf("\033[1mCHS2LBA\033[0m\n");
-	printf("  C:%lu  H:%lu  S:%lu  MAX_HEAD:%lu  MAX_SECTOR:%lu\n",
+	fprintf(fout, "\033[1mCHS2LBA\033[0m\n");
+	fprintf(fout, "  C:%lu  H:%lu  S:%lu  MAX_HEAD:%lu  MAX_SECTOR:%lu\n",
 		param[0], param[1], param[2], param[3], param[4]);
 
 	return true;
@@ -1157,17 +1468,18 @@ static bool lba2chs(char *lba, t_chs *p_chs)
 		return false;
 	}
 
-	printf("\033[1mLBA2CHS\033[0m\n  LBA:%s  ",
+	fprintf(fout, "\033[1mLBA2CHS\033[0m\n  LBA:%s  ",
 		getstr_u128(param[0], uint_buf));
-	printf("MAX_HEAD:%s  ", getstr_u128(param[1], uint_buf));
-	printf("MAX_SECTOR:%s\n", getstr_u128(param[2], uint_buf));
+	fprintf(fout, "MAX_HEAD:%s  ", getstr_u128(param[1], uint_buf));
+	fprintf(fout, "MAX_SECTOR:%s\n", getstr_u128(param[2], uint_buf));
 
 	return true;
 }
 
+#ifndef BCAL_BUILTIN
 static void show_basic_sizes()
 {
-	printf("---------------\n Storage sizes\n---------------\n"
+	fprintf(fout, "---------------\n Storage sizes\n---------------\n"
 		"char       : %lu\n"
 		"short      : %lu\n"
 		"int        : %lu\n"
@@ -1194,7 +1506,7 @@ static void show_basic_sizes()
 
 static void prompt_help()
 {
-	printf("prompt keys:\n\
+	fprintf(fout, "prompt keys:\n\
  b          toggle bc mode\n\
  r          show result from last operation\n\
  s          show sizes of storage types\n\
@@ -1204,32 +1516,106 @@ static void prompt_help()
 
 static void usage()
 {
-	printf("usage: bcal [-c N] [-f loc] [-s bytes] [expr]\n\
-            [N [unit]] [-b [expr]] [-m] [-d] [-h]\n\n\
+	fprintf(fout, "usage: bcal [-c N] [-f loc] [-s bytes] [expr]\n\
+            [N [unit]] [-b [expr]] [-m] [-d] [-h]\n\
+            [--stream [file ...]]\n\
+            [--aggregate [--field N] [file ...]]\n\
+            [--quantile [--field N] [file ...]]\n\
+            [--scan [--aggregate|--quantile] [file ...]]\n\
+            [-j N] [--files-from list] [--binary FMT]\n\
+            [--lba [--dual] [--field N] [file ...]]\n\
+            [--chs2lba|--lba2chs [--geometry MH-MS]\n\
+             [--raw] [file ...]]\n\
+            [--part image ...]\n\
+            [--align N [--raw] [--field N] [file ...]]\n\
+            [--ranges [--sectors] [--intersect] [file ...]]\n\
+            [--sort [--field N] [file ...]]\n\
+            [--seq [--format F] START END STEP]\n\
+            [--serve sock] [--client sock args ...]\n\
+            [--coproc] [--shm name [--backoff SPINS-US]]\n\
+            [--stats]\n\n\
 Storage expression calculator.\n\n\
 positional arguments:\n\
  expr       expression in decimal/hex operands\n\
+            or sum/min/max/avg(list or @file)\n\
  N [unit]   capacity in B/KiB/MiB/GiB/TiB/kB/MB/GB/TB\n\
             https://en.wikipedia.org/wiki/Binary_prefix\n\
             default unit is B (byte), case is ignored\n\
             N can be decimal or '0x' prefixed hex value\n\n\
 optional arguments:\n\
  -c N       show +ve integer N in binary, decimal, hex\n\
+            N = '-' converts values in stdin, one per line\n\
  -f loc     convert CHS to LBA or LBA to CHS\n\
             refer to the operational notes in man page\n\
  -s bytes   sector size [default 512]\n\
  -b [expr]  enter bc mode or evaluate expression in bc\n\
  -m         show minimal output (e.g. decimal bytes)\n\
+ --stream   evaluate expressions from files or stdin\n\
+            separated by newline or ';', show terms/s\n\
+ --aggregate\n\
+            total, min, max and power of 2 histogram\n\
+            of sizes in a column of files or stdin\n\
+ --quantile aggregate and show p50, p90, p99, p999\n\
+            within 1/256 of the exact value\n\
+ --field N  column of input for --aggregate,\n\
+            --lba, --align and --sort [default 1]\n\
+ --scan     extract sizes with a unit or 0x prefix\n\
+            from text, aggregate with --aggregate\n\
+ -j N       aggregate with N threads [default 1]\n\
+            0 uses all processors\n\
+ --files-from list\n\
+            read more input files from list, one per\n\
+            line, '-' is stdin\n\
+ --lba      show LBA:OFFSET of byte addresses in a\n\
+            column of files or stdin, one per line\n\
+ --dual     show 512e and 4Kn LBA:OFFSET with --lba\n\
+ --chs2lba  convert C,H,S[,MH,MS] records to LBA\n\
+ --lba2chs  convert LBA[,MH,MS] records to C,H,S\n\
+ --geometry MH-MS\n\
+            default MAX_HEAD and MAX_SECTOR [16-63]\n\
+ --raw      records are little-endian 64-bit words\n\
+ --binary FMT\n\
+            input is an array of u32, u64 or u128\n\
+            with le or be suffix [default le], for\n\
+            --aggregate, --quantile, --align, --lba\n\
+            and CHS; --raw is u64le\n\
+ --part     show MBR or GPT partitions of images\n\
+            in -s sectors, flag misaligned ones\n\
+ --align N  show offsets in a column of files or stdin\n\
+            which are not multiples of N\n\
+ --ranges   merge START+LEN ranges of files or stdin,\n\
+            show coverage and gaps\n\
+ --sectors  plain range values are in -s sectors\n\
+ --intersect\n\
+            show the overlap of ranges in 2 files\n\
+ --sort     sort lines of files or stdin by the size\n\
+            in a column, with the unit rules\n\
+ --seq      show offsets from START to END by STEP\n\
+ --format F dec, hex, lba (LBA:OFFSET) or bin for\n\
+            --seq [default dec]\n\
+ --serve sock\n\
+            evaluate requests on Unix socket sock\n\
+ --client sock args ...\n\
+            evaluate args on the --serve server\n\
+ --coproc   evaluate NUL terminated requests from\n\
+            stdin, for use as a coprocess\n\
+ --shm name poll request rings in shared memory name\n\
+ --backoff SPINS-US\n\
+            polls to spin before sleeping, max sleep\n\
+            in microseconds for --shm [10000-1000]\n\
+ --stats    show timings and allocations of the\n\
+            evaluation phases on exit or SIGUSR1\n\
  -d         enable debug information and logs\n\
  -h         show this help\n\n");
 
 	prompt_help();
 
-	printf("\nVersion %s\n\
+	fprintf(fout, "\nVersion %s\n\
 Copyright © 2016 Arun Prakash Jana <engineerarun@gmail.com>\n\
 License: GPLv3\n\
 Webpage: https://github.com/jarun/bcal\n", VERSION);
 }
+#endif
 
 static int bstricmp(const char *s1, const char *s2)
 {
@@ -1240,101 +1626,414 @@ static int bstricmp(const char *s1, const char *s2)
 	return *(const unsigned char *)s1 - *(const unsigned char *)s2;
 }
 
-/* Convert any unit in bytes
- * Failure if out parameter holds -1
+/*
+ * Overflow-checked arithmetic used by eval()
+ * Operands which fit in 64 bits are computed natively. An operation is
+ * promoted to maxuint_t only if the 64-bit result overflows.
+ * Returns false if the result does not fit in maxuint_t.
  */
-static maxuint_t unitconv(Data bunit, char *isunit, int *out)
+static bool add_u(maxuint_t a, maxuint_t b, maxuint_t *c)
 {
-	/* Data is a C structure containing a string p and a char
-	 * indicating if the string is a unit or a plain number
-	 */
-	char *numstr = bunit.p, *punit = NULL;
-	int  count;
-	maxfloat_t byte_metric = 0;
+	ull r;
 
-	if (numstr == NULL || *numstr == '\0') {
-		log(ERROR, "invalid token\n");
-		*out = -1;
-		return 0;
+	if (FITS_U64(a) && FITS_U64(b) && !__builtin_add_overflow((ull)a, (ull)b, &r)) {
+		*c = r;
+		return true;
 	}
 
-	log(DEBUG, "numstr: %s\n", numstr);
-	*out = 0;
-
-	/* ensure this is not the result of a previous operation */
-	if (*isunit != 1)
-		*isunit = 0;
+	return !__builtin_add_overflow(a, b, c);
+}
 
-	byte_metric = strtold(numstr, &punit);
-	log(DEBUG, "byte_metric: %Lf\n", byte_metric);
-	if (*numstr != '\0' && *punit == '\0')
-		return (maxuint_t)byte_metric;
+static bool mul_u(maxuint_t a, maxuint_t b, maxuint_t *c)
+{
+	ull r;
 
-	log(DEBUG, "punit: %s\n", punit);
+	if (FITS_U64(a) && FITS_U64(b)) {
+		if (!__builtin_mul_overflow((ull)a, (ull)b, &r)) {
+			*c = r;
+			return true;
+		}
+#ifdef __SIZEOF_INT128__
+		/* A 64x64-bit product always fits in 128 bits */
+		*c = (maxuint_t)(ull)a * (ull)b;
+		return true;
+#endif
+	}
 
-	count = ARRAY_SIZE(units);
-	while (--count >= 0)
-		if (!bstricmp(units[count], punit))
-			break;
+	return !__builtin_mul_overflow(a, b, c);
+}
 
-	if (count == -1) {
-		if (cfg.minimal)
-			log(ERROR, "unknown unit\n");
-		else
-			try_bc(NULL);
+static maxuint_t div_u(maxuint_t a, maxuint_t b)
+{
+	if (FITS_U64(a) && FITS_U64(b))
+		return (ull)a / (ull)b;
 
-		*out = -1;
-		return 0;
-	}
+	return a / b;
+}
 
-	*isunit = 1;
+static maxuint_t mod_u(maxuint_t a, maxuint_t b)
+{
+	if (FITS_U64(a) && FITS_U64(b))
+		return (ull)a % (ull)b;
 
-	switch (count) {
-	case 0:
-		return (maxuint_t)byte_metric;
-	case 1: /* Kibibyte */
-		return (maxuint_t)(byte_metric * 1024);
-	case 2: /* Mebibyte */
-		return (maxuint_t)(byte_metric * (1 << 20));
-	case 3: /* Gibibyte */
-		return (maxuint_t)(byte_metric * (1 << 30));
-	case 4: /* Tebibyte */
-		return (maxuint_t)(byte_metric * ((maxuint_t)1 << 40));
-	case 5: /* Kilobyte */
-		return (maxuint_t)(byte_metric * 1000);
-	case 6: /* Megabyte */
-		return (maxuint_t)(byte_metric * 1000000);
-	case 7: /* Gigabyte */
-		return (maxuint_t)(byte_metric * 1000000000);
-	case 8: /* Terabyte */
-		return (maxuint_t)(byte_metric * 1000000000000);
-	default:
-		log(ERROR, "unknown unit\n");
-		*out = -1;
-		return 0;
-	}
+	return a % b;
 }
 
-/* Get the priority of operators.
- * Higher priority, higher value.
- */
-static int priority(char sign) /* Get the priority of operators, higher priprity */
+static bool shl_u(maxuint_t a, maxuint_t b, maxuint_t *c)
 {
-	switch (sign) {
-	case '|': return 1;
-	case '^': return 2;
-	case '&': return 3;
-	case '>':
-	case '<': return 4;
-	case '-':
-	case '+': return 5;
-	case '%':
-	case '/':
-	case '*': return 6;
-	default : return 0;
+	if (!a) {
+		*c = 0;
+		return true;
 	}
 
-	return 0;
+	if (b >= UINT_BITS)
+		return false;
+
+	if (FITS_U64(a) && b < 64 && !((ull)a >> (63 - (uint)b) >> 1)) {
+		*c = (ull)a << (uint)b;
+		return true;
+	}
+
+	*c = a << (uint)b;
+	return (*c >> (uint)b) == a;
+}
+
+static maxuint_t shr_u(maxuint_t a, maxuint_t b)
+{
+	if (b >= UINT_BITS)
+		return 0;
+
+	if (FITS_U64(a))
+		return (ull)a >> (uint)b;
+
+	return a >> (uint)b;
+}
+
+/* Index of unit in units[], -1 if unknown */
+static int unitidx(const char *unit)
+{
+	int count = ARRAY_SIZE(units);
+
+	while (--count >= 0)
+		if (!bstricmp(units[count], unit))
+			break;
+
+	return count;
+}
+
+/*
+ * Converts a number with an optional unit suffix (e.g. "1.5GiB") to bytes
+ * The unit can also be passed separately in unit, else it must be NULL.
+ * isunit is set if a unit is specified.
+ * Returns:
+ *  0 - success
+ * -1 - malformed number or unknown unit
+ * -2 - overflow
+ */
+static int strtosize(char *numstr, const char *unit, maxuint_t *val, char *isunit)
+{
+	char *punit, intbuf[NUM_LEN];
+	int count = 0;
+	size_t len;
+	maxfloat_t byte_metric;
+
+	*isunit = 0;
+
+	/* Fast path for decimal integers with an optional unit suffix */
+	if (isdigit((int)numstr[0]) && !(numstr[0] == '0' && isalpha((int)numstr[1]))) {
+		maxuint_t acc = 0;
+
+		for (punit = numstr; isdigit((int)*punit); ++punit)
+			if (!mul_u(acc, 10, &acc) || !add_u(acc, (uint)(*punit - '0'), &acc))
+				return -2;
+
+		if (!*punit && !unit) {
+			*val = acc;
+			return 0;
+		}
+
+		count = (*punit) ? (unit ? -1 : unitidx(punit)) : unitidx(unit);
+		if (count != -1) {
+			*isunit = 1;
+			return mul_u(acc, unitsz[count], val) ? 0 : -2;
+		}
+	}
+
+	/* Integers are converted exactly, without a long double round trip */
+	*val = strtouquad(numstr, &punit);
+	if (!*punit && !unit)
+		return 0;
+
+	byte_metric = strtold(numstr, &punit);
+	log(DEBUG, "byte_metric: %Lf\n", byte_metric);
+	if (punit == numstr || byte_metric < 0 || isnan(byte_metric))
+		return -1;
+
+	if (*punit) {
+		if (unit)
+			return -1;
+
+		unit = punit;
+	}
+
+	if (unit) {
+		log(DEBUG, "punit: %s\n", unit);
+
+		count = unitidx(unit);
+		if (count == -1)
+			return -1;
+
+		*isunit = 1;
+	}
+
+	/* Integer quantities are scaled exactly */
+	len = (size_t)(punit - numstr);
+	if (len < sizeof(intbuf)) {
+		memcpy(intbuf, numstr, len);
+		intbuf[len] = '\0';
+
+		*val = strtouquad(intbuf, &punit);
+		if (!*punit)
+			return mul_u(*val, unitsz[count], val) ? 0 : -2;
+	}
+
+	/* Truncate fractional bytes */
+	byte_metric *= unitsz[count];
+	if (byte_metric >= (maxfloat_t)(maxuint_t)-1)
+		return -2;
+
+	*val = (maxuint_t)byte_metric;
+	return 0;
+}
+
+/* Convert any unit in bytes
+ * Failure if out parameter holds -1
+ */
+static maxuint_t unitconv(Data bunit, char *isunit, int *out)
+{
+	/* Data is a C structure containing a string p and a char
+	 * indicating if the string is a unit or a plain number
+	 */
+	char *numstr = bunit.p, unit;
+	maxuint_t val;
+	int ret;
+
+	if (numstr == NULL || *numstr == '\0') {
+		log(ERROR, "invalid token\n");
+		*out = -1;
+		return 0;
+	}
+
+	log(DEBUG, "numstr: %s\n", numstr);
+	*out = 0;
+
+	STATS_TIME(ST_UNITCONV, ret = strtosize(numstr, NULL, &val, &unit));
+
+	switch (ret) {
+	case 0:
+		/* ensure this is not the result of a previous operation */
+		if (unit)
+			*isunit = 1;
+		else if (*isunit != 1)
+			*isunit = 0;
+
+		return val;
+	case -2:
+		log(ERROR, "token overflow\n");
+		break;
+	default:
+		if (cfg.minimal)
+			log(ERROR, "unknown unit\n");
+		else
+			try_bc(NULL);
+	}
+
+	*out = -1;
+	return 0;
+}
+
+/* Named variable, name is interned in the table */
+typedef struct {
+	char *name; /* NULL if the slot is free */
+	uint len;
+	uint hash;
+	t_val val;  /* for the stream evaluator */
+	bool exact; /* val holds the value, false if it exceeds maxuint_t */
+	Data d;     /* for the postfix evaluator */
+} t_var;
+
+/* Open-addressing hash table with linear probing */
+typedef struct {
+	t_var *slots;
+	uint cap;   /* power of 2 */
+	uint count;
+} t_symtab;
+
+static t_symtab symtab;
+
+/* Length of the identifier at the start of s, 0 if none */
+static size_t identlen(const char *s)
+{
+	size_t len = 0;
+
+	if (!isalpha((int)*s) && *s != '_')
+		return 0;
+
+	while (isalnum((int)s[len]) || s[len] == '_')
+		++len;
+
+	return len;
+}
+
+/* FNV-1a */
+static uint symhash(const char *name, size_t len)
+{
+	uint hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (uchar)*name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Slot holding name or the free slot where it belongs */
+static t_var *sym_slot(t_var *slots, uint cap, const char *name, uint len, uint hash)
+{
+	uint mask = cap - 1;
+
+	for (uint i = hash & mask;; i = (i + 1) & mask) {
+		t_var *var = &slots[i];
+
+		if (!var->name || (var->hash == hash && var->len == len &&
+				   !memcmp(var->name, name, len)))
+			return var;
+	}
+}
+
+static t_var *sym_get(const char *name, size_t len)
+{
+	t_var *var;
+
+	if (!symtab.count)
+		return NULL;
+
+	var = sym_slot(symtab.slots, symtab.cap, name, (uint)len, symhash(name, len));
+	return var->name ? var : NULL;
+}
+
+/* Is s a reference to a defined variable? */
+static bool isvarref(const char *s)
+{
+	size_t len = identlen(s);
+
+	return len && sym_get(s, len);
+}
+
+/* Keep the load factor at most 1/2 */
+static bool sym_grow(void)
+{
+	uint cap = symtab.cap ? symtab.cap << 1 : 16;
+	t_var *slots = (t_var *)mem_calloc(cap, sizeof(t_var));
+
+	if (!slots) {
+		log(ERROR, "out of memory\n");
+		return false;
+	}
+
+	for (uint i = 0; i < symtab.cap; ++i)
+		if (symtab.slots[i].name)
+			*sym_slot(slots, cap, symtab.slots[i].name, symtab.slots[i].len,
+				  symtab.slots[i].hash) = symtab.slots[i];
+
+	free(symtab.slots);
+	symtab.slots = slots;
+	symtab.cap = cap;
+	return true;
+}
+
+/* Store a value in variable name, defining it if required */
+static int sym_set(const char *name, size_t len, const Data *d)
+{
+	t_var *var;
+	uint hash = symhash(name, len);
+	char *pch;
+
+	if ((len == 1 && *name == 'r') || len >= NUM_LEN) {
+		log(ERROR, "invalid variable name\n");
+		return -1;
+	}
+
+	/* Unit names are reserved */
+	char buf[NUM_LEN];
+
+	memcpy(buf, name, len);
+	buf[len] = '\0';
+	if (unitidx(buf) != -1) {
+		log(ERROR, "invalid variable name\n");
+		return -1;
+	}
+
+	if ((symtab.count + 1) << 1 > symtab.cap && !sym_grow())
+		return -1;
+
+	var = sym_slot(symtab.slots, symtab.cap, name, (uint)len, hash);
+	if (!var->name) {
+		var->name = mem_strdup(buf);
+		if (!var->name) {
+			log(ERROR, "out of memory\n");
+			return -1;
+		}
+
+		var->len = (uint)len;
+		var->hash = hash;
+		++symtab.count;
+	}
+
+	var->d = *d;
+	var->val.v = strtouquad(var->d.p, &pch);
+	var->val.unit = var->d.unit;
+	var->exact = !*pch;
+	log(DEBUG, "%s = %s %d\n", var->name, var->d.p, var->d.unit);
+
+	return 0;
+}
+
+/* Length of the variable name if s is an assignment, e.g. "disk = 4TiB" */
+static size_t isassign(const char *s)
+{
+	size_t len = identlen(s), i = len;
+
+	if (!len)
+		return 0;
+
+	while (isspace((int)s[i]))
+		++i;
+
+	return (s[i] == '=' && s[i + 1] != '=') ? len : 0;
+}
+
+/* Get the priority of operators.
+ * Higher priority, higher value.
+ */
+static int priority(char sign) /* Get the priority of operators, higher priprity */
+{
+	switch (sign) {
+	case '|': return 1;
+	case '^': return 2;
+	case '&': return 3;
+	case '>':
+	case '<': return 4;
+	case '-':
+	case '+': return 5;
+	case '%':
+	case '/':
+	case '*': return 6;
+	default : return 0;
+	}
+
+	return 0;
 }
 
 /* Convert Infix mathematical expression to Postfix */
@@ -1345,6 +2044,7 @@ static int infix2postfix(char *exp, queue **resf, queue **resr)
 	static Data tokenData, ct;
 	int balanced = 0;
 	bool tokenize = true;
+	t_var *var;
 
 	tokenData.p[0] = '\0';
 	tokenData.unit = 0;
@@ -1398,16 +2098,25 @@ static int infix2postfix(char *exp, queue **resf, queue **resr)
 			--balanced;
 			break;
 		case 'r':
-			if (lastres.p[0] == '\0') {
-				log(ERROR, "no result stored\n");
-				emptystack(&op);
-				cleanqueue(resf);
-				return -1;
-			}
+			if (token[1] == '\0') {
+				if (lastres.p[0] == '\0') {
+					log(ERROR, "no result stored\n");
+					emptystack(&op);
+					cleanqueue(resf);
+					return -1;
+				}
 
-			enqueue(resf, resr, lastres);
-			break;
+				enqueue(resf, resr, lastres);
+				break;
+			} // fallthrough
 		default:
+			/* Variables are replaced by their values */
+			var = sym_get(token, strlen(token));
+			if (var) {
+				enqueue(resf, resr, var->d);
+				break;
+			}
+
 			/*
 			 * Check if unit is specified
 			 * This also guards against a case of 0xn b
@@ -1462,11 +2171,11 @@ static int validate_div(maxuint_t dividend, maxuint_t divisor, maxuint_t quotien
 
 		if (cfg.loglvl == DEBUG) {
 			printhex_u128(dividend);
-			printf(" (dividend)\n");
+			fprintf(fout, " (dividend)\n");
 			printhex_u128(divisor);
-			printf(" (divisor)\n");
+			fprintf(fout, " (divisor)\n");
 			printhex_u128(quotient);
-			printf(" (quotient)\n");
+			fprintf(fout, " (quotient)\n");
 		}
 
 		return -1;
@@ -1475,160 +2184,181 @@ static int validate_div(maxuint_t dividend, maxuint_t divisor, maxuint_t quotien
 	return 0;
 }
 
-/* Evaluates Postfix Expression
- * Numeric result if out parameter holds 1
- * Failure if out parameter holds -1
+/*
+ * Applies the unit rules of operator op to operands with unit flags ua and ub
+ * Returns the unit flag of the result or -1 on mismatch
  */
-static maxuint_t eval(queue **front, queue **rear, int *out)
+static int opunit(char op, char ua, char ub)
 {
-	stack *est = NULL;
-	Data res, arg, raw_a, raw_b, raw_c;
-	*out = 0;
-	maxuint_t a, b, c;
+	switch (op) {
+	case '>':
+	case '<':
+		if (!ub)
+			return ua;
 
-	/* Check if queue is empty */
-	if (*front == NULL)
-		return 0;
+		log(ERROR, "unit mismatch in %c%c\n", op, op);
+		return -1;
+	case '+':
+	case '-':
+	case '&':
+	case '|':
+	case '^':
+		if (ua == ub)
+			return ua;
 
-	/* Check if only one element in the queue */
-	if (*front == *rear) {
-		char unit = 0;
+		log(ERROR, "unit mismatch in %c\n", op);
+		return -1;
+	case '*':
+		/* Check if only one is unit */
+		if (!(ua && ub))
+			return ua || ub;
 
-		dequeue(front, rear, &res);
-		return unitconv(res, &unit, out);
-	}
+		log(ERROR, "unit mismatch in *\n");
+		return -1;
+	case '/':
+		if (ua && ub)
+			return 0;
 
-	while (*front) {
-		dequeue(front, rear, &arg);
+		if (!ub)
+			return ua;
 
-		/* Check if arg is an operator */
-		if (strlen(arg.p) == 1 && !isdigit((int)arg.p[0])) {
-			pop(&est, &raw_b);
-			pop(&est, &raw_a);
+		log(ERROR, "unit mismatch in /\n");
+		return -1;
+	case '%':
+		if (!(ua || ub))
+			return 0;
 
-			b = unitconv(raw_b, &raw_b.unit, out);
-			if (*out == -1)
-				return 0;
-			a = unitconv(raw_a, &raw_a.unit, out);
-			if (*out == -1)
-				return 0;
+		log(ERROR, "unit mismatch in modulo\n");
+		return -1;
+	default:
+		return -1;
+	}
+}
 
-			log(DEBUG, "(%s, %d) %c (%s, %d)\n",
-			    raw_a.p, raw_a.unit, arg.p[0], raw_b.p, raw_b.unit);
+/*
+ * Applies operator op to operands x and y, the result is saved in x
+ * Returns -1 on failure
+ */
+static int applyop(char op, t_val *x, const t_val *y)
+{
+	maxuint_t a = x->v, b = y->v, c = 0;
+	int unit;
 
-			c = 0;
-			raw_c.unit = 0;
+	if ((op == '/' || op == '%') && b == 0) {
+		log(ERROR, "division by 0\n");
+		return -1;
+	}
 
-			switch (arg.p[0]) {
-			case '>':
-			case '<':
-				if (raw_b.unit) {
-					log(ERROR, "unit mismatch in %c%c\n", arg.p[0], arg.p[0]);
-					goto error;
-				}
+	unit = opunit(op, x->unit, y->unit);
+	if (unit == -1)
+		return -1;
 
-				if (arg.p[0] == '>')
-					c = a >> b;
-				else
-					c = a << b;
-				raw_c.unit = raw_a.unit;
-				break;
-			case '+':
-			case '&':
-			case '|':
-			case '^':
-				/* Check if the units match */
-				if (raw_a.unit == raw_b.unit) {
-					switch (arg.p[0]) {
-					case '+':
-						c = a + b;
-						break;
-					case '&':
-						c = a & b;
-						break;
-					case '|':
-						c = a | b;
-						break;
-					case '^':
-						c = a ^ b;
-						break;
-					default:
-						break;
-					}
+	switch (op) {
+	case '>':
+		c = shr_u(a, b);
+		break;
+	case '<':
+		if (!shl_u(a, b, &c)) {
+			log(ERROR, "overflow in <<\n");
+			return -1;
+		}
+		break;
+	case '+':
+		if (!add_u(a, b, &c)) {
+			log(ERROR, "overflow in +\n");
+			return -1;
+		}
+		break;
+	case '&':
+		c = a & b;
+		break;
+	case '|':
+		c = a | b;
+		break;
+	case '^':
+		c = a ^ b;
+		break;
+	case '-':
+		if (b > a) {
+			log(ERROR, "negative result\n");
+			return -1;
+		}
 
-					if (raw_a.unit)
-						raw_c.unit = 1;
-					break;
-				}
+		c = a - b;
+		break;
+	case '*':
+		if (!mul_u(a, b, &c)) {
+			log(ERROR, "overflow in *\n");
+			return -1;
+		}
+		break;
+	case '/':
+		c = div_u(a, b);
+		validate_div(a, b, c);
+		break;
+	default: /* '%' */
+		c = mod_u(a, b);
+		break;
+	}
 
-				log(ERROR, "unit mismatch in %c\n", arg.p[0]);
-				goto error;
-			case '-':
-				/* Check if the units match */
-				if (raw_a.unit == raw_b.unit) {
-					if (b > a) {
-						log(ERROR, "negative result\n");
-						goto error;
-					}
+	x->v = c;
+	x->unit = (char)unit;
+	return 0;
+}
 
-					c = a - b;
-					if (raw_a.unit)
-						raw_c.unit = 1;
-					break;
-				}
+/* Evaluates Postfix Expression
+ * Numeric result if out parameter holds 1
+ * Failure if out parameter holds -1
+ */
+static maxuint_t eval(queue **front, queue **rear, int *out)
+{
+	stack *est = NULL;
+	Data res, arg, raw_a, raw_b, raw_c;
+	*out = 0;
+	maxuint_t a, b, c;
+	char *pch;
+	t_val va, vb;
 
-				log(ERROR, "unit mismatch in -\n");
-				goto error;
-			case '*':
-				/* Check if only one is unit */
-				if (!(raw_a.unit && raw_b.unit)) {
-					c = a * b;
-					if (raw_a.unit || raw_b.unit)
-						raw_c.unit = 1;
-					break;
-				}
+	/* Check if queue is empty */
+	if (*front == NULL)
+		return 0;
 
-				log(ERROR, "unit mismatch in *\n");
-				goto error;
-			case '/':
-				if (b == 0) {
-					log(ERROR, "division by 0\n");
-					goto error;
-				}
+	/* Check if only one element in the queue */
+	if (*front == *rear) {
+		char unit = 0;
 
-				if (raw_a.unit && raw_b.unit) {
-					c = a / b;
+		dequeue(front, rear, &res);
+		return unitconv(res, &unit, out);
+	}
 
-					validate_div(a, b, c);
-					break;
-				}
+	while (*front) {
+		dequeue(front, rear, &arg);
 
-				if (!raw_b.unit) {
-					c = a / b;
-					if (raw_a.unit)
-						raw_c.unit = 1;
+		/* Check if arg is an operator */
+		if (strlen(arg.p) == 1 && !isdigit((int)arg.p[0])) {
+			pop(&est, &raw_b);
+			pop(&est, &raw_a);
 
-					validate_div(a, b, c);
-					break;
-				}
+			b = unitconv(raw_b, &raw_b.unit, out);
+			if (*out == -1)
+				return 0;
+			a = unitconv(raw_a, &raw_a.unit, out);
+			if (*out == -1)
+				return 0;
 
-				log(ERROR, "unit mismatch in /\n");
-				goto error;
-			case '%':
-				if (b == 0) {
-					log(ERROR, "division by 0\n");
-					goto error;
-				}
+			log(DEBUG, "(%s, %d) %c (%s, %d)\n",
+			    raw_a.p, raw_a.unit, arg.p[0], raw_b.p, raw_b.unit);
 
-				if (!(raw_a.unit || raw_b.unit)) {
-					c = a % b;
-					break;
-				}
+			va.v = a;
+			va.unit = raw_a.unit;
+			vb.v = b;
+			vb.unit = raw_b.unit;
 
-				log(ERROR, "unit mismatch in modulo\n"); // fallthrough
-			default:
+			if (applyop(arg.p[0], &va, &vb) == -1)
 				goto error;
-			}
+
+			c = va.v;
+			raw_c.unit = va.unit;
 
 			/* Convert to string */
 			bstrlcpy(raw_c.p, getstr_u128(c, uint_buf), NUM_LEN);
@@ -1655,7 +2385,13 @@ static maxuint_t eval(queue **front, queue **rear, int *out)
 		*out = 1;
 
 	/* Convert string to integer */
-	return strtoull(res.p, NULL, 0);
+	c = strtouquad(res.p, &pch);
+	if (*pch) {
+		log(ERROR, "invalid expression\n");
+		goto error;
+	}
+
+	return c;
 
 error:
 	*out = -1;
@@ -1766,9 +2502,13 @@ static void removeinnerspaces(char *s)
 
 /* Make the expression compatible with parsing by
  * inserting/removing space between arguments
+ * The result is valid until the next call.
  */
 static char *fixexpr(char *exp, int *unitless)
 {
+	static char *parsed;
+	static size_t parsedlen;
+
 	*unitless = 0;
 
 	strstrip(exp);
@@ -1783,47 +2523,61 @@ static char *fixexpr(char *exp, int *unitless)
 	*/
 
 	int i = 0, j = 0;
-	char *parsed = (char *)calloc(1, 2 * strlen(exp) * sizeof(char));
+	size_t len = 2 * strlen(exp);
 	char prev = '(';
 
+	/* Grows to the longest expression and is reused */
+	if (len < NUM_LEN)
+		len = NUM_LEN;
+
+	if (len > parsedlen) {
+		char *tmp = (char *)mem_realloc(parsed, len);
+
+		if (!tmp) {
+			log(ERROR, "out of memory\n");
+			return NULL;
+		}
+
+		parsed = tmp;
+		parsedlen = len;
+	}
+
+	memset(parsed, 0, len);
+
 	log(DEBUG, "exp (%s)\n", exp);
 
 	while (exp[i] != '\0') {
 		if (exp[i] == '{' || exp[i] == '}' || exp[i] == '[' || exp[i] == ']') {
 			log(ERROR, "first brackets only\n");
-			free(parsed);
 			return NULL;
 		}
 
 		if (exp[i] == '-' && (issign(prev) || prev == '(')) {
 			log(ERROR, "negative token\n");
-			free(parsed);
 			return NULL;
 		}
 
-		if (isoperator((int)exp[i]) && isalpha((int)exp[i + 1]) && (exp[i + 1] != 'r')) {
+		if (isoperator((int)exp[i]) && isalpha((int)exp[i + 1]) && (exp[i + 1] != 'r') &&
+		    !isvarref(exp + i + 1)) {
 			log(ERROR, "invalid expression\n");
-			free(parsed);
 			return NULL;
 		}
 
 		if ((isdigit((int)exp[i]) && isoperator((int)exp[i + 1])) ||
 		    (isoperator((int)exp[i]) && (isdigit((int)exp[i + 1]) ||
 		     isoperator((int)exp[i + 1]))) ||
-		    (isalpha((int)exp[i]) && isoperator((int)exp[i + 1])) ||
-		    (isoperator((int)exp[i]) && ((int)exp[i + 1] == 'r'))) {
+		    ((isalpha((int)exp[i]) || exp[i] == '_') && isoperator((int)exp[i + 1])) ||
+		    (isoperator((int)exp[i]) && ((int)exp[i + 1] == 'r' || isvarref(exp + i + 1)))) {
 			if (exp[i] == '<' || exp[i] == '>') { /* handle shift operators << and >> */
 				if (prev != exp[i] && exp[i] != exp[i + 1]) {
 					log(ERROR, "invalid operator %c\n", exp[i]);
 					*unitless = 0;
-					free(parsed);
 					return NULL;
 				}
 
 				if (prev == exp[i + 1]) { /* handle <<< or >>> */
 					log(ERROR, "invalid sequence %c%c%c\n", prev, exp[i], exp[i + 1]);
 					*unitless = 0;
-					free(parsed);
 					return NULL;
 				}
 
@@ -1860,7 +2614,6 @@ loop_end:
 
 	if (!parsed[i]) {
 		log(DEBUG, "no operator in expression [%s]\n", parsed);
-		free(parsed);
 		*unitless = 1;
 		return NULL;
 	}
@@ -1890,205 +2643,6408 @@ static int convertunit(char *value, char *unit, ulong sectorsz)
 			--len;
 		}
 
-		if (unitchars) {
-			while (--count >= 0)
-				if (!bstricmp(units[count], value + len))
-					break;
+		if (unitchars) {
+			while (--count >= 0)
+				if (!bstricmp(units[count], value + len))
+					break;
+
+			if (count == -1) {
+				log(ERROR, "unknown unit\n");
+				return -1;
+			}
+
+			value[len] = '\0';
+		} else
+			count = 0;
+	} else {
+		strstrip(unit);
+
+		while (--count >= 0)
+			if (!bstricmp(units[count], unit))
+				break;
+
+		if (count == -1) {
+			log(ERROR, "unknown unit\n");
+			return -1;
+		}
+	}
+
+	log(DEBUG, "%s %s\n", value, units[count]);
+
+	if (!cfg.minimal && unit)
+		fprintf(fout, "\033[1mUNIT CONVERSION\033[0m\n");
+
+	switch (count) {
+	case 0:
+		bytes = convertbyte(value, &ret);
+		break;
+	case 1:
+		bytes = convertkib(value, &ret);
+		break;
+	case 2:
+		bytes = convertmib(value, &ret);
+		break;
+	case 3:
+		bytes = convertgib(value, &ret);
+		break;
+	case 4:
+		bytes = converttib(value, &ret);
+		break;
+	case 5:
+		bytes = convertkb(value, &ret);
+		break;
+	case 6:
+		bytes = convertmb(value, &ret);
+		break;
+	case 7:
+		bytes = convertgb(value, &ret);
+		break;
+	case 8:
+		bytes = converttb(value, &ret);
+		break;
+	default:
+		log(ERROR, "unknown unit\n");
+		return -1;
+	}
+
+	if (ret == -1) {
+		if (cfg.minimal || unit) /* For running python test cases */
+			log(ERROR, "malformed input\n");
+		else
+			return try_bc(NULL);
+
+		return -1;
+	}
+
+	bstrlcpy(lastres.p, getstr_u128(bytes, uint_buf), UINT_BUF_LEN);
+	lastres.unit = 1;
+	++resgen;
+	log(DEBUG, "result: %s %d\n", lastres.p, lastres.unit);
+
+	if (cfg.minimal)
+		return 0;
+
+	fprintf(fout, "\nADDRESS\n (d) %s\n (h) ",
+		getstr_u128(bytes, uint_buf));
+	printhex_u128(bytes);
+
+	/* Calculate LBA and offset */
+	lba = bytes / sectorsz;
+	offset = bytes % sectorsz;
+
+	fprintf(fout, "\n\nLBA:OFFSET (sector size: 0x%lx)\n", sectorsz);
+	/* We use a global buffer, so print decimal lba first, then offset */
+	fprintf(fout, " (d) %s:", getstr_u128(lba, uint_buf));
+	fprintf(fout, "%s\n (h) ", getstr_u128(offset, uint_buf));
+	printhex_u128(lba);
+	fprintf(fout, ":");
+	printhex_u128(offset);
+	fprintf(fout, "\n");
+
+	return 0;
+}
+
+/* Print the result of an expression and save it in 'r' */
+static int emitres(maxuint_t bytes, char unit)
+{
+	int ret;
+	char *ptr;
+
+	if (!unit) {
+		ptr = getstr_u128(bytes, uint_buf);
+		fprintf(fout, "%s\n", ptr);
+		bstrlcpy(lastres.p, ptr, UINT_BUF_LEN);
+		lastres.unit = 0;
+		++resgen;
+		log(DEBUG, "result1: %s %d\n", lastres.p, lastres.unit);
+		return 0;
+	}
+
+	if (!(cfg.minimal || cfg.repl))
+		fprintf(fout, "\033[1mRESULT\033[0m\n");
+
+	convertbyte(getstr_u128(bytes, uint_buf), &ret);
+	if (ret == -1) {
+		log(ERROR, "malformed input\n");
+		return -1;
+	}
+
+	ptr = getstr_u128(bytes, uint_buf);
+	bstrlcpy(lastres.p, ptr, UINT_BUF_LEN);
+	lastres.unit = 1;
+	++resgen;
+	log(DEBUG, "result2: %s %d\n", lastres.p, lastres.unit);
+
+	if (cfg.minimal)
+		return 0;
+
+	fprintf(fout, "\nADDRESS\n (d) %s\n (h) ", ptr);
+	printhex_u128(bytes);
+	fprintf(fout, "\n");
+
+	return 0;
+}
+
+static int printres(maxuint_t bytes, char unit)
+{
+	int ret;
+
+	STATS_TIME(ST_OUTPUT, ret = emitres(bytes, unit));
+	return ret;
+}
+
+#ifdef WIDE_BITS
+typedef struct {
+	wuint_t v;
+	char unit;
+} wdata;
+
+static char wide_buf[WIDE_BUF_LEN];
+
+/* Convert a token with an optional unit suffix to a wide integer
+ * Failure if out parameter holds -1
+ */
+static void unitconv_wide(char *numstr, char *isunit, wuint_t *val, int *out)
+{
+	char *punit = NULL, intbuf[NUM_LEN];
+	int count;
+	size_t len;
+	maxfloat_t byte_metric;
+
+	*out = 0;
+
+	if (numstr == NULL || *numstr == '\0') {
+		log(ERROR, "invalid token\n");
+		*out = -1;
+		return;
+	}
+
+	/* ensure this is not the result of a previous operation */
+	if (*isunit != 1)
+		*isunit = 0;
+
+	if (wide_parse(numstr, val))
+		return;
+
+	byte_metric = strtold(numstr, &punit);
+	if (*punit == '\0') {
+		if (!wide_from_ld(byte_metric, val)) {
+			log(ERROR, "token overflow\n");
+			*out = -1;
+		}
+		return;
+	}
+
+	count = unitidx(punit);
+	if (count == -1) {
+		if (cfg.minimal)
+			log(ERROR, "unknown unit\n");
+		else
+			try_bc(NULL);
+
+		*out = -1;
+		return;
+	}
+
+	*isunit = 1;
+
+	/* Integer quantities are scaled exactly */
+	len = (size_t)(punit - numstr);
+	memcpy(intbuf, numstr, len);
+	intbuf[len] = '\0';
+
+	if (wide_parse(intbuf, val)) {
+		if (!wide_muladd_small(val, unitsz[count], 0)) {
+			log(ERROR, "token overflow\n");
+			*out = -1;
+		}
+		return;
+	}
+
+	if (!wide_from_ld(byte_metric * unitsz[count], val)) {
+		log(ERROR, "token overflow\n");
+		*out = -1;
+	}
+}
+
+/* Shift count as an unsigned int, WIDE_BITS if it is out of range */
+static uint wide_shiftcount(const wuint_t *v)
+{
+	if (wide_len(v) > 1 || v->l[0] >= WIDE_BITS)
+		return WIDE_BITS;
+
+	return (uint)v->l[0];
+}
+
+/* Evaluates Postfix Expression with WIDE_BITS operands
+ * Returns -1 on failure
+ */
+static int eval_wide(queue **front, queue **rear, wdata *res)
+{
+	/* Kept for the next expression */
+	static wdata *st;
+	static size_t cap;
+	wdata *a, *b;
+	size_t top = 0;
+	Data arg;
+	wuint_t rem;
+	int out = 0, unit;
+
+	while (*front) {
+		dequeue(front, rear, &arg);
+
+		/* Check if arg is an operator */
+		if (strlen(arg.p) == 1 && !isdigit((int)arg.p[0])) {
+			if (top < 2) {
+				log(ERROR, "invalid token\n");
+				goto error;
+			}
+
+			a = &st[top - 2];
+			b = &st[top - 1];
+
+			if ((arg.p[0] == '/' || arg.p[0] == '%') && wide_iszero(&b->v)) {
+				log(ERROR, "division by 0\n");
+				goto error;
+			}
+
+			unit = opunit(arg.p[0], a->unit, b->unit);
+			if (unit == -1)
+				goto error;
+
+			switch (arg.p[0]) {
+			case '>':
+				wide_shr(&a->v, wide_shiftcount(&b->v), &a->v);
+				break;
+			case '<':
+				if (!wide_shl(&a->v, wide_shiftcount(&b->v), &a->v)) {
+					log(ERROR, "overflow in <<\n");
+					goto error;
+				}
+				break;
+			case '+':
+				if (!wide_add(&a->v, &b->v, &a->v)) {
+					log(ERROR, "overflow in +\n");
+					goto error;
+				}
+				break;
+			case '&':
+			case '|':
+			case '^':
+				for (int i = 0; i < WIDE_LIMBS; ++i) {
+					if (arg.p[0] == '&')
+						a->v.l[i] &= b->v.l[i];
+					else if (arg.p[0] == '|')
+						a->v.l[i] |= b->v.l[i];
+					else
+						a->v.l[i] ^= b->v.l[i];
+				}
+				break;
+			case '-':
+				if (!wide_sub(&a->v, &b->v, &a->v)) {
+					log(ERROR, "negative result\n");
+					goto error;
+				}
+				break;
+			case '*':
+				if (!wide_mul(&a->v, &b->v, &a->v)) {
+					log(ERROR, "overflow in *\n");
+					goto error;
+				}
+				break;
+			case '/':
+				wide_divmod(&a->v, &b->v, &a->v, &rem);
+				if (!wide_iszero(&rem))
+					log(WARNING, "result truncated\n");
+				break;
+			default: /* '%' */
+				wide_divmod(&a->v, &b->v, &rem, &a->v);
+				break;
+			}
+
+			a->unit = (char)unit;
+			--top;
+		} else {
+			if (top == cap) {
+				cap = cap ? cap << 1 : 16;
+				wdata *tmp = (wdata *)mem_realloc(st, cap * sizeof(wdata));
+
+				if (!tmp) {
+					log(ERROR, "out of memory\n");
+					goto error;
+				}
+				st = tmp;
+			}
+
+			st[top].unit = arg.unit;
+			STATS_TIME(ST_UNITCONV, unitconv_wide(arg.p, &st[top].unit, &st[top].v, &out));
+			if (out == -1)
+				goto error;
+			++top;
+		}
+	}
+
+	/* Stack must hold exactly the result at this point */
+	if (top != 1) {
+		log(ERROR, "invalid expression\n");
+		goto error;
+	}
+
+	*res = st[0];
+	return 0;
+
+error:
+	cleanqueue(front);
+	return -1;
+}
+
+/* Print a wide result and save it in 'r' */
+static void printwide(wdata *res, ulong sectorsz, bool lba)
+{
+	char *ptr = wide_tostr(&res->v, wide_buf, sizeof(wide_buf));
+	wuint_t q = res->v;
+	limb_t offset;
+
+	bstrlcpy(lastres.p, ptr, NUM_LEN);
+	lastres.unit = res->unit;
+	++resgen;
+	log(DEBUG, "result: %s %d\n", lastres.p, lastres.unit);
+
+	if (!res->unit) {
+		fprintf(fout, "%s\n", ptr);
+		return;
+	}
+
+	if (cfg.minimal) {
+		fprintf(fout, "%s B\n", ptr);
+		return;
+	}
+
+	if (!(cfg.repl || lba))
+		fprintf(fout, "\033[1mRESULT\033[0m\n");
+
+	fprintf(fout, "%40s B\n", ptr);
+	printiecsi(wide_to_ld(&res->v));
+
+	fprintf(fout, "\nADDRESS\n (d) %s\n (h) %s\n", ptr, wide_tohex(&res->v, wide_buf));
+
+	if (!lba)
+		return;
+
+	offset = wide_divmod_small(&q, sectorsz);
+	fprintf(fout, "\nLBA:OFFSET (sector size: 0x%lx)\n", sectorsz);
+	fprintf(fout, " (d) %s:%llu\n", wide_tostr(&q, wide_buf, sizeof(wide_buf)), offset);
+	fprintf(fout, " (h) %s:0x%llx\n", wide_tohex(&q, wide_buf), offset);
+}
+
+/* Wide counterpart of convertunit() for a single value with optional unit */
+static int convertunit_wide(char *value, ulong sectorsz)
+{
+	int count, unitchars = 0, len = (int)strlen(value);
+	wdata res = {{{0}}, 1};
+	maxfloat_t val;
+	char *pch;
+
+	while (len) {
+		if (!isalpha((int)value[len - 1]))
+			break;
+
+		++unitchars;
+		--len;
+	}
+
+	if (unitchars) {
+		count = unitidx(value + len);
+		if (count == -1) {
+			log(ERROR, "unknown unit\n");
+			return -1;
+		}
+
+		value[len] = '\0';
+	} else
+		count = 0;
+
+	if (wide_parse(value, &res.v)) {
+		if (!wide_muladd_small(&res.v, unitsz[count], 0)) {
+			log(ERROR, "token overflow\n");
+			return -1;
+		}
+	} else {
+		/* Fractional bytes are truncated */
+		val = strtold(value, &pch);
+		if (!count || *value == '\0' || *pch) {
+			log(ERROR, "malformed input\n");
+			return -1;
+		}
+
+		if (!wide_from_ld(val * unitsz[count], &res.v)) {
+			log(ERROR, "token overflow\n");
+			return -1;
+		}
+	}
+
+	STATS_TIME(ST_OUTPUT, printwide(&res, sectorsz, true));
+	return 0;
+}
+
+static int evaluate_wide(char *exp, ulong sectorsz)
+{
+	int ret = 0;
+	wdata res;
+	queue *front = NULL, *rear = NULL;
+	char *expr;
+
+	STATS_TIME(ST_FIXEXPR, expr = fixexpr(exp, &ret));  /* Make parsing compatible */
+	if (expr == NULL) {
+		if (!ret)
+			return -1;
+
+		if (exp[0] == '\0') {
+			log(ERROR, "invalid value\n");
+			return -1;
+		}
+
+		return convertunit_wide(exp, sectorsz);
+	}
+
+	STATS_TIME(ST_POSTFIX, ret = infix2postfix(expr, &front, &rear));
+	if (ret == -1)
+		return -1;
+
+	STATS_TIME(ST_EVAL, ret = eval_wide(&front, &rear, &res));
+	if (ret == -1)
+		return -1;
+
+	STATS_TIME(ST_OUTPUT, printwide(&res, sectorsz, false));
+	return 0;
+}
+
+static int convertbase_wide(char *arg)
+{
+	wuint_t val;
+
+	strstrip(arg);
+
+	if (*arg == '\0') {
+		log(ERROR, "empty input\n");
+		return -1;
+	}
+
+	if (*arg == '-') {
+		log(ERROR, "N must be >= 0\n");
+		return -1;
+	}
+
+	if (cfg.repl && arg[0] == 'r' && arg[1] == '\0')
+		arg = lastres.p;
+
+	if (!wide_parse(arg, &val)) {
+		log(ERROR, "invalid input\n");
+		return -1;
+	}
+
+	fprintf(fout, " (b) %s\n", wide_tobin(&val, wide_buf));
+	fprintf(fout, " (d) %s\n", wide_tostr(&val, wide_buf, sizeof(wide_buf)));
+	fprintf(fout, " (h) %s\n", wide_tohex(&val, wide_buf));
+
+	return 0;
+}
+#endif
+
+/* List reductions */
+enum {
+	RED_SUM,
+	RED_MIN,
+	RED_MAX,
+	RED_AVG,
+};
+
+static const char * const reductions[] = {"sum", "min", "max", "avg"};
+
+#define RED_CHUNK 512
+
+typedef struct {
+	maxuint_t vals[RED_CHUNK];
+	size_t n;           /* values pending in vals */
+	ull count;          /* values in the list */
+	t_val res;
+	int fn;
+	char item[NUM_LEN]; /* list item being read */
+	size_t len;
+	bool toolong;
+} t_reduce;
+
+/*
+ * Sum of n values, false on overflow
+ * The low and high 64-bit halves are summed separately in 4 lanes. Sums of
+ * at most 2^64 halves cannot wrap, so the loop has no carry checks and the
+ * carry is resolved once when the halves are recombined.
+ */
+static bool sum_kernel(const maxuint_t *v, size_t n, maxuint_t *res)
+{
+#ifdef __SIZEOF_INT128__
+	maxuint_t lo[4] = {0}, hi[4] = {0};
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		lo[0] += (ull)v[i];
+		lo[1] += (ull)v[i + 1];
+		lo[2] += (ull)v[i + 2];
+		lo[3] += (ull)v[i + 3];
+		hi[0] += (ull)(v[i] >> 64);
+		hi[1] += (ull)(v[i + 1] >> 64);
+		hi[2] += (ull)(v[i + 2] >> 64);
+		hi[3] += (ull)(v[i + 3] >> 64);
+	}
+
+	for (; i < n; ++i) {
+		lo[0] += (ull)v[i];
+		hi[0] += (ull)(v[i] >> 64);
+	}
+
+	lo[0] += lo[1] + lo[2] + lo[3];
+	hi[0] += hi[1] + hi[2] + hi[3];
+	if (hi[0] >> 64)
+		return false;
+
+	return add_u(hi[0] << 64, lo[0], res);
+#else
+	maxuint_t acc[4] = {0};
+	bool of = false;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		of |= __builtin_add_overflow(acc[0], v[i], &acc[0]);
+		of |= __builtin_add_overflow(acc[1], v[i + 1], &acc[1]);
+		of |= __builtin_add_overflow(acc[2], v[i + 2], &acc[2]);
+		of |= __builtin_add_overflow(acc[3], v[i + 3], &acc[3]);
+	}
+
+	for (; i < n; ++i)
+		of |= __builtin_add_overflow(acc[0], v[i], &acc[0]);
+
+	of |= __builtin_add_overflow(acc[0], acc[1], &acc[0]);
+	of |= __builtin_add_overflow(acc[2], acc[3], &acc[2]);
+	of |= __builtin_add_overflow(acc[0], acc[2], res);
+	return !of;
+#endif
+}
+
+/* Minimum (max == false) or maximum of n > 0 values */
+static maxuint_t minmax_kernel(const maxuint_t *v, size_t n, bool max)
+{
+	maxuint_t m[4] = {v[0], v[0], v[0], v[0]};
+	size_t i = 0;
+
+	if (max) {
+		for (; i + 4 <= n; i += 4) {
+			m[0] = v[i] > m[0] ? v[i] : m[0];
+			m[1] = v[i + 1] > m[1] ? v[i + 1] : m[1];
+			m[2] = v[i + 2] > m[2] ? v[i + 2] : m[2];
+			m[3] = v[i + 3] > m[3] ? v[i + 3] : m[3];
+		}
+
+		for (; i < n; ++i)
+			m[0] = v[i] > m[0] ? v[i] : m[0];
+
+		m[0] = m[1] > m[0] ? m[1] : m[0];
+		m[2] = m[3] > m[2] ? m[3] : m[2];
+		return m[2] > m[0] ? m[2] : m[0];
+	}
+
+	for (; i + 4 <= n; i += 4) {
+		m[0] = v[i] < m[0] ? v[i] : m[0];
+		m[1] = v[i + 1] < m[1] ? v[i + 1] : m[1];
+		m[2] = v[i + 2] < m[2] ? v[i + 2] : m[2];
+		m[3] = v[i + 3] < m[3] ? v[i + 3] : m[3];
+	}
+
+	for (; i < n; ++i)
+		m[0] = v[i] < m[0] ? v[i] : m[0];
+
+	m[0] = m[1] < m[0] ? m[1] : m[0];
+	m[2] = m[3] < m[2] ? m[3] : m[2];
+	return m[2] < m[0] ? m[2] : m[0];
+}
+
+/* Reduce the pending values into the result */
+static int red_flush(t_reduce *rd)
+{
+	maxuint_t val;
+
+	if (!rd->n)
+		return 0;
+
+	if (rd->fn == RED_SUM || rd->fn == RED_AVG) {
+		if (!sum_kernel(rd->vals, rd->n, &val) || !add_u(rd->res.v, val, &rd->res.v)) {
+			log(ERROR, "overflow in %s\n", reductions[rd->fn]);
+			return -1;
+		}
+	} else {
+		val = minmax_kernel(rd->vals, rd->n, rd->fn == RED_MAX);
+		if (rd->count == rd->n || (rd->fn == RED_MAX ? val > rd->res.v : val < rd->res.v))
+			rd->res.v = val;
+	}
+
+	rd->n = 0;
+	return 0;
+}
+
+/* Convert a list item, e.g. "4TiB", "0x10 b" or a variable */
+static int red_item(t_reduce *rd)
+{
+	char *item = rd->item, *unit = NULL, *pch;
+	t_val val;
+	t_var *var;
+	size_t len;
+
+	if (rd->toolong) {
+		log(ERROR, "invalid token\n");
+		return -1;
+	}
+
+	item[rd->len] = '\0';
+	rd->len = 0;
+	strstrip(item);
+	if (!*item)
+		return 0;
+
+	/* Unit separated by blank */
+	for (pch = item; *pch && !isspace((int)*pch); ++pch)
+		;
+	if (*pch) {
+		*pch = '\0';
+		for (unit = pch + 1; isspace((int)*unit); ++unit)
+			;
+	}
+
+	len = identlen(item);
+	if (!unit && len && !item[len] && (var = sym_get(item, len))) {
+		if (!var->exact) {
+			log(ERROR, "token overflow\n");
+			return -1;
+		}
+
+		val = var->val;
+	} else if (!unit && item[0] == 'r' && item[1] == '\0') {
+		val.v = strtouquad(lastres.p, &pch);
+		if (!lastres.p[0] || *pch) {
+			log(ERROR, "no result stored\n");
+			return -1;
+		}
+
+		val.unit = lastres.unit;
+	} else {
+		switch (strtosize(item, unit, &val.v, &val.unit)) {
+		case 0:
+			break;
+		case -2:
+			log(ERROR, "token overflow\n");
+			return -1;
+		default:
+			log(ERROR, "invalid token\n");
+			return -1;
+		}
+	}
+
+	/* Unit rules of + apply to all reductions */
+	if (!rd->count)
+		rd->res.unit = val.unit;
+	else if (val.unit != rd->res.unit) {
+		log(ERROR, "unit mismatch in %s\n", reductions[rd->fn]);
+		return -1;
+	}
+
+	rd->vals[rd->n++] = val.v;
+	++rd->count;
+	return rd->n == RED_CHUNK ? red_flush(rd) : 0;
+}
+
+/* Feed list text to the reduction, items are separated by ',' or newline */
+static int red_feed(t_reduce *rd, const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (str[i] == ',' || str[i] == '\n') {
+			if (red_item(rd) == -1)
+				return -1;
+		} else if (rd->len < NUM_LEN - 1)
+			rd->item[rd->len++] = str[i];
+		else
+			rd->toolong = true;
+	}
+
+	return 0;
+}
+
+static int red_file(t_reduce *rd, const char *path)
+{
+	static char buf[1 << 16];
+	ssize_t len;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1) {
+		log(ERROR, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		if (red_feed(rd, buf, (size_t)len) == -1) {
+			close(fd);
+			return -1;
+		}
+
+	close(fd);
+	if (len == -1) {
+		log(ERROR, "read()! [%s]\n", strerror(errno));
+		return -1;
+	}
+
+	/* The last item may not be terminated */
+	return red_item(rd);
+}
+
+/* Index of the reduction if exp starts with a call like "sum(", else -1 */
+static int reduction_at(const char *exp)
+{
+	size_t len = identlen(exp);
+	int count = ARRAY_SIZE(reductions);
+
+	if (len != 3)
+		return -1;
+
+	while (isspace((int)exp[len]))
+		++len;
+
+	if (exp[len] != '(')
+		return -1;
+
+	while (--count >= 0)
+		if (!strncmp(exp, reductions[count], 3))
+			break;
+
+	return count;
+}
+
+/* Index of the reduction if exp is a call like "sum(...)", else -1 */
+static int isreduction(const char *exp)
+{
+	int fn = reduction_at(exp);
+	const char *end;
+
+	if (fn == -1)
+		return -1;
+
+	/* Else it is an operand */
+	end = strchr(exp, ')');
+	return (end && !end[1]) ? fn : -1;
+}
+
+/* The first reduction in exp, not part of a longer name, NULL if none */
+static char *findreduction(char *exp)
+{
+	for (char *p = exp; *p; ++p)
+		if ((p == exp || !(isalnum((int)p[-1]) || p[-1] == '_')) &&
+		    reduction_at(p) != -1)
+			return p;
+
+	return NULL;
+}
+
+/*
+ * Evaluate "fn(list)" where list is comma separated values or @file
+ * Returns -1 on failure
+ */
+static int reduce(char *exp, int fn, t_val *res)
+{
+	static t_reduce rd;
+	char *list = strchr(exp, '('), *end;
+
+	strstrip(exp);
+	end = exp + strlen(exp) - 1;
+	if (*end != ')') {
+		log(ERROR, "unbalanced expression\n");
+		return -1;
+	}
+
+	*end = '\0';
+	++list;
+	strstrip(list);
+
+	memset(&rd, 0, sizeof(rd));
+	rd.fn = fn;
+
+	if (*list == '@') {
+		if (red_file(&rd, list + 1) == -1)
+			return -1;
+	} else if (red_feed(&rd, list, strlen(list)) == -1 || red_item(&rd) == -1)
+		return -1;
+
+	if (red_flush(&rd) == -1)
+		return -1;
+
+	if (!rd.count) {
+		log(ERROR, "empty list\n");
+		return -1;
+	}
+
+	if (fn == RED_AVG)
+		rd.res.v = div_u(rd.res.v, rd.count);
+
+	log(DEBUG, "%s of %llu values\n", reductions[fn], rd.count);
+	*res = rd.res;
+	return 0;
+}
+
+/*
+ * Replace the reductions in exp by their values, e.g. "2 * sum(1, 2)" by
+ * "2 * 3", so they can be operands. Returns exp if there are none and NULL
+ * on failure.
+ */
+static char *reduce_operands(char *exp)
+{
+	static char *buf;
+	static size_t buflen;
+	char *p = findreduction(exp), *end;
+	size_t len = strlen(exp), n = 0;
+	t_val val;
+
+	if (!p)
+		return exp;
+
+	/* A call of at least 5 characters becomes a value and a unit */
+	len += (len / 5 + 1) * NUM_LEN + 1;
+	if (len > buflen) {
+		char *tmp = (char *)mem_realloc(buf, len);
+
+		if (!tmp) {
+			log(ERROR, "out of memory\n");
+			return NULL;
+		}
+
+		buf = tmp;
+		buflen = len;
+	}
+
+	for (; p; p = findreduction(end + 1)) {
+		end = strchr(p, ')');
+		if (!end) {
+			log(ERROR, "unbalanced expression\n");
+			return NULL;
+		}
+
+		memcpy(buf + n, exp, (size_t)(p - exp));
+		n += (size_t)(p - exp);
+
+		/* The call is reduced in its place in buf, exp is kept */
+		memcpy(buf + n, p, (size_t)(end - p + 1));
+		buf[n + (size_t)(end - p + 1)] = '\0';
+		if (reduce(buf + n, reduction_at(p), &val) == -1)
+			return NULL;
+
+		n += (size_t)snprintf(buf + n, NUM_LEN, "%s%s", getstr_u128(val.v, uint_buf),
+				      val.unit ? " b" : "");
+		exp = end + 1;
+	}
+
+	bstrlcpy(buf + n, exp, buflen - n);
+	return buf;
+}
+
+/* Evaluate an expression without output, into d */
+static int evalexpr(char *rhs, Data *d)
+{
+	int ret = 0;
+	char *expr;
+	queue *front = NULL, *rear = NULL;
+#ifdef WIDE_BITS
+	wdata res = {{{0}}, 0};
+#else
+	maxuint_t bytes;
+#endif
+
+	while (isspace((int)*rhs))
+		++rhs;
+
+	ret = isreduction(rhs);
+	if (ret != -1) {
+		t_val val;
+
+		if (reduce(rhs, ret, &val) == -1)
+			return -1;
+
+		bstrlcpy(d->p, getstr_u128(val.v, uint_buf), NUM_LEN);
+		d->unit = val.unit;
+		return 0;
+	}
+
+	rhs = reduce_operands(rhs);
+	if (!rhs)
+		return -1;
+
+	STATS_TIME(ST_FIXEXPR, expr = fixexpr(rhs, &ret));
+	if (expr == NULL) {
+		if (!ret)
+			return -1;
+
+		if (*rhs == '\0') {
+			log(ERROR, "invalid value\n");
+			return -1;
+		}
+
+		/* Single value, possibly another variable */
+		t_var *var = sym_get(rhs, strlen(rhs));
+
+		if (var && identlen(rhs) == strlen(rhs)) {
+			*d = var->d;
+			return 0;
+		}
+
+		if (rhs[0] == 'r' && rhs[1] == '\0') {
+			if (lastres.p[0] == '\0') {
+				log(ERROR, "no result stored\n");
+				return -1;
+			}
+
+			*d = lastres;
+			return 0;
+		}
+
+#ifdef WIDE_BITS
+		STATS_TIME(ST_UNITCONV, unitconv_wide(rhs, &res.unit, &res.v, &ret));
+#else
+		bstrlcpy(d->p, rhs, NUM_LEN);
+		bytes = unitconv(*d, &d->unit, &ret);
+#endif
+	} else {
+		STATS_TIME(ST_POSTFIX, ret = infix2postfix(expr, &front, &rear));
+		if (ret == -1)
+			return -1;
+
+#ifdef WIDE_BITS
+		STATS_TIME(ST_EVAL, ret = eval_wide(&front, &rear, &res));
+#else
+		STATS_TIME(ST_EVAL, bytes = eval(&front, &rear, &ret));
+		d->unit = ret != 1;
+#endif
+	}
+
+	if (ret == -1)
+		return -1;
+
+#ifdef WIDE_BITS
+	bstrlcpy(d->p, wide_tostr(&res.v, wide_buf, sizeof(wide_buf)), NUM_LEN);
+	d->unit = res.unit;
+#else
+	bstrlcpy(d->p, getstr_u128(bytes, uint_buf), NUM_LEN);
+#endif
+	return 0;
+}
+
+/* Evaluate the right side of "name = rhs" and store it in name silently */
+static int assign(char *exp, size_t len)
+{
+	char *rhs = strchr(exp + len, '=') + 1;
+	Data d = {"", 0};
+
+	if (evalexpr(rhs, &d) == -1)
+		return -1;
+
+	return sym_set(exp, len, &d);
+}
+
+static int evaluate(char *exp, ulong sectorsz)
+{
+	size_t len;
+	int fn;
+	t_var *var;
+
+	strstrip(exp);
+
+	len = isassign(exp);
+	if (len)
+		return assign(exp, len);
+
+	fn = isreduction(exp);
+	if (fn != -1) {
+		t_val val;
+
+		if (reduce(exp, fn, &val) == -1)
+			return -1;
+
+		return printres(val.v, val.unit);
+	}
+
+	exp = reduce_operands(exp);
+	if (!exp)
+		return -1;
+
+	/* A lone variable shows its value */
+	len = identlen(exp);
+	if (len && !exp[len]) {
+		var = sym_get(exp, len);
+		if (var) {
+#ifdef WIDE_BITS
+			exp = var->d.p;
+#else
+			return printres(var->val.v, var->val.unit);
+#endif
+		}
+	}
+
+#ifdef WIDE_BITS
+	return evaluate_wide(exp, sectorsz);
+#endif
+	int ret = 0;
+	maxuint_t bytes = 0;
+	queue *front = NULL, *rear = NULL;
+	char *expr;
+
+	STATS_TIME(ST_FIXEXPR, expr = fixexpr(exp, &ret));  /* Make parsing compatible */
+	if (expr)
+		log(DEBUG, "expr: %s\n", expr);
+
+	if (expr == NULL) {
+		if (ret)
+			return convertunit(exp, NULL, sectorsz);
+
+		return -1;
+	}
+
+	STATS_TIME(ST_POSTFIX, ret = infix2postfix(expr, &front, &rear));
+	if (ret == -1)
+		return -1;
+
+	STATS_TIME(ST_EVAL, bytes = eval(&front, &rear, &ret));  /* Evaluate Expression */
+	if (ret == -1)
+		return -1;
+
+	return printres(bytes, ret != 1);
+}
+
+#ifndef BCAL_BUILTIN
+/*
+ * Input of the bulk modes
+ * Compressed input is detected by its magic number and decompressed on a
+ * separate thread into one of two buffers while the other one is parsed.
+ */
+enum {
+	IN_PLAIN,
+	IN_GZIP,
+	IN_ZSTD,
+};
+
+#define IN_BUF_LEN (1 << 20)
+
+#ifdef USE_ZSTD
+typedef struct {
+	ZSTD_DStream *ds;
+	ZSTD_inBuffer src;
+	bool pending;  /* within a frame */
+} t_zstd;
+#endif
+
+typedef struct {
+	int fd;
+	int type;
+	uchar peek[4];       /* first bytes, read to detect the type */
+	size_t npeek;
+	size_t peekpos;
+	char *src;           /* compressed input */
+	void *dec;           /* decompressor state */
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *ring[2];
+	size_t fill[2];
+	bool full[2];        /* ring[i] holds data to parse */
+	uint rd;             /* buffer being parsed */
+	size_t rdpos;
+	bool done;           /* no more buffers will be filled */
+	bool stop;           /* the parser gave up */
+	bool failed;
+	bool bad;            /* decompression failed, owned by the worker */
+} t_in;
+
+static int in_type(const uchar *p, size_t len)
+{
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+		return IN_GZIP;
+
+	if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+		return IN_ZSTD;
+
+	return IN_PLAIN;
+}
+
+#if defined(USE_ZLIB) || defined(USE_ZSTD)
+/* Read compressed input, the peeked bytes first */
+static ssize_t in_src(t_in *in, size_t len)
+{
+	size_t n = in->npeek - in->peekpos;
+
+	if (n) {
+		memcpy(in->src, in->peek + in->peekpos, n);
+		in->peekpos = in->npeek;
+		return (ssize_t)n;
+	}
+
+	return read(in->fd, in->src, len);
+}
+#endif
+
+#ifdef USE_ZLIB
+/*
+ * Decompress up to cap bytes, returns 0 at the end
+ * On error bad is set and the bytes decompressed before it are returned.
+ */
+static ssize_t in_gzip(t_in *in, char *out, size_t cap)
+{
+	z_stream *zs = (z_stream *)in->dec;
+	ssize_t len;
+	int ret;
+
+	zs->next_out = (Bytef *)out;
+	zs->avail_out = (uInt)cap;
+
+	while (zs->avail_out) {
+		if (!zs->avail_in) {
+			len = in_src(in, IN_BUF_LEN);
+			if (len == -1) {
+				log(ERROR, "read()! [%s]\n", strerror(errno));
+				in->bad = true;
+				break;
+			}
+
+			/* The end of input must end a member */
+			if (!len) {
+				if (zs->total_in) {
+					log(ERROR, "truncated gzip input\n");
+					in->bad = true;
+				}
+				break;
+			}
+
+			zs->next_in = (Bytef *)in->src;
+			zs->avail_in = (uInt)len;
+		}
+
+		ret = inflate(zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			/* Members can be concatenated */
+			inflateReset(zs);
+		else if (ret != Z_OK) {
+			log(ERROR, "gzip: %s\n", zs->msg ? zs->msg : "invalid input");
+			in->bad = true;
+			break;
+		}
+	}
+
+	return (ssize_t)(cap - zs->avail_out);
+}
+#endif
+
+#ifdef USE_ZSTD
+/* Same as in_gzip() */
+static ssize_t in_zstd(t_in *in, char *out, size_t cap)
+{
+	ZSTD_inBuffer *src = &((t_zstd *)in->dec)->src;
+	ZSTD_outBuffer dst = {out, cap, 0};
+	ssize_t len;
+	size_t ret;
+
+	while (dst.pos < cap) {
+		if (src->pos == src->size) {
+			len = in_src(in, IN_BUF_LEN);
+			if (len == -1) {
+				log(ERROR, "read()! [%s]\n", strerror(errno));
+				in->bad = true;
+				break;
+			}
+
+			if (!len) {
+				if (((t_zstd *)in->dec)->pending) {
+					log(ERROR, "truncated zstd input\n");
+					in->bad = true;
+				}
+				break;
+			}
+
+			src->src = in->src;
+			src->size = (size_t)len;
+			src->pos = 0;
+		}
+
+		ret = ZSTD_decompressStream(((t_zstd *)in->dec)->ds, &dst, src);
+		if (ZSTD_isError(ret)) {
+			log(ERROR, "zstd: %s\n", ZSTD_getErrorName(ret));
+			in->bad = true;
+			break;
+		}
+
+		/* 0 at the end of a frame */
+		((t_zstd *)in->dec)->pending = ret != 0;
+	}
+
+	return (ssize_t)dst.pos;
+}
+#endif
+
+static ssize_t in_decode(t_in *in, char *out, size_t cap)
+{
+#ifdef USE_ZLIB
+	if (in->type == IN_GZIP)
+		return in_gzip(in, out, cap);
+#endif
+#ifdef USE_ZSTD
+	if (in->type == IN_ZSTD)
+		return in_zstd(in, out, cap);
+#endif
+	in->bad = true;
+	return 0;
+}
+
+/* Decompressor thread, fills the buffers in turn */
+static void *in_worker(void *arg)
+{
+	t_in *in = (t_in *)arg;
+	uint wr = 0;
+	ssize_t len;
+	bool stop;
+
+	for (;;) {
+		pthread_mutex_lock(&in->lock);
+		while (in->full[wr] && !in->stop)
+			pthread_cond_wait(&in->cond, &in->lock);
+		stop = in->stop;
+		pthread_mutex_unlock(&in->lock);
+
+		if (stop)
+			break;
+
+		len = in_decode(in, in->ring[wr], IN_BUF_LEN);
+
+		/* Output decoded before an error is parsed first */
+		pthread_mutex_lock(&in->lock);
+		if (len > 0) {
+			in->fill[wr] = (size_t)len;
+			in->full[wr] = true;
+		}
+		if (!len || in->bad) {
+			in->failed = in->bad;
+			in->done = true;
+		}
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->lock);
+
+		if (!len || in->bad)
+			break;
+
+		wr ^= 1;
+	}
+
+	return NULL;
+}
+
+static void in_free(t_in *in)
+{
+#ifdef USE_ZLIB
+	if (in->type == IN_GZIP && in->dec)
+		inflateEnd((z_stream *)in->dec);
+#endif
+#ifdef USE_ZSTD
+	if (in->type == IN_ZSTD && in->dec)
+		ZSTD_freeDStream(((t_zstd *)in->dec)->ds);
+#endif
+	free(in->dec);
+	free(in->src);
+	free(in->ring[0]);
+	free(in->ring[1]);
+}
+
+/* Detect the type of input in fd and start decompression if required */
+static int in_open(t_in *in, int fd)
+{
+	static const char * const names[] = {"plain", "gzip", "zstd"};
+	ssize_t len;
+
+	memset(in, 0, sizeof(t_in));
+	in->fd = fd;
+
+	while (in->npeek < sizeof(in->peek)) {
+		len = read(fd, in->peek + in->npeek, sizeof(in->peek) - in->npeek);
+		if (len == -1) {
+			log(ERROR, "read()! [%s]\n", strerror(errno));
+			return -1;
+		}
+
+		if (!len)
+			break;
+
+		in->npeek += (size_t)len;
+	}
+
+	in->type = in_type(in->peek, in->npeek);
+	log(DEBUG, "%s input\n", names[in->type]);
+	if (in->type == IN_PLAIN)
+		return 0;
+
+	in->src = (char *)mem_malloc(IN_BUF_LEN);
+	in->ring[0] = (char *)mem_malloc(IN_BUF_LEN);
+	in->ring[1] = (char *)mem_malloc(IN_BUF_LEN);
+	if (!in->src || !in->ring[0] || !in->ring[1]) {
+		log(ERROR, "out of memory\n");
+		goto error;
+	}
+
+	switch (in->type) {
+#ifdef USE_ZLIB
+	case IN_GZIP:
+		in->dec = mem_calloc(1, sizeof(z_stream));
+		/* Detect the gzip header */
+		if (!in->dec || inflateInit2((z_stream *)in->dec, 15 + 32) != Z_OK) {
+			free(in->dec);
+			in->dec = NULL;
+			log(ERROR, "inflateInit2() failed\n");
+			goto error;
+		}
+		break;
+#endif
+#ifdef USE_ZSTD
+	case IN_ZSTD:
+		in->dec = mem_calloc(1, sizeof(t_zstd));
+		if (!in->dec || !(((t_zstd *)in->dec)->ds = ZSTD_createDStream())) {
+			free(in->dec);
+			in->dec = NULL;
+			log(ERROR, "ZSTD_createDStream() failed\n");
+			goto error;
+		}
+		break;
+#endif
+	default:
+		log(ERROR, "%s input is not supported by this build\n", names[in->type]);
+		goto error;
+	}
+
+	pthread_mutex_init(&in->lock, NULL);
+	pthread_cond_init(&in->cond, NULL);
+	if (pthread_create(&in->tid, NULL, in_worker, in)) {
+		log(ERROR, "pthread_create()! [%s]\n", strerror(errno));
+		pthread_mutex_destroy(&in->lock);
+		pthread_cond_destroy(&in->cond);
+		goto error;
+	}
+
+	return 0;
+
+error:
+	in_free(in);
+	return -1;
+}
+
+/* Wait for a decompressed buffer, false at the end of input */
+static bool in_wait(t_in *in)
+{
+	pthread_mutex_lock(&in->lock);
+	while (!in->full[in->rd] && !in->done)
+		pthread_cond_wait(&in->cond, &in->lock);
+	pthread_mutex_unlock(&in->lock);
+
+	return in->full[in->rd];
+}
+
+/* Hand the buffer being parsed back to the decompressor */
+static void in_release(t_in *in)
+{
+	pthread_mutex_lock(&in->lock);
+	in->full[in->rd] = false;
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->lock);
+	in->rd ^= 1;
+	in->rdpos = 0;
+}
+
+/* read() for the bulk modes, decompressed data if the input is compressed */
+static ssize_t in_read(t_in *in, char *buf, size_t len)
+{
+	size_t n = in->npeek - in->peekpos;
+
+	if (in->type == IN_PLAIN) {
+		if (!n)
+			return read(in->fd, buf, len);
+
+		n = n < len ? n : len;
+		memcpy(buf, in->peek + in->peekpos, n);
+		in->peekpos += n;
+		return (ssize_t)n;
+	}
+
+	if (!in_wait(in)) {
+		errno = EIO;
+		return in->failed ? -1 : 0;
+	}
+
+	n = in->fill[in->rd] - in->rdpos;
+	n = n < len ? n : len;
+	memcpy(buf, in->ring[in->rd] + in->rdpos, n);
+	in->rdpos += n;
+
+	if (in->rdpos == in->fill[in->rd])
+		in_release(in);
+
+	return (ssize_t)n;
+}
+
+/*
+ * Next block of input in *data, valid until the next call
+ * Decompressed data is returned in place, plain input is read into buf.
+ */
+static ssize_t in_next(t_in *in, char *buf, size_t len, const char **data)
+{
+	ssize_t n;
+
+	if (in->type == IN_PLAIN) {
+		*data = buf;
+		return in_read(in, buf, len);
+	}
+
+	/* The block returned last */
+	if (in->rdpos && in->rdpos == in->fill[in->rd])
+		in_release(in);
+
+	if (!in_wait(in)) {
+		errno = EIO;
+		return in->failed ? -1 : 0;
+	}
+
+	*data = in->ring[in->rd] + in->rdpos;
+	n = (ssize_t)(in->fill[in->rd] - in->rdpos);
+	in->rdpos = in->fill[in->rd];
+	return n;
+}
+
+static void in_close(t_in *in)
+{
+	if (in->type == IN_PLAIN)
+		return;
+
+	pthread_mutex_lock(&in->lock);
+	in->stop = true;
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->lock);
+
+	pthread_join(in->tid, NULL);
+	pthread_mutex_destroy(&in->lock);
+	pthread_cond_destroy(&in->cond);
+	in_free(in);
+}
+
+/* Streaming evaluator states */
+enum {
+	SEV_OPERAND,  /* expecting an operand */
+	SEV_TOKEN,    /* reading an operand */
+	SEV_SPACE,    /* blank after an operand, a unit may follow */
+	SEV_UNIT,     /* reading a unit separated by blank from its operand */
+	SEV_OPERATOR, /* expecting an operator, ')' or end of expression */
+	SEV_SHIFT,    /* read the first character of << or >> */
+};
+
+/*
+ * Streaming expression evaluator
+ *
+ * Expressions are evaluated with the shunting-yard algorithm as the input
+ * is read, so the stacks grow with the nesting depth of the expression and
+ * not with the number of terms. Expressions are separated by newline or ';'.
+ * A newline after an operator or within parentheses continues the expression.
+ */
+typedef struct {
+	t_val *vals;     /* operand stack */
+	char *ops;       /* operator stack */
+	char *tok;       /* operand being read */
+	size_t nvals, nops, ntok;
+	size_t capvals, capops, captok;
+	size_t unitpos;  /* offset of a blank separated unit in tok, 0 if none */
+	int state;
+	int depth;       /* open parentheses */
+	char shift;      /* first character of a shift operator */
+	bool failed;     /* skip to the end of the expression */
+	int ret;         /* -1 if any expression failed */
+	ull terms;       /* operands evaluated */
+	ull exprs;       /* expressions evaluated */
+	t_val r;         /* last result */
+	bool hasr;
+	char lhs[NUM_LEN]; /* variable assigned by the expression, if any */
+	t_mark t0;       /* first character of the expression, with --stats */
+} t_stream;
+
+static bool sev_grow(void **ptr, size_t *cap, size_t size)
+{
+	size_t newcap = *cap ? *cap << 1 : 32;
+	void *tmp = mem_realloc(*ptr, newcap * size);
+
+	if (!tmp) {
+		log(ERROR, "out of memory\n");
+		return false;
+	}
+
+	*ptr = tmp;
+	*cap = newcap;
+	return true;
+}
+
+static void sev_init(t_stream *ev)
+{
+	memset(ev, 0, sizeof(t_stream));
+
+	/* Continue from the last result of the session */
+	if (lastres.p[0]) {
+		char *pch;
+
+		ev->r.v = strtouquad(lastres.p, &pch);
+		ev->r.unit = lastres.unit;
+		ev->hasr = !*pch;
+	}
+}
+
+static void sev_free(t_stream *ev)
+{
+	free(ev->vals);
+	free(ev->ops);
+	free(ev->tok);
+}
+
+/* Discard the current expression */
+static void sev_reset(t_stream *ev)
+{
+	ev->nvals = ev->nops = ev->ntok = 0;
+	ev->depth = 0;
+	ev->state = SEV_OPERAND;
+	ev->lhs[0] = '\0';
+	ev->t0.ns = 0;
+}
+
+static void sev_fail(t_stream *ev)
+{
+	if (ev->t0.ns)
+		stats_end(ST_REQUEST, ev->t0);
+	ev->failed = true;
+	ev->ret = -1;
+	sev_reset(ev);
+}
+
+static bool sev_tokadd(t_stream *ev, char c)
+{
+	if (ev->ntok + 1 >= ev->captok && !sev_grow((void **)&ev->tok, &ev->captok, 1))
+		return false;
+
+	ev->tok[ev->ntok++] = c;
+	ev->tok[ev->ntok] = '\0';
+	return true;
+}
+
+/* Convert the operand read and push it */
+static int sev_operand(t_stream *ev)
+{
+	t_val val;
+	t_var *var;
+	char *unit = ev->unitpos ? ev->tok + ev->unitpos : NULL;
+
+	if (ev->tok[0] == 'r' && ev->tok[1] == '\0') {
+		if (!ev->hasr) {
+			log(ERROR, "no result stored\n");
+			return -1;
+		}
+
+		val = ev->r;
+	} else if (!ev->unitpos && identlen(ev->tok) == ev->ntok &&
+		   (var = sym_get(ev->tok, ev->ntok))) {
+		if (!var->exact) {
+			log(ERROR, "token overflow\n");
+			return -1;
+		}
+
+		val = var->val;
+	} else {
+		switch (strtosize(ev->tok, unit, &val.v, &val.unit)) {
+		case 0:
+			break;
+		case -2:
+			log(ERROR, "token overflow\n");
+			return -1;
+		default:
+			log(ERROR, "unknown unit\n");
+			return -1;
+		}
+	}
+
+	if (ev->nvals == ev->capvals && !sev_grow((void **)&ev->vals, &ev->capvals, sizeof(t_val)))
+		return -1;
+
+	ev->vals[ev->nvals++] = val;
+	++ev->terms;
+	ev->ntok = 0;
+	ev->unitpos = 0;
+	return 0;
+}
+
+/* Apply the operator on top of the stack */
+static int sev_reduce(t_stream *ev)
+{
+	char op = ev->ops[--ev->nops];
+
+	if (ev->nvals < 2) {
+		log(ERROR, "invalid expression\n");
+		return -1;
+	}
+
+	--ev->nvals;
+	return applyop(op, &ev->vals[ev->nvals - 1], &ev->vals[ev->nvals]);
+}
+
+static int sev_pushop(t_stream *ev, char op)
+{
+	if (op != '(')
+		while (ev->nops && ev->ops[ev->nops - 1] != '(' &&
+		       priority(op) <= priority(ev->ops[ev->nops - 1]))
+			if (sev_reduce(ev) == -1)
+				return -1;
+
+	if (ev->nops == ev->capops && !sev_grow((void **)&ev->ops, &ev->capops, 1))
+		return -1;
+
+	ev->ops[ev->nops++] = op;
+	return 0;
+}
+
+/* Complete the current expression and print the result */
+static int sev_end(t_stream *ev)
+{
+	t_val *res;
+	t_mark t0 = ev->t0;
+	int ret;
+
+	while (ev->nops) {
+		if (ev->ops[ev->nops - 1] == '(') {
+			log(ERROR, "unbalanced expression\n");
+			return -1;
+		}
+
+		if (sev_reduce(ev) == -1)
+			return -1;
+	}
+
+	if (ev->nvals != 1) {
+		log(ERROR, "invalid expression\n");
+		return -1;
+	}
+
+	res = &ev->vals[0];
+	++ev->exprs;
+
+	/* Assignments are silent and keep r */
+	if (ev->lhs[0]) {
+		Data d;
+
+		bstrlcpy(d.p, getstr_u128(res->v, uint_buf), NUM_LEN);
+		d.unit = res->unit;
+		ret = sym_set(ev->lhs, strlen(ev->lhs), &d);
+		sev_reset(ev);
+		stats_end(ST_REQUEST, t0);
+		return ret;
+	}
+
+	ev->r = *res;
+	ev->hasr = true;
+	sev_reset(ev);
+
+	ret = printres(res->v, res->unit);
+	stats_end(ST_REQUEST, t0);
+	return ret;
+}
+
+static bool istokchar(char c)
+{
+	return isalnum((int)c) || c == '.' || c == '_';
+}
+
+/* Feed one character of input to the evaluator */
+static void sev_char(t_stream *ev, char c)
+{
+	bool blank = (c == ' ' || c == '\t' || c == '\r');
+	bool eol = (c == '\n' || c == ';');
+
+	if (ev->failed) {
+		if (eol)
+			ev->failed = false;
+		return;
+	}
+
+	if (stats && !ev->t0.ns && !blank && !eol)
+		ev->t0 = stats_start();
+
+	/* "name = expr" */
+	if (c == '=' && (ev->state == SEV_TOKEN || ev->state == SEV_SPACE) &&
+	    !ev->nvals && !ev->nops && !ev->lhs[0] && !ev->unitpos) {
+		if (identlen(ev->tok) != ev->ntok || ev->ntok >= NUM_LEN) {
+			log(ERROR, "invalid variable name\n");
+			goto error;
+		}
+
+		memcpy(ev->lhs, ev->tok, ev->ntok + 1);
+		ev->ntok = 0;
+		ev->state = SEV_OPERAND;
+		return;
+	}
+
+again:
+	switch (ev->state) {
+	case SEV_TOKEN:
+		if (istokchar(c)) {
+			if (!sev_tokadd(ev, c))
+				goto error;
+			return;
+		}
+
+		if (blank) {
+			ev->state = SEV_SPACE;
+			return;
+		}
+		break;
+	case SEV_SPACE:
+		if (blank)
+			return;
+
+		/* "0xff b" or "10 TiB" */
+		if (isalpha((int)c)) {
+			if (!sev_tokadd(ev, '\0'))
+				goto error;
+			ev->unitpos = ev->ntok;
+			if (!sev_tokadd(ev, c))
+				goto error;
+			ev->state = SEV_UNIT;
+			return;
+		}
+		break;
+	case SEV_UNIT:
+		if (isalpha((int)c)) {
+			if (!sev_tokadd(ev, c))
+				goto error;
+			return;
+		}
+
+		if (blank) {
+			if (sev_operand(ev) == -1)
+				goto error;
+			ev->state = SEV_OPERATOR;
+			return;
+		}
+		break;
+	case SEV_OPERAND:
+		if (blank || c == '\n')
+			return;
+
+		if (c == ';') {
+			if (ev->nops || ev->nvals) {
+				log(ERROR, "invalid expression\n");
+				goto error;
+			}
+			return;
+		}
+
+		if (c == '(') {
+			++ev->depth;
+			if (sev_pushop(ev, c) == -1)
+				goto error;
+			return;
+		}
+
+		if (istokchar(c)) {
+			ev->ntok = 0;
+			ev->unitpos = 0;
+			if (!sev_tokadd(ev, c))
+				goto error;
+			ev->state = SEV_TOKEN;
+			return;
+		}
+
+		if (c == '-')
+			log(ERROR, "negative token\n");
+		else if ((c == '<' || c == '>') && ev->nops && ev->ops[ev->nops - 1] == c)
+			log(ERROR, "invalid sequence %c%c%c\n", c, c, c);
+		else if (c == '{' || c == '}' || c == '[' || c == ']')
+			log(ERROR, "first brackets only\n");
+		else
+			log(ERROR, "invalid token\n");
+		goto error;
+	case SEV_OPERATOR:
+		if (blank)
+			return;
+
+		if (eol) {
+			/* Continue within parentheses */
+			if (ev->depth && c == '\n')
+				return;
+
+			if (ev->depth) {
+				log(ERROR, "unbalanced expression\n");
+				goto error;
+			}
+
+			if (sev_end(ev) == -1)
+				goto error;
+			return;
+		}
+
+		switch (c) {
+		case ')':
+			if (!ev->depth) {
+				log(ERROR, "unbalanced expression\n");
+				goto error;
+			}
+
+			while (ev->ops[ev->nops - 1] != '(')
+				if (sev_reduce(ev) == -1)
+					goto error;
+
+			--ev->nops;
+			--ev->depth;
+			return;
+		case '<':
+		case '>':
+			ev->shift = c;
+			ev->state = SEV_SHIFT;
+			return;
+		case '+':
+		case '-':
+		case '*':
+		case '/':
+		case '%':
+		case '&':
+		case '|':
+		case '^':
+			if (sev_pushop(ev, c) == -1)
+				goto error;
+			ev->state = SEV_OPERAND;
+			return;
+		case '{':
+		case '}':
+		case '[':
+		case ']':
+			log(ERROR, "first brackets only\n");
+			goto error;
+		default:
+			log(ERROR, "invalid expression\n");
+			goto error;
+		}
+	case SEV_SHIFT:
+		if (c != ev->shift) {
+			log(ERROR, "invalid operator %c\n", ev->shift);
+			goto error;
+		}
+
+		if (sev_pushop(ev, c) == -1)
+			goto error;
+		ev->state = SEV_OPERAND;
+		return;
+	default:
+		return;
+	}
+
+	/* The operand is complete, process c as an operator */
+	if (sev_operand(ev) == -1)
+		goto error;
+
+	ev->state = SEV_OPERATOR;
+	goto again;
+
+error:
+	sev_fail(ev);
+	if (eol)
+		ev->failed = false;
+}
+
+/* Complete a trailing expression at end of input */
+static void sev_finish(t_stream *ev)
+{
+	if (ev->failed) {
+		ev->failed = false;
+		return;
+	}
+
+	if (ev->state == SEV_OPERAND && !ev->nops && !ev->nvals)
+		return;
+
+	if (ev->state == SEV_OPERAND || ev->state == SEV_SHIFT) {
+		log(ERROR, "invalid expression\n");
+		sev_fail(ev);
+		ev->failed = false;
+		return;
+	}
+
+	sev_char(ev, ';');
+}
+
+/* Evaluate the expressions read from fd */
+static int sev_fd(t_stream *ev, int fd)
+{
+	static char buf[1 << 16];
+	ssize_t len;
+	t_in in;
+
+	if (in_open(&in, fd) == -1)
+		return -1;
+
+	while ((len = in_read(&in, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < len; ++i)
+			sev_char(ev, buf[i]);
+		stats_poll();
+	}
+
+	in_close(&in);
+	if (len == -1) {
+		/* Decompression errors are reported by the decompressor */
+		if (!in.failed)
+			log(ERROR, "read()! [%s]\n", strerror(errno));
+		return -1;
+	}
+
+	sev_finish(ev);
+	return 0;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Evaluate expressions from files, or stdin if there are none */
+static int stream_files(char **files, int count)
+{
+	t_stream ev;
+	struct timespec start;
+	double secs;
+	int fd, ret = 0;
+
+	sev_init(&ev);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (!count)
+		ret = sev_fd(&ev, STDIN_FILENO);
+
+	for (int i = 0; i < count; ++i) {
+		fd = strcmp(files[i], "-") ? open(files[i], O_RDONLY) : STDIN_FILENO;
+		if (fd == -1) {
+			log(ERROR, "%s: %s\n", files[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if (sev_fd(&ev, fd) == -1)
+			ret = -1;
+
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	secs = elapsed(&start);
+	if (!cfg.minimal) {
+		fflush(fout);
+		log(INFO, "%llu expressions, %llu terms in %.6f s (%.0f terms/s)\n",
+		    ev.exprs, ev.terms, secs, secs > 0 ? (double)ev.terms / secs : 0);
+	}
+
+	sev_free(&ev);
+	return (ret || ev.ret) ? -1 : 0;
+}
+
+/*
+ * Log-bucketed quantile sketch (HDR histogram)
+ * Values below 2^(QS_SUB_BITS + 1) have a bucket each. A larger value with
+ * n significant bits goes to one of 2^QS_SUB_BITS buckets of width
+ * 2^(n - QS_SUB_BITS - 1) for its power of 2. A quantile is reported as the
+ * middle of its bucket, so the relative error is at most 2^-(QS_SUB_BITS + 1).
+ * Sketches of parts of the input merge by adding the counts.
+ */
+#define QS_SUB_BITS 7
+#define QS_BUCKETS ((UINT_BITS - QS_SUB_BITS + 1) << QS_SUB_BITS)
+
+typedef struct {
+	ull count;
+	ull bucket[QS_BUCKETS];
+} t_sketch;
+
+/* Number of significant bits in val */
+static uint bitlen(maxuint_t val)
+{
+#ifdef __SIZEOF_INT128__
+	if (val >> 64)
+		return 128 - (uint)__builtin_clzll((ull)(val >> 64));
+#endif
+	return val ? 64 - (uint)__builtin_clzll((ull)val) : 0;
+}
+
+static inline void qs_add(t_sketch *qs, maxuint_t val)
+{
+	uint bits = bitlen(val), shift;
+
+	++qs->count;
+
+	if (bits <= QS_SUB_BITS + 1) {
+		++qs->bucket[(uint)val];
+		return;
+	}
+
+	shift = bits - QS_SUB_BITS - 1;
+	++qs->bucket[(shift << QS_SUB_BITS) + (uint)(val >> shift)];
+}
+
+static inline void qs_merge(t_sketch *dst, const t_sketch *src)
+{
+	for (uint i = 0; i < QS_BUCKETS; ++i)
+		dst->bucket[i] += src->bucket[i];
+
+	dst->count += src->count;
+}
+
+/* Value at rank ceil(count * permille / 1000), the middle of its bucket */
+static maxuint_t qs_quantile(const t_sketch *qs, uint permille)
+{
+	maxuint_t rank = ((maxuint_t)qs->count * permille + 999) / 1000, seen = 0;
+	uint i = 0, shift;
+
+	if (!rank)
+		rank = 1;
+
+	for (; i < QS_BUCKETS - 1; ++i) {
+		seen += qs->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i < (2U << QS_SUB_BITS))
+		return i;
+
+	shift = (i >> QS_SUB_BITS) - 1;
+	return ((maxuint_t)(i - (shift << QS_SUB_BITS)) << shift) + ((maxuint_t)1 << (shift - 1));
+}
+
+/*
+ * Aggregation of sizes read from a column of text input
+ * Totals are exact: values below 2^64 are summed without checks, as a sum
+ * of fewer than 2^64 such values cannot wrap a 128-bit accumulator.
+ */
+#define AGG_BUCKETS (UINT_BITS + 1)
+
+typedef struct {
+	ull count;
+	ull skipped;   /* lines without a valid size */
+	maxuint_t sum; /* values < 2^64 */
+	maxuint_t big; /* values >= 2^64 */
+	bool overflow;
+	maxuint_t min;
+	maxuint_t max;
+	ull hist[AGG_BUCKETS]; /* bucket k holds values in [2^(k-1), 2^k) */
+	t_sketch *qs;          /* quantiles, NULL if not required */
+	uint field;            /* column of sizes */
+} t_agg;
+
+static void agg_init(t_agg *ag)
+{
+	memset(ag, 0, sizeof(t_agg));
+	ag->min = (maxuint_t)-1;
+}
+
+static inline void agg_add(t_agg *ag, maxuint_t val)
+{
+	if (FITS_U64(val))
+		ag->sum += val;
+	else if (!add_u(ag->big, val, &ag->big))
+		ag->overflow = true;
+
+	if (val < ag->min)
+		ag->min = val;
+	if (val > ag->max)
+		ag->max = val;
+
+	++ag->hist[bitlen(val)];
+	++ag->count;
+
+	if (ag->qs)
+		qs_add(ag->qs, val);
+}
+
+/* Size in a token of len bytes, false if it isn't one, unit is set if it has one */
+static bool size_token_unit(const char *tok, size_t len, maxuint_t *val, char *unit)
+{
+	const char *pch;
+	char buf[NUM_LEN];
+	ull acc = 0;
+
+	*unit = 0;
+
+	/* Fast path for decimal byte counts which fit in 64 bits */
+	if (len < 20) {
+		for (pch = tok; pch < tok + len && (uchar)(*pch - '0') < 10; ++pch)
+			acc = acc * 10 + (ull)(*pch - '0');
+
+		if (pch == tok + len) {
+			*val = acc;
+			return len != 0;
+		}
+	}
+
+	if (len >= NUM_LEN)
+		return false;
+
+	memcpy(buf, tok, len);
+	buf[len] = '\0';
+	return !strtosize(buf, NULL, val, unit);
+}
+
+static bool size_token(const char *tok, size_t len, maxuint_t *val)
+{
+	char unit;
+
+	return size_token_unit(tok, len, val, &unit);
+}
+
+/* Size in the field of a line, false if there is none */
+static bool agg_field(const char *line, const char *end, uint field, maxuint_t *val)
+{
+	const char *tok = line, *pch;
+
+	/* Fields are separated by blanks */
+	for (;;) {
+		while (tok < end && (*tok == ' ' || *tok == '\t'))
+			++tok;
+
+		if (tok == end)
+			return false;
+
+		if (field == 1)
+			break;
+
+		while (tok < end && *tok != ' ' && *tok != '\t')
+			++tok;
+		--field;
+	}
+
+	for (pch = tok; pch < end && *pch != ' ' && *pch != '\t' && *pch != '\r'; ++pch)
+		;
+
+	return size_token(tok, (size_t)(pch - tok), val);
+}
+
+/*
+ * Aggregate the complete lines in buf
+ * Returns the number of bytes consumed, a trailing partial line is left.
+ */
+static size_t agg_lines(t_agg *ag, const char *buf, size_t len, uint field)
+{
+	const char *line = buf, *end = buf + len, *eol;
+	maxuint_t val;
+
+	while ((eol = (const char *)memchr(line, '\n', (size_t)(end - line)))) {
+		if (agg_field(line, eol, field, &val))
+			agg_add(ag, val);
+		else if (eol > line)
+			++ag->skipped;
+
+		line = eol + 1;
+	}
+
+	return (size_t)(line - buf);
+}
+
+/*
+ * Lines of the input in fd are passed to fn in blocks of complete lines
+ * fn returns the number of bytes it consumed. Blocks are parsed where they
+ * were read or decompressed, only a line split between two blocks is
+ * copied. A line which doesn't fit in the buffer is dropped and reported
+ * to fn as a NULL block.
+ */
+typedef size_t (*t_linefn)(void *arg, const char *buf, size_t len);
+
+static int lines_fd(int fd, t_linefn fn, void *arg)
+{
+	static char buf[1 << 20], blk[IN_BUF_LEN];
+	const char *data, *eol;
+	size_t used = 0, n, k;
+	ssize_t len;
+	bool drop = false;
+	t_in in;
+
+	if (in_open(&in, fd) == -1)
+		return -1;
+
+	while ((len = in_next(&in, blk, sizeof(blk), &data)) > 0) {
+		n = (size_t)len;
+
+		/* Complete the line left in buf, or skip the rest of a dropped one */
+		if (used || drop) {
+			eol = (const char *)memchr(data, '\n', n);
+			k = eol ? (size_t)(eol + 1 - data) : n;
+			if (!drop && k < sizeof(buf) - used) {
+				memcpy(buf + used, data, k);
+				used += k;
+			} else if (!drop) {
+				fn(arg, NULL, 0);
+				drop = true;
+			}
+
+			data += k;
+			n -= k;
+			if (!eol)
+				continue;
+
+			if (!drop)
+				fn(arg, buf, used);
+			used = 0;
+			drop = false;
+		}
+
+		k = fn(arg, data, n);
+		data += k;
+		n -= k;
+
+		/* Keep the trailing partial line */
+		if (n < sizeof(buf)) {
+			memcpy(buf, data, n);
+			used = n;
+		} else {
+			fn(arg, NULL, 0);
+			drop = true;
+		}
+	}
+
+	in_close(&in);
+	if (len == -1) {
+		/* Decompression errors are reported by the decompressor */
+		if (!in.failed)
+			log(ERROR, "read()! [%s]\n", strerror(errno));
+		return -1;
+	}
+
+	/* Last line without newline */
+	if (used && !drop) {
+		buf[used++] = '\n';
+		fn(arg, buf, used);
+	}
+
+	return 0;
+}
+
+static size_t agg_linefn(void *arg, const char *buf, size_t len)
+{
+	t_agg *ag = (t_agg *)arg;
+
+	if (!buf) {
+		++ag->skipped;
+		return 0;
+	}
+
+	return agg_lines(ag, buf, len, ag->field);
+}
+
+static int agg_fd(t_agg *ag, int fd, uint field)
+{
+	ag->field = field;
+	return lines_fd(fd, agg_linefn, ag);
+}
+
+/*
+ * Binary input
+ * Values are unsigned integers of 4, 8 or 16 bytes, little or big-endian.
+ * Files are mapped, other input is read in blocks. Values are byte-swapped
+ * if needed and widened to 128 bits a block at a time.
+ */
+#define BIN_BLOCK 1024
+#define HOST_BE (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+typedef struct {
+	uint width;     /* bytes of a value, 0 for text input */
+	bool be;
+} t_binfmt;
+
+/* Blocks of values are passed to fn, NULL for a truncated record */
+typedef void (*t_valfn)(void *arg, const maxuint_t *v, size_t n);
+
+typedef struct {
+	t_binfmt bf;
+	uint words;     /* values in a record */
+	t_valfn fn;
+	void *arg;
+} t_binin;
+
+/* u32, u64 or u128, followed by le (default) or be */
+static int binfmt_parse(const char *str, t_binfmt *bf)
+{
+	char *end;
+	ulong bits;
+
+	if (*str != 'u' || !isdigit((uchar)str[1]))
+		return -1;
+
+	bits = strtoul(str + 1, &end, 10);
+	if (bits != 32 && bits != 64 && bits != 128)
+		return -1;
+
+	if (!*end || !strcmp(end, "le"))
+		bf->be = false;
+	else if (!strcmp(end, "be"))
+		bf->be = true;
+	else
+		return -1;
+
+	bf->width = (uint)(bits >> 3);
+	return 0;
+}
+
+static inline ull get_le64(const void *p)
+{
+	ull val;
+
+	memcpy(&val, p, sizeof(val));
+#if HOST_BE
+	val = __builtin_bswap64(val);
+#endif
+	return val;
+}
+
+/* Reverse the bytes of each value of width bytes in buf */
+static void bin_swap(char *buf, size_t len, uint width)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	/* Swap 16-bit words, then the bytes in them */
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((__m128i *)(buf + i));
+
+		if (width == 4) {
+			x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+			x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		} else {
+			x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+			x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+			if (width == 16)
+				x = _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2));
+		}
+
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i *)(buf + i), x);
+	}
+#endif
+
+	for (; i < len; i += width)
+		for (uint k = 0; k < width >> 1; ++k) {
+			char c = buf[i + k];
+
+			buf[i + k] = buf[i + width - 1 - k];
+			buf[i + width - 1 - k] = c;
+		}
+}
+
+/* Decode n <= BIN_BLOCK values at buf */
+static void bin_decode(const t_binfmt *bf, const char *buf, size_t n, maxuint_t *v)
+{
+	char tmp[BIN_BLOCK * 16];
+	size_t i;
+
+	if (bf->be != HOST_BE) {
+		memcpy(tmp, buf, n * bf->width);
+		bin_swap(tmp, n * bf->width, bf->width);
+		buf = tmp;
+	}
+
+	if (bf->width == 4)
+		for (i = 0; i < n; ++i) {
+			uint val;
+
+			memcpy(&val, buf + i * 4, 4);
+			v[i] = val;
+		}
+	else if (bf->width == 8)
+		for (i = 0; i < n; ++i) {
+			ull val;
+
+			memcpy(&val, buf + i * 8, 8);
+			v[i] = val;
+		}
+	else
+		memcpy(v, buf, n * 16);
+}
+
+/*
+ * Fixed size binary records of the input in fd are passed to fn in blocks
+ * fn returns the number of bytes it consumed. A trailing partial record is
+ * reported to fn as a NULL block.
+ */
+static int records_fd(int fd, size_t recsz, t_linefn fn, void *arg)
+{
+	static char buf[1 << 20];
+	struct stat sb;
+	size_t used = 0, done;
+	ssize_t len;
+	char *map;
+	t_in in;
+
+	if (!fstat(fd, &sb) && S_ISREG(sb.st_mode)) {
+		used = (size_t)sb.st_size;
+		if (!used)
+			return 0;
+
+		map = (char *)mmap(NULL, used, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			if (in_type((uchar *)map, used) == IN_PLAIN) {
+				madvise(map, used, MADV_SEQUENTIAL);
+				fn(arg, map, used - used % recsz);
+				munmap(map, used);
+				if (used % recsz) {
+					fn(arg, NULL, 0);
+					return -1;
+				}
+
+				return 0;
+			}
+
+			/* Compressed, decompress as a stream */
+			munmap(map, used);
+		}
+
+		used = 0;
+	}
+
+	if (in_open(&in, fd) == -1)
+		return -1;
+
+	while ((len = in_read(&in, buf + used, sizeof(buf) - used)) > 0) {
+		used += (size_t)len;
+		done = fn(arg, buf, used - used % recsz);
+		used -= done;
+		memmove(buf, buf + done, used);
+	}
+
+	in_close(&in);
+	if (len == -1) {
+		if (!in.failed)
+			log(ERROR, "read()! [%s]\n", strerror(errno));
+		return -1;
+	}
+
+	if (used) {
+		fn(arg, NULL, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+static size_t bin_recfn(void *arg, const char *buf, size_t len)
+{
+	t_binin *bi = (t_binin *)arg;
+	maxuint_t v[BIN_BLOCK];
+	size_t n = len / bi->bf.width, block = BIN_BLOCK - BIN_BLOCK % bi->words, k;
+
+	if (!buf) {
+		bi->fn(bi->arg, NULL, 0);
+		return 0;
+	}
+
+	for (size_t i = 0; i < n; i += k) {
+		k = n - i < block ? n - i : block;
+		bin_decode(&bi->bf, buf + i * bi->bf.width, k, v);
+		bi->fn(bi->arg, v, k);
+	}
+
+	return len;
+}
+
+/* Pass the values in fd to fn, in records of words values */
+static int bin_fd(int fd, const t_binfmt *bf, uint words, t_valfn fn, void *arg)
+{
+	t_binin bi = {*bf, words, fn, arg};
+
+	return records_fd(fd, (size_t)bf->width * words, bin_recfn, &bi);
+}
+
+static void agg_valfn(void *arg, const maxuint_t *v, size_t n)
+{
+	t_agg *ag = (t_agg *)arg;
+
+	if (!v) {
+		log(ERROR, "truncated value\n");
+		return;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		agg_add(ag, v[i]);
+}
+
+/* Power of 2 as a binary prefix label, e.g. 4 KiB */
+static char *p2label(uint exp, char *buf, size_t len)
+{
+	static const char * const prefix[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB", "ZiB", "YiB"};
+
+	if (exp / 10 < ARRAY_SIZE(prefix))
+		snprintf(buf, len, "%u %s", 1U << (exp % 10), prefix[exp / 10]);
+	else
+		snprintf(buf, len, "2^%u B", exp);
+
+	return buf;
+}
+
+/* Size in IEC and SI units, e.g. "512 MiB, 536.87 MB" */
+static char *sizestr(maxuint_t bytes, char *buf, size_t len)
+{
+	static const char * const iec[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB"};
+	static const char * const si[] = {"B", "kB", "MB", "GB", "TB", "PB", "EB"};
+	maxuint_t iecsz = 1, sisz = 1;
+	uint i = 0, j = 0;
+
+	while (i + 1 < ARRAY_SIZE(iec) && bytes >= iecsz << 10) {
+		iecsz <<= 10;
+		++i;
+	}
+
+	while (j + 1 < ARRAY_SIZE(si) && bytes >= sisz * 1000) {
+		sisz *= 1000;
+		++j;
+	}
+
+	snprintf(buf, len, "%.*Lf %s, %.*Lf %s",
+		 bytes % iecsz ? 2 : 0, (maxfloat_t)bytes / iecsz, iec[i],
+		 bytes % sisz ? 2 : 0, (maxfloat_t)bytes / sisz, si[j]);
+	return buf;
+}
+
+static int agg_print(t_agg *ag)
+{
+	maxuint_t total;
+	char lo[16], hi[16];
+	int ret;
+
+	if (!ag->count) {
+		log(ERROR, "no values\n");
+		return -1;
+	}
+
+	if (ag->overflow || !add_u(ag->sum, ag->big, &total)) {
+		log(ERROR, "overflow in total\n");
+		return -1;
+	}
+
+	if (!cfg.minimal)
+		fprintf(fout, "\033[1mTOTAL\033[0m\n");
+	convertbyte(getstr_u128(total, uint_buf), &ret);
+
+	if (!cfg.minimal)
+		fprintf(fout, "\n\033[1mSTATS\033[0m\n");
+	fprintf(fout, " count %llu\n", ag->count);
+	fprintf(fout, " min   %s B\n", getstr_u128(ag->min, uint_buf));
+	fprintf(fout, " max   %s B\n", getstr_u128(ag->max, uint_buf));
+	fprintf(fout, " mean  %s B\n", getstr_u128(div_u(total, ag->count), uint_buf));
+	if (ag->skipped)
+		fprintf(fout, " skip  %llu\n", ag->skipped);
+
+	if (!cfg.minimal)
+		fprintf(fout, "\n\033[1mHISTOGRAM\033[0m\n");
+	for (uint k = 0; k < AGG_BUCKETS; ++k) {
+		if (!ag->hist[k])
+			continue;
+
+		if (!k)
+			fprintf(fout, " %9s   %-9s %llu\n", "0 B", "", ag->hist[k]);
+		else
+			fprintf(fout, " %9s - %-9s %llu\n", p2label(k - 1, lo, sizeof(lo)),
+				p2label(k, hi, sizeof(hi)), ag->hist[k]);
+	}
+
+	if (ag->qs) {
+		static const uint permille[] = {500, 900, 990, 999};
+		static const char * const label[] = {"p50 ", "p90 ", "p99 ", "p999"};
+		maxuint_t val;
+
+		if (!cfg.minimal)
+			fprintf(fout, "\n\033[1mQUANTILES\033[0m\n");
+		for (uint i = 0; i < ARRAY_SIZE(permille); ++i) {
+			/* The middle of the bucket may lie outside the input */
+			val = qs_quantile(ag->qs, permille[i]);
+			val = val < ag->min ? ag->min : (val > ag->max ? ag->max : val);
+			fprintf(fout, " %s  %s B\n", label[i], getstr_u128(val, uint_buf));
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Scanner for sizes in free text, e.g. "size=1.5GiB", "4096 B" or "0x1000"
+ * A decimal number must be followed by a unit, optionally after a blank.
+ * Hex numbers are bytes unless a unit follows. Tokens must not be part of
+ * a word, so "x86" or "v1.5GiB" are not sizes.
+ */
+#define SCAN_TOKEN_MAX 128 /* longer digit runs are never sizes */
+
+/* Character classes without locale lookups */
+static inline bool isdec(char c)
+{
+	return (uchar)(c - '0') < 10;
+}
+
+static inline bool isletter(char c)
+{
+	return (uchar)((c | 0x20) - 'a') < 26;
+}
+
+static inline bool ishex(char c)
+{
+	return isdec(c) || (uchar)((c | 0x20) - 'a') < 6;
+}
+
+static inline bool isword(char c)
+{
+	return isdec(c) || isletter(c) || c == '_';
+}
+
+/* Report a size found by the scanner */
+static void scan_emit(t_agg *ag, maxuint_t val)
+{
+	if (ag)
+		agg_add(ag, val);
+	else
+		fprintf(fout, "%s\n", getstr_u128(val, uint_buf));
+}
+
+/*
+ * Match a size at buf[pos], a digit which does not follow a word character
+ * Returns the offset to continue scanning from, 0 if the token may continue
+ * beyond len and more input is required.
+ */
+static size_t scan_token(const char *buf, size_t len, size_t pos, bool final, t_agg *ag)
+{
+	char num[SCAN_TOKEN_MAX], unit[4];
+	size_t i = pos, end, ulen, k, n;
+	bool hex = false;
+	maxuint_t val;
+	char isunit;
+
+	if (buf[i] == '0' && i + 2 < len && (buf[i + 1] | 0x20) == 'x' && ishex(buf[i + 2])) {
+		hex = true;
+		for (i += 2; i < len && ishex(buf[i]); ++i)
+			;
+	} else {
+		while (i < len && isdec(buf[i])) {
+			++i;
+
+			/* Digits grouped by commas, e.g. 1,024 */
+			if (i < len && buf[i] == ',') {
+				if (i + 4 >= len && !final)
+					return (len - pos < SCAN_TOKEN_MAX) ? 0 : i;
+
+				if (i + 3 < len && isdec(buf[i + 1]) && isdec(buf[i + 2]) &&
+				    isdec(buf[i + 3]) && !(i + 4 < len && isdec(buf[i + 4])))
+					++i;
+			}
+		}
+
+		if (i + 1 < len && buf[i] == '.' && isdec(buf[i + 1]))
+			for (++i; i < len && isdec(buf[i]); ++i)
+				;
+	}
+
+	end = i;
+	if (end - pos >= NUM_LEN)
+		goto skip;
+
+	/* Unit, optionally after a blank */
+	if (i < len && buf[i] == ' ')
+		++i;
+
+	for (ulen = 0; i < len && isletter(buf[i]) && ulen < sizeof(unit); ++i)
+		unit[ulen++] = buf[i];
+
+	if (i == len && !final)
+		return (len - pos < SCAN_TOKEN_MAX) ? 0 : end;
+
+	for (k = pos, n = 0; k < end; ++k)
+		if (buf[k] != ',')
+			num[n++] = buf[k];
+	num[n] = '\0';
+
+	/* All units end with 'b' */
+	if (ulen && ulen < sizeof(unit) && (unit[ulen - 1] | 0x20) == 'b' &&
+	    !(i < len && isword(buf[i]))) {
+		unit[ulen] = '\0';
+		if (unitidx(unit) != -1) {
+			if (!strtosize(num, unit, &val, &isunit))
+				scan_emit(ag, val);
+			else if (ag)
+				++ag->skipped;
+			return i;
+		}
+	}
+
+	if (hex && !(end < len && isword(buf[end]))) {
+		if (!strtosize(num, NULL, &val, &isunit))
+			scan_emit(ag, val);
+		else if (ag)
+			++ag->skipped;
+	}
+
+skip:
+	/* Skip the rest of the word */
+	while (end < len && (isword(buf[end]) || buf[end] == '.'))
+		++end;
+
+	if (end == len && !final && end - pos < SCAN_TOKEN_MAX)
+		return 0;
+
+	return end;
+}
+
+/* Bit i is set if buf[i] is a decimal digit */
+static inline uint digitmask(const char *buf)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)buf), _mm_set1_epi8('0'));
+
+	return (uint)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(9)), v));
+#else
+	uint mask = 0;
+
+	for (uint i = 0; i < 16; ++i)
+		mask |= (uint)isdec(buf[i]) << i;
+
+	return mask;
+#endif
+}
+
+/*
+ * Scan buf[start, len) for sizes, buf[start - 1] is context if start > 0
+ * Unless final, a token at the end may be incomplete and is left unscanned.
+ * Returns the offset up to which buf was scanned.
+ */
+static size_t scan_buf(const char *buf, size_t start, size_t len, bool final, t_agg *ag)
+{
+	size_t i = start, next;
+	uint mask;
+
+	while (i < len) {
+		/* Find the first digit which starts a run, 16 bytes at a time */
+		if (i + 16 <= len) {
+			mask = digitmask(buf + i);
+			mask &= ~((mask << 1) | (i && isdec(buf[i - 1])));
+			if (!mask) {
+				i += 16;
+				continue;
+			}
+
+			i += (uint)__builtin_ctz(mask);
+		} else if (!isdec(buf[i]) || (i && isdec(buf[i - 1]))) {
+			++i;
+			continue;
+		}
+
+		/* Digits after a word, a fraction or a digit group start no size */
+		if (i && (isword(buf[i - 1]) || buf[i - 1] == '.' ||
+			  (buf[i - 1] == ',' && i > 1 && isdec(buf[i - 2])))) {
+			while (i < len && isdec(buf[i]))
+				++i;
+			continue;
+		}
+
+		next = scan_token(buf, len, i, final, ag);
+		if (!next)
+			return i;
+
+		i = next;
+	}
+
+	return len;
+}
+
+/* Scan a file, mapped if possible */
+static int scan_fd(t_agg *ag, int fd)
+{
+	static char buf[1 << 20];
+	struct stat sb;
+	size_t used = 0, start = 0, done;
+	ssize_t len;
+	char *map;
+	t_in in;
+
+	if (!fstat(fd, &sb) && S_ISREG(sb.st_mode)) {
+		if (!sb.st_size)
+			return 0;
+
+		map = (char *)mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			if (in_type((uchar *)map, (size_t)sb.st_size) == IN_PLAIN) {
+				madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+				scan_buf(map, 0, (size_t)sb.st_size, true, ag);
+				munmap(map, (size_t)sb.st_size);
+				return 0;
+			}
+
+			/* Compressed, decompress as a stream */
+			munmap(map, (size_t)sb.st_size);
+		}
+	}
+
+	if (in_open(&in, fd) == -1)
+		return -1;
+
+	/* Keep a byte of context before the unscanned input */
+	while ((len = in_read(&in, buf + used, sizeof(buf) - used)) > 0) {
+		used += (size_t)len;
+		done = scan_buf(buf, start, used, false, ag);
+		if (done > start) {
+			used -= done - 1;
+			memmove(buf, buf + done - 1, used);
+			start = 1;
+		}
+	}
+
+	in_close(&in);
+	if (len == -1) {
+		/* Decompression errors are reported by the decompressor */
+		if (!in.failed)
+			log(ERROR, "read()! [%s]\n", strerror(errno));
+		return -1;
+	}
+
+	scan_buf(buf, start, used, true, ag);
+	return 0;
+}
+
+/* Merge the aggregate of a part of the input */
+static void agg_merge(t_agg *dst, const t_agg *src)
+{
+	/* Both sums of values < 2^64 are bounded by their counts */
+	dst->sum += src->sum;
+	if (src->overflow || !add_u(dst->big, src->big, &dst->big))
+		dst->overflow = true;
+
+	if (src->count) {
+		if (src->min < dst->min)
+			dst->min = src->min;
+		if (src->max > dst->max)
+			dst->max = src->max;
+	}
+
+	for (uint k = 0; k < AGG_BUCKETS; ++k)
+		dst->hist[k] += src->hist[k];
+
+	dst->count += src->count;
+	dst->skipped += src->skipped;
+
+	if (dst->qs && src->qs)
+		qs_merge(dst->qs, src->qs);
+}
+
+/* Aggregate buf, a trailing line may lack the newline */
+static void agg_chunk(t_agg *ag, const char *buf, size_t len, uint field)
+{
+	size_t done = agg_lines(ag, buf, len, field);
+	maxuint_t val;
+
+	if (done == len)
+		return;
+
+	if (agg_field(buf + done, buf + len, field, &val))
+		agg_add(ag, val);
+	else
+		++ag->skipped;
+}
+
+/*
+ * Parallel ingestion of mapped files
+ * Files are split into newline-aligned chunks which are dealt to the
+ * workers round-robin. A worker takes chunks from the tail of its own
+ * queue and steals from the head of others' when it runs out, so small
+ * files don't wait behind a large one and a single large file uses all
+ * workers. Each worker aggregates its chunks and the aggregates are
+ * merged at the end.
+ */
+#define POOL_CHUNK (8 << 20)
+
+typedef struct {
+	const char *map;
+	size_t off;
+	size_t len;
+} t_task;
+
+typedef struct {
+	pthread_mutex_t lock;
+	t_task *tasks;
+	size_t head;    /* next task to steal */
+	size_t tail;    /* one past the next task of the owner */
+	size_t cap;
+	t_agg ag;
+	pthread_t tid;
+	struct t_pool *pool;
+} t_worker;
+
+typedef struct t_pool {
+	t_worker *workers;
+	uint count;
+	uint field;
+	bool scan;
+} t_pool;
+
+static bool pool_push(t_worker *w, const char *map, size_t off, size_t len)
+{
+	if (w->tail == w->cap && !sev_grow((void **)&w->tasks, &w->cap, sizeof(t_task)))
+		return false;
+
+	w->tasks[w->tail].map = map;
+	w->tasks[w->tail].off = off;
+	w->tasks[w->tail].len = len;
+	++w->tail;
+	return true;
+}
+
+/* Take a task from the tail of own queue, else from the head of another */
+static bool pool_take(t_worker *self, t_task *task)
+{
+	t_pool *pool = self->pool;
+	uint id = (uint)(self - pool->workers);
+	bool found = false;
+
+	for (uint i = 0; i < pool->count && !found; ++i) {
+		t_worker *w = &pool->workers[(id + i) % pool->count];
+
+		pthread_mutex_lock(&w->lock);
+		if (w->head < w->tail) {
+			*task = (w == self) ? w->tasks[--w->tail] : w->tasks[w->head++];
+			found = true;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return found;
+}
+
+static void *pool_worker(void *arg)
+{
+	t_worker *w = (t_worker *)arg;
+	t_task task;
+
+	while (pool_take(w, &task)) {
+		if (w->pool->scan)
+			/* The byte before a chunk is a newline */
+			scan_buf(task.map, task.off, task.off + task.len, true, &w->ag);
+		else
+			agg_chunk(&w->ag, task.map + task.off, task.len, w->pool->field);
+	}
+
+	return NULL;
+}
+
+/* Split a mapped file into chunks ending at a newline */
+static bool pool_split(t_pool *pool, const char *map, size_t size, uint *next)
+{
+	size_t off = 0, end;
+	const char *eol;
+
+	while (off < size) {
+		end = (size - off > POOL_CHUNK) ? off + POOL_CHUNK : size;
+		if (end < size) {
+			eol = (const char *)memchr(map + end, '\n', size - end);
+			end = eol ? (size_t)(eol - map) + 1 : size;
+		}
+
+		if (!pool_push(&pool->workers[*next], map, off, end - off))
+			return false;
+
+		*next = (*next + 1) % pool->count;
+		off = end;
+	}
+
+	return true;
+}
+
+/*
+ * Aggregate files with jobs threads into ag
+ * Input which can't be mapped, like stdin, is read by the calling thread.
+ */
+static int pool_files(char **files, int count, t_agg *ag, uint field, bool scan, uint jobs)
+{
+	t_pool pool = {NULL, jobs, field, scan};
+	struct stat sb;
+	char **maps;
+	size_t *sizes;
+	int *fds;
+	uint next = 0, started = 0;
+	int fd, ret = 0;
+
+	pool.workers = (t_worker *)mem_calloc(jobs, sizeof(t_worker));
+	maps = (char **)mem_calloc((size_t)count, sizeof(char *));
+	sizes = (size_t *)mem_calloc((size_t)count, sizeof(size_t));
+	fds = (int *)mem_malloc((size_t)count * sizeof(int));
+	if (!pool.workers || !maps || !sizes || !fds) {
+		log(ERROR, "out of memory\n");
+		ret = -1;
+		goto done;
+	}
+
+	for (uint i = 0; i < jobs; ++i) {
+		pthread_mutex_init(&pool.workers[i].lock, NULL);
+		agg_init(&pool.workers[i].ag);
+		pool.workers[i].pool = &pool;
+	}
+
+	for (uint i = 0; i < jobs; ++i) {
+		if (ag->qs) {
+			pool.workers[i].ag.qs = (t_sketch *)mem_calloc(1, sizeof(t_sketch));
+			if (!pool.workers[i].ag.qs) {
+				log(ERROR, "out of memory\n");
+				ret = -1;
+				goto done;
+			}
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		fds[i] = -1;
+		fd = strcmp(files[i], "-") ? open(files[i], O_RDONLY) : STDIN_FILENO;
+		if (fd == -1) {
+			log(ERROR, "%s: %s\n", files[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if (fstat(fd, &sb) == -1) {
+			log(ERROR, "%s: %s\n", files[i], strerror(errno));
+			ret = -1;
+			if (fd != STDIN_FILENO)
+				close(fd);
+			continue;
+		}
+
+		if (S_ISREG(sb.st_mode) && sb.st_size) {
+			maps[i] = (char *)mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (maps[i] == MAP_FAILED)
+				maps[i] = NULL;
+			else if (in_type((uchar *)maps[i], (size_t)sb.st_size) != IN_PLAIN) {
+				/* Compressed files are decompressed as a stream */
+				munmap(maps[i], (size_t)sb.st_size);
+				maps[i] = NULL;
+			} else {
+				sizes[i] = (size_t)sb.st_size;
+				if (!pool_split(&pool, maps[i], sizes[i], &next))
+					ret = -1;
+			}
+		}
+
+		/* Files which can't be mapped are read by this thread */
+		if (!maps[i] && !(S_ISREG(sb.st_mode) && !sb.st_size))
+			fds[i] = fd;
+		else if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	for (; started < jobs; ++started)
+		if (pthread_create(&pool.workers[started].tid, NULL, pool_worker,
+				   &pool.workers[started])) {
+			log(ERROR, "pthread_create()! [%s]\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+	/* Meanwhile read the input which is not mapped */
+	for (int i = 0; i < count; ++i) {
+		if (fds[i] == -1)
+			continue;
+
+		if ((scan ? scan_fd(ag, fds[i]) : agg_fd(ag, fds[i], field)) == -1)
+			ret = -1;
+
+		if (fds[i] != STDIN_FILENO)
+			close(fds[i]);
+	}
+
+	/* Workers steal each other's chunks, so any one of them finishes all */
+	if (!started)
+		pool_worker(&pool.workers[0]);
+
+	for (uint i = 0; i < started; ++i)
+		pthread_join(pool.workers[i].tid, NULL);
+
+	log(DEBUG, "%u workers\n", started);
+
+done:
+	if (pool.workers)
+		for (uint i = 0; i < jobs; ++i) {
+			agg_merge(ag, &pool.workers[i].ag);
+			free(pool.workers[i].ag.qs);
+			free(pool.workers[i].tasks);
+			pthread_mutex_destroy(&pool.workers[i].lock);
+		}
+
+	for (int i = 0; maps && i < count; ++i)
+		if (maps[i])
+			munmap(maps[i], sizes[i]);
+
+	free(pool.workers);
+	free(maps);
+	free(sizes);
+	free(fds);
+	return ret;
+}
+
+/*
+ * Files in argv followed by the paths listed in path, one per line
+ * Returns NULL on failure
+ */
+static char **filelist(const char *path, char **argv, int argc, int *count)
+{
+	FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	char **files = NULL, *line = NULL;
+	size_t cap = 0, linecap = 0;
+	ssize_t len;
+
+	if (!fp) {
+		log(ERROR, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	*count = 0;
+	for (int i = 0; i < argc; ++i) {
+		if ((size_t)*count == cap && !sev_grow((void **)&files, &cap, sizeof(char *)))
+			goto error;
+		files[(*count)++] = argv[i];
+	}
+
+	while ((len = getline(&line, &linecap, fp)) != -1) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		if ((size_t)*count == cap && !sev_grow((void **)&files, &cap, sizeof(char *)))
+			goto error;
+
+		files[*count] = mem_strdup(line);
+		if (!files[*count]) {
+			log(ERROR, "out of memory\n");
+			goto error;
+		}
+		++*count;
+	}
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return files;
+
+error:
+	free(line);
+	free(files);
+	if (fp != stdin)
+		fclose(fp);
+	return NULL;
+}
+
+static int ingest_fd(t_agg *ag, int fd, uint field, bool scan, const t_binfmt *bf)
+{
+	if (bf && bf->width)
+		return bin_fd(fd, bf, 1, agg_valfn, ag);
+
+	return scan ? scan_fd(ag, fd) : agg_fd(ag, fd, field);
+}
+
+/*
+ * Read sizes from files, or stdin if there are none
+ * Sizes are read from a column, scanned for in the text if scan is set, or
+ * read as binary values if bf has a width. They are aggregated in ag, or
+ * printed if ag is NULL.
+ */
+static int ingest_files(char **files, int count, t_agg *ag, uint field, bool scan,
+			const t_binfmt *bf)
+{
+	int fd, ret = 0;
+
+	if (!count)
+		return ingest_fd(ag, STDIN_FILENO, field, scan, bf);
+
+	for (int i = 0; i < count; ++i) {
+		fd = strcmp(files[i], "-") ? open(files[i], O_RDONLY) : STDIN_FILENO;
+		if (fd == -1) {
+			log(ERROR, "%s: %s\n", files[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if (ingest_fd(ag, fd, field, scan, bf) == -1)
+			ret = -1;
+
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	return ret;
+}
+
+static int aggregate_files(char **files, int count, uint field, bool quantiles, bool scan,
+			   uint jobs, const t_binfmt *bf)
+{
+	t_agg ag;
+	struct timespec start;
+	int ret;
+
+	agg_init(&ag);
+	if (quantiles) {
+		ag.qs = (t_sketch *)mem_calloc(1, sizeof(t_sketch));
+		if (!ag.qs) {
+			log(ERROR, "out of memory\n");
+			return -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (jobs > 1 && count && !bf->width)
+		ret = pool_files(files, count, &ag, field, scan, jobs);
+	else
+		ret = ingest_files(files, count, &ag, field, scan, bf);
+	log(DEBUG, "%llu values in %.6f s\n", ag.count, elapsed(&start));
+
+	if (agg_print(&ag) == -1)
+		ret = -1;
+
+	free(ag.qs);
+	return ret;
+}
+
+/*
+ * Division by a constant divisor with a multiply and shifts
+ * The magic number is the reciprocal of d rounded up, as in Granlund and
+ * Montgomery, "Division by invariant integers using multiplication". A power
+ * of 2 uses a shift and a mask.
+ */
+typedef struct {
+	ull d;
+	ull magic;
+	ull mask;   /* d - 1 if d is a power of 2 */
+	uint shift;
+	bool pow2;
+	bool add;   /* the magic number needs 65 bits */
+} t_divisor;
+
+static void div_init(t_divisor *dv, ull d)
+{
+	uint log2d = 63 - (uint)__builtin_clzll(d);
+	ull rem, rem2;
+
+	memset(dv, 0, sizeof(t_divisor));
+	dv->d = d;
+	dv->shift = log2d;
+
+	if (!(d & (d - 1))) {
+		dv->pow2 = true;
+		dv->mask = d - 1;
+		return;
+	}
+
+	/* floor(2^(64 + log2d) / d) */
+	dv->magic = (ull)(((maxuint_t)1 << (64 + log2d)) / d);
+	rem = (ull)(((maxuint_t)1 << (64 + log2d)) % d);
+
+	if (d - rem >= (1ULL << log2d)) {
+		/* Use 2^(65 + log2d) / d and fix the lost bit with an add */
+		dv->add = true;
+		dv->magic <<= 1;
+		rem2 = rem << 1;
+		if (rem2 >= d || rem2 < rem)
+			++dv->magic;
+	}
+
+	++dv->magic;
+}
+
+static inline ull div_q(const t_divisor *dv, ull n)
+{
+	ull q;
+
+	if (dv->pow2)
+		return n >> dv->shift;
+
+	q = (ull)(((maxuint_t)dv->magic * n) >> 64);
+	if (dv->add)
+		return (((n - q) >> 1) + q) >> dv->shift;
+
+	return q >> dv->shift;
+}
+
+/* Buffered output with write(), for output of bulk modes */
+#define OUT_BUF_LEN (1 << 16)
+
+static struct {
+	char buf[OUT_BUF_LEN];
+	size_t len;
+} out;
+
+/* write(2) all of buf, a signal may interrupt it */
+static int write_all(int fd, const char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = write(fd, buf + done, len - done);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			log(ERROR, "write()! [%s]\n", strerror(errno));
+			return -1;
+		}
+
+		done += (size_t)ret;
+	}
+
+	return 0;
+}
+
+static int out_flush(void)
+{
+	int ret = write_all(STDOUT_FILENO, out.buf, out.len);
+
+	out.len = 0;
+	return ret;
+}
+
+/* Make room for len bytes */
+static inline char *out_reserve(size_t len)
+{
+	if (out.len + len > OUT_BUF_LEN)
+		out_flush();
+
+	return out.buf + out.len;
+}
+
+static inline void out_char(char c)
+{
+	*out_reserve(1) = c;
+	++out.len;
+}
+
+static void out_mem(const char *p, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (out.len == OUT_BUF_LEN)
+			out_flush();
+
+		n = OUT_BUF_LEN - out.len < len ? OUT_BUF_LEN - out.len : len;
+		memcpy(out.buf + out.len, p, n);
+		out.len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static inline void out_str(const char *str)
+{
+	size_t len = strlen(str);
+
+	memcpy(out_reserve(len), str, len);
+	out.len += len;
+}
+
+/* Decimal, 2 digits at a time */
+static inline void out_dec(ull val)
+{
+	static const char digits[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	char tmp[20], *pch = tmp + sizeof(tmp);
+	size_t len;
+
+	while (val >= 100) {
+		uint r = (uint)(val % 100);
+
+		val /= 100;
+		pch -= 2;
+		memcpy(pch, digits + 2 * r, 2);
+	}
+
+	if (val >= 10) {
+		pch -= 2;
+		memcpy(pch, digits + 2 * val, 2);
+	} else
+		*--pch = (char)('0' + val);
+
+	len = (size_t)(tmp + sizeof(tmp) - pch);
+	memcpy(out_reserve(len), pch, len);
+	out.len += len;
+}
+
+static inline void out_u128(maxuint_t val)
+{
+	if (FITS_U64(val))
+		out_dec((ull)val);
+	else
+		out_str(getstr_u128(val, uint_buf));
+}
+
+static inline void out_hex(maxuint_t val)
+{
+	char buf[HEX_BUF_LEN];
+
+	out_str(hexstr(val, buf));
+}
+
+static inline void out_bin(maxuint_t val)
+{
+	char buf[BIN_BUF_LEN];
+
+	out_str(binstr(val, buf));
+}
+
+/*
+ * Batch mapping of byte addresses to LBA:OFFSET
+ * Each line of input holds an address in the selected column. An output
+ * line has LBA:OFFSET for each sector size, separated by a blank.
+ */
+typedef struct {
+	t_divisor dv[2];
+	uint ndv;
+	uint field;
+	ull line;
+	ull errors;
+} t_lbamap;
+
+static void lba_map(const t_lbamap *lm, maxuint_t addr)
+{
+	for (uint i = 0; i < lm->ndv; ++i) {
+		const t_divisor *dv = &lm->dv[i];
+
+		if (i)
+			out_char(' ');
+
+		if (FITS_U64(addr)) {
+			ull q = div_q(dv, (ull)addr);
+
+			out_dec(q);
+			out_char(':');
+			out_dec((ull)addr - q * dv->d);
+		} else {
+			out_u128(div_u(addr, dv->d));
+			out_char(':');
+			out_u128(mod_u(addr, dv->d));
+		}
+	}
+
+	out_char('\n');
+}
+
+static size_t lba_linefn(void *arg, const char *buf, size_t len)
+{
+	t_lbamap *lm = (t_lbamap *)arg;
+	const char *line = buf, *end = buf + len, *eol;
+	maxuint_t addr;
+
+	if (!buf) {
+		++lm->line;
+		++lm->errors;
+		out_flush();
+		log(ERROR, "line %llu: line too long\n", lm->line);
+		return 0;
+	}
+
+	while ((eol = (const char *)memchr(line, '\n', (size_t)(end - line)))) {
+		++lm->line;
+		if (agg_field(line, eol, lm->field, &addr))
+			lba_map(lm, addr);
+		else {
+			/* Keep errors in sequence with the output */
+			++lm->errors;
+			out_flush();
+			log(ERROR, "line %llu: invalid address\n", lm->line);
+		}
+
+		line = eol + 1;
+	}
+
+	return (size_t)(line - buf);
+}
+
+/* Binary addresses */
+static void lba_valfn(void *arg, const maxuint_t *v, size_t n)
+{
+	t_lbamap *lm = (t_lbamap *)arg;
+
+	if (!v) {
+		++lm->line;
+		++lm->errors;
+		out_flush();
+		log(ERROR, "record %llu: truncated\n", lm->line);
+		return;
+	}
+
+	lm->line += n;
+	for (size_t i = 0; i < n; ++i)
+		lba_map(lm, v[i]);
+}
+
+/* Map addresses from files, or stdin if there are none */
+static int lba_files(char **files, int count, ulong sectorsz, uint field, bool dual,
+		     const t_binfmt *bf)
+{
+	t_lbamap lm = {{{0}}, 0, field, 0, 0};
+	int fd, ret = 0;
+
+	if (!sectorsz) {
+		log(ERROR, "sector size must be +ve\n");
+		return -1;
+	}
+
+	/* 512e and 4Kn */
+	if (dual) {
+		div_init(&lm.dv[lm.ndv++], 512);
+		div_init(&lm.dv[lm.ndv++], 4096);
+	} else
+		div_init(&lm.dv[lm.ndv++], sectorsz);
+
+	for (int i = 0; i < (count ? count : 1); ++i) {
+		if (!count || !strcmp(files[i], "-"))
+			fd = STDIN_FILENO;
+		else
+			fd = open(files[i], O_RDONLY);
+
+		if (fd == -1) {
+			out_flush();
+			log(ERROR, "%s: %s\n", files[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if ((bf->width ? bin_fd(fd, bf, 1, lba_valfn, &lm)
+			       : lines_fd(fd, lba_linefn, &lm)) == -1)
+			ret = -1;
+
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	if (out_flush() == -1 || lm.errors)
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * Bulk CHS <-> LBA conversion
+ * A record is C,H,S or LBA, optionally followed by MAX_HEAD,MAX_SECTOR.
+ * Division constants of a geometry are computed once and kept in a small
+ * cache, so sweeps over a few geometries don't set them up per record.
+ */
+#define GEOM_CACHE 64
+
+typedef struct {
+	ull mh;
+	ull ms;
+	maxuint_t hs;   /* MAX_HEAD * MAX_SECTOR */
+	t_divisor dh;
+	t_divisor ds;
+} t_geom;
+
+typedef struct {
+	t_geom geom;    /* default geometry */
+	t_geom cache[GEOM_CACHE];
+	bool tolba;
+	ull rec;
+	ull errors;
+} t_chsmap;
+
+static void geom_init(t_geom *g, ull mh, ull ms)
+{
+	g->mh = mh;
+	g->ms = ms;
+	g->hs = (maxuint_t)mh * ms;
+	div_init(&g->dh, mh);
+	div_init(&g->ds, ms);
+}
+
+static const t_geom *geom_get(t_chsmap *cm, ull mh, ull ms)
+{
+	t_geom *g;
+
+	if (mh == cm->geom.mh && ms == cm->geom.ms)
+		return &cm->geom;
+
+	g = &cm->cache[(mh * 31 + ms) % GEOM_CACHE];
+	if (g->mh != mh || g->ms != ms)
+		geom_init(g, mh, ms);
+
+	return g;
+}
+
+/* Convert a record of n values, returns an error message on failure */
+static const char *chs_conv(t_chsmap *cm, const ull *v, int n)
+{
+	const t_geom *g = &cm->geom;
+	maxuint_t lba;
+	ull q, c;
+	int geo = cm->tolba ? 3 : 1;
+
+	if (n != geo && n != geo + 2)
+		return "invalid record";
+
+	if (n > geo) {
+		if (!v[geo])
+			return "MAX_HEAD = 0";
+		if (!v[geo + 1])
+			return "MAX_SECTOR = 0";
+
+		g = geom_get(cm, v[geo], v[geo + 1]);
+	}
+
+	if (cm->tolba) {
+		if (!v[2])
+			return "S = 0";
+		if (v[1] > g->mh)
+			return "H > MAX_HEAD";
+		if (v[2] > g->ms)
+			return "S > MAX_SECTOR";
+
+		/* MH * MS * C + MS * H + S - 1 */
+		if (!mul_u(g->hs, v[0], &lba) ||
+		    !add_u(lba, (maxuint_t)g->ms * v[1] + v[2] - 1, &lba))
+			return "LBA overflow";
+
+		out_u128(lba);
+		out_char('\n');
+		return NULL;
+	}
+
+	/* C = L / MS / MH, H = L / MS % MH, S = L % MS + 1 */
+	q = div_q(&g->ds, v[0]);
+	c = div_q(&g->dh, q);
+	out_dec(c);
+	out_char(',');
+	out_dec(q - c * g->mh);
+	out_char(',');
+	out_dec(v[0] - q * g->ms + 1);
+	out_char('\n');
+	return NULL;
+}
+
+static void chs_error(t_chsmap *cm, const char *what, const char *err)
+{
+	/* Keep errors in sequence with the output */
+	++cm->errors;
+	out_flush();
+	log(ERROR, "%s %llu: %s\n", what, cm->rec, err);
+}
+
+/*
+ * Values in a line, separated by ',', '-' or blanks
+ * Decimal, 0x (hex) and 0b (binary) are accepted. Returns the number of
+ * values, or -1 if a value is invalid or there are too many.
+ */
+static int chs_fields(const char *line, const char *end, ull *v, int max)
+{
+	const char *start;
+	int n = 0;
+	uint base, digit;
+	ull val;
+
+	for (;;) {
+		while (line < end && (*line == ',' || *line == '-' || *line == ' ' ||
+				      *line == '\t' || *line == '\r'))
+			++line;
+
+		if (line == end)
+			return n;
+
+		if (n == max)
+			return -1;
+
+		base = 10;
+		if (line[0] == '0' && end - line > 2) {
+			if (line[1] == 'x' || line[1] == 'X')
+				base = 16;
+			else if (line[1] == 'b' || line[1] == 'B')
+				base = 2;
+
+			if (base != 10)
+				line += 2;
+		}
+
+		val = 0;
+		start = line;
+		for (; line < end; ++line) {
+			if (isdec(*line))
+				digit = (uint)(*line - '0');
+			else if (base == 16 && ishex(*line))
+				digit = (uint)((*line | 0x20) - 'a' + 10);
+			else
+				break;
+
+			if (digit >= base || __builtin_mul_overflow(val, (ull)base, &val) ||
+			    __builtin_add_overflow(val, (ull)digit, &val))
+				return -1;
+		}
+
+		if (line == start || (line < end && *line != ',' && *line != '-' &&
+				      *line != ' ' && *line != '\t' && *line != '\r'))
+			return -1;
+
+		v[n++] = val;
+	}
+}
+
+static size_t chs_linefn(void *arg, const char *buf, size_t len)
+{
+	t_chsmap *cm = (t_chsmap *)arg;
+	const char *line = buf, *end = buf + len, *eol, *err;
+	ull v[5];
+	int n;
+
+	if (!buf) {
+		++cm->rec;
+		chs_error(cm, "line", "line too long");
+		return 0;
+	}
+
+	while ((eol = (const char *)memchr(line, '\n', (size_t)(end - line)))) {
+		++cm->rec;
+		n = chs_fields(line, eol, v, 5);
+		if (n) {
+			err = n < 0 ? "invalid record" : chs_conv(cm, v, n);
+			if (err)
+				chs_error(cm, "line", err);
+		}
+
+		line = eol + 1;
+	}
+
+	return (size_t)(line - buf);
+}
+
+/* Binary records: C, H, S or LBA */
+static void chs_valfn(void *arg, const maxuint_t *v, size_t n)
+{
+	t_chsmap *cm = (t_chsmap *)arg;
+	int words = cm->tolba ? 3 : 1;
+	const char *err;
+	ull rec[3];
+
+	if (!v) {
+		++cm->rec;
+		chs_error(cm, "record", "truncated");
+		return;
+	}
+
+	for (size_t done = 0; done < n; done += (size_t)words) {
+		++cm->rec;
+		err = NULL;
+		for (int i = 0; i < words; ++i) {
+			if (!FITS_U64(v[done + i]))
+				err = "out of range";
+			rec[i] = (ull)v[done + i];
+		}
+
+		if (!err)
+			err = chs_conv(cm, rec, words);
+		if (err)
+			chs_error(cm, "record", err);
+	}
+}
+
+/* Convert records from files, or stdin if there are none */
+static int chs_files(char **files, int count, bool tolba, const ull *geometry,
+		     const t_binfmt *bf)
+{
+	t_chsmap *cm = (t_chsmap *)mem_calloc(1, sizeof(t_chsmap));
+	int fd, ret = 0;
+
+	if (!cm) {
+		log(ERROR, "calloc()! [%s]\n", strerror(errno));
+		return -1;
+	}
+
+	geom_init(&cm->geom, geometry[0], geometry[1]);
+	cm->tolba = tolba;
+
+	for (int i = 0; i < (count ? count : 1); ++i) {
+		if (!count || !strcmp(files[i], "-"))
+			fd = STDIN_FILENO;
+		else
+			fd = open(files[i], O_RDONLY);
+
+		if (fd == -1) {
+			out_flush();
+			log(ERROR, "%s: %s\n", files[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if ((bf->width ? bin_fd(fd, bf, tolba ? 3 : 1, chs_valfn, cm)
+			       : lines_fd(fd, chs_linefn, cm)) == -1)
+			ret = -1;
+
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	if (out_flush() == -1 || cm->errors)
+		ret = -1;
+
+	free(cm);
+	return ret;
+}
+
+/*
+ * Alignment check of offsets
+ * A power of 2 is checked with a mask, in SIMD lanes for binary input where
+ * most blocks of offsets are expected to be aligned. Other alignments, e.g.
+ * RAID stripes, use the reciprocal of the alignment.
+ */
+typedef struct {
+	maxuint_t n;
+	maxuint_t mask;     /* n - 1 if n is a power of 2 */
+	t_divisor dv;
+	bool pow2;
+	bool wide;          /* n doesn't fit in 64 bits */
+	uint field;
+	ull rec;
+	ull count;
+	ull misaligned;
+	ull skipped;
+	const char *what;   /* "line" or "record" */
+} t_align;
+
+static void align_init(t_align *al, maxuint_t n, uint field)
+{
+	memset(al, 0, sizeof(t_align));
+	al->n = n;
+	al->field = field;
+	al->pow2 = !(n & (n - 1));
+	al->mask = al->pow2 ? n - 1 : 0;
+	al->wide = !FITS_U64(n);
+	if (!al->wide)
+		div_init(&al->dv, (ull)n);
+}
+
+static inline maxuint_t align_rem(const t_align *al, maxuint_t off)
+{
+	if (al->pow2)
+		return off & al->mask;
+
+	if (!al->wide && FITS_U64(off))
+		return (ull)off - div_q(&al->dv, (ull)off) * (ull)al->n;
+
+	return mod_u(off, al->n);
+}
+
+/* Report a misaligned offset with the aligned values around it */
+static void align_report(t_align *al, maxuint_t off, maxuint_t rem)
+{
+	maxuint_t up;
+
+	++al->misaligned;
+	out_str(al->what);
+	out_char(' ');
+	out_dec(al->rec);
+	out_str(": ");
+	out_u128(off);
+	out_str(" down ");
+	out_u128(off - rem);
+	if (add_u(off - rem, al->n, &up)) {
+		out_str(" up ");
+		out_u128(up);
+	}
+	out_char('\n');
+}
+
+static inline void align_check(t_align *al, maxuint_t off)
+{
+	maxuint_t rem = align_rem(al, off);
+
+	++al->rec;
+	++al->count;
+	if (rem)
+		align_report(al, off, rem);
+}
+
+static size_t align_linefn(void *arg, const char *buf, size_t len)
+{
+	t_align *al = (t_align *)arg;
+	const char *line = buf, *end = buf + len, *eol;
+	maxuint_t off;
+
+	if (!buf) {
+		++al->rec;
+		++al->skipped;
+		return 0;
+	}
+
+	while ((eol = (const char *)memchr(line, '\n', (size_t)(end - line)))) {
+		if (agg_field(line, eol, al->field, &off))
+			align_check(al, off);
+		else {
+			++al->rec;
+			if (eol > line)
+				++al->skipped;
+		}
+
+		line = eol + 1;
+	}
+
+	return (size_t)(line - buf);
+}
+
+/* Binary offsets */
+static void align_valfn(void *arg, const maxuint_t *v, size_t n)
+{
+	t_align *al = (t_align *)arg;
+	size_t i = 0;
+
+	if (!v) {
+		++al->rec;
+		++al->skipped;
+		out_flush();
+		log(ERROR, "record %llu: truncated\n", al->rec);
+		return;
+	}
+
+#ifdef __SSE2__
+	/* 8 offsets at a time, only a block with a misaligned one is looked into */
+	if (al->pow2) {
+		const __m128i mask = _mm_set_epi64x((long long)(al->mask >> 32 >> 32),
+						    (long long)al->mask);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i *p;
+		__m128i acc;
+
+		for (; i + 8 <= n; i += 8) {
+			p = (const __m128i *)(v + i);
+			acc = _mm_or_si128(_mm_or_si128(_mm_or_si128(p[0], p[1]),
+							_mm_or_si128(p[2], p[3])),
+					   _mm_or_si128(_mm_or_si128(p[4], p[5]),
+							_mm_or_si128(p[6], p[7])));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(acc, mask), zero))
+			    == 0xffff) {
+				al->rec += 8;
+				al->count += 8;
+				continue;
+			}
+
+			for (uint k = 0; k < 8; ++k)
+				align_check(al, v[i + k]);
+		}
+	}
+#endif
+
+	for (; i < n; ++i)
+		align_check(al, v[i]);
+}
+
+/* Check offsets from files, or stdin if there are none */
+static int align_files(char **files, int count, maxuint_t n, uint field, const t_binfmt *bf)
+{
+	t_align al;
+	int fd, ret = 0;
+
+	align_init(&al, n, field);
+	al.what = bf->width ? "record" : "line";
+
+	for (int i = 0; i < (count ? count : 1); ++i) {
+		if (!count || !strcmp(files[i], "-"))
+			fd = STDIN_FILENO;
+		else
+			fd = open(files[i], O_RDONLY);
+
+		if (fd == -1) {
+			out_flush();
+			log(ERROR, "%s: %s\n", files[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if ((bf->width ? bin_fd(fd, bf, 1, align_valfn, &al)
+			       : lines_fd(fd, align_linefn, &al)) == -1)
+			ret = -1;
+
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	if (out_flush() == -1)
+		ret = -1;
+
+	fprintf(fout, " count      %llu\n aligned    %llu\n misaligned %llu\n",
+		al.count, al.count - al.misaligned, al.misaligned);
+	if (al.skipped)
+		fprintf(fout, " skip       %llu\n", al.skipped);
+
+	return ret;
+}
+
+/*
+ * Range sets
+ * Ranges are START+LEN, kept as [start, end) in 32 bytes each. They are
+ * sorted in place with an MSD radix sort on the start, from its highest
+ * non-zero byte, and merged in one pass.
+ */
+#define RANGE_ISORT 32
+
+typedef struct {
+	maxuint_t start;
+	maxuint_t end;
+} t_range;
+
+typedef struct {
+	t_range *r;
+	size_t count;
+	size_t cap;
+	maxuint_t scale;    /* bytes per unit of plain values */
+	ull rec;
+	ull errors;
+	ull empty;
+	bool oom;
+} t_rangeset;
+
+/*
+ * Value at *pos of a range, a unit may follow after blanks
+ * *pos is moved past it. The scale of --sectors applies to values without
+ * a unit.
+ */
+static bool range_value(const t_rangeset *rs, const char **pos, const char *end, maxuint_t *val)
+{
+	const char *tok = *pos, *unit, *pch;
+	char buf[NUM_LEN], isunit;
+	size_t len, ulen;
+
+	for (pch = tok; pch < end && *pch != '+' && *pch != ' ' && *pch != '\t' && *pch != '\r'; ++pch)
+		;
+	len = (size_t)(pch - tok);
+	*pos = pch;
+
+	for (unit = pch; unit < end && (*unit == ' ' || *unit == '\t'); ++unit)
+		;
+	for (pch = unit; pch < end && isalpha((uchar)*pch); ++pch)
+		;
+	ulen = (size_t)(pch - unit);
+
+	/* 10 KiB is read as 10KiB */
+	if (len && ulen && unit > *pos && len + ulen < sizeof(buf) &&
+	    (pch == end || *pch == '+' || *pch == ' ' || *pch == '\t' || *pch == '\r')) {
+		memcpy(buf, tok, len);
+		memcpy(buf + len, unit, ulen);
+		buf[len + ulen] = '\0';
+		if (unitidx(buf + len) != -1) {
+			tok = buf;
+			len += ulen;
+			*pos = pch;
+		}
+	}
+
+	if (!size_token_unit(tok, len, val, &isunit))
+		return false;
+
+	return isunit || mul_u(*val, rs->scale, val);
+}
+
+/* START+LEN or START LEN, false if the line isn't a range */
+static bool range_parse(const t_rangeset *rs, const char *line, const char *end, t_range *r)
+{
+	const char *pch;
+	maxuint_t len;
+
+	while (line < end && (*line == ' ' || *line == '\t'))
+		++line;
+
+	if (!range_value(rs, &line, end, &r->start))
+		return false;
+
+	while (line < end && (*line == '+' || *line == ' ' || *line == '\t'))
+		++line;
+
+	pch = line;
+	if (!range_value(rs, &pch, end, &len))
+		return false;
+
+	/* Nothing but blanks may follow */
+	while (pch < end && (*pch == ' ' || *pch == '\t' || *pch == '\r'))
+		++pch;
+
+	return pch == end && add_u(r->start, len, &r->end);
+}
+
+static size_t range_linefn(void *arg, const char *buf, size_t len)
+{
+	t_rangeset *rs = (t_rangeset *)arg;
+	const char *line = buf, *end = buf + len, *eol;
+	t_range r;
+
+	if (!buf) {
+		++rs->rec;
+		++rs->errors;
+		log(ERROR, "line %llu: line too long\n", rs->rec);
+		return 0;
+	}
+
+	while ((eol = (const char *)memchr(line, '\n', (size_t)(end - line)))) {
+		++rs->rec;
+		if (eol == line || (eol == line + 1 && *line == '\r')) {
+			line = eol + 1;
+			continue;
+		}
+
+		if (!range_parse(rs, line, eol, &r)) {
+			++rs->errors;
+			log(ERROR, "line %llu: invalid range\n", rs->rec);
+		} else if (r.end == r.start)
+			++rs->empty;
+		else if (rs->count < rs->cap ||
+			 (!rs->oom && sev_grow((void **)&rs->r, &rs->cap, sizeof(t_range))))
+			rs->r[rs->count++] = r;
+		else
+			rs->oom = true;
+
+		line = eol + 1;
+	}
+
+	return (size_t)(line - buf);
+}
+
+/* In place MSD radix sort of ranges on the start, byte is the digit */
+static void range_sort(t_range *r, size_t n, int byte)
+{
+	size_t count[256] = {0}, next[256], end[256], i;
+	t_range tmp;
+	uint b, d;
+
+	if (n < RANGE_ISORT) {
+		for (i = 1; i < n; ++i) {
+			size_t j = i;
+
+			tmp = r[i];
+			for (; j && r[j - 1].start > tmp.start; --j)
+				r[j] = r[j - 1];
+			r[j] = tmp;
+		}
+		return;
+	}
+
+	for (i = 0; i < n; ++i)
+		++count[(uint)(r[i].start >> (byte << 3)) & 0xff];
+
+	/* All starts have the same digit, go to the next one */
+	b = (uint)(r[0].start >> (byte << 3)) & 0xff;
+	if (count[b] == n) {
+		if (byte)
+			range_sort(r, n, byte - 1);
+		return;
+	}
+
+	for (i = 0, b = 0; b < 256; ++b) {
+		next[b] = i;
+		i += count[b];
+		end[b] = i;
+	}
+
+	/* Swap each range into its bucket */
+	for (b = 0; b < 256; ++b)
+		while (next[b] < end[b]) {
+			d = (uint)(r[next[b]].start >> (byte << 3)) & 0xff;
+			if (d == b) {
+				++next[b];
+				continue;
+			}
+
+			tmp = r[next[b]];
+			r[next[b]] = r[next[d]];
+			r[next[d]++] = tmp;
+		}
+
+	if (byte)
+		for (i = 0, b = 0; b < 256; i += count[b++])
+			if (count[b] > 1)
+				range_sort(r + i, count[b], byte - 1);
+}
+
+/* Sort and merge overlapping or adjacent ranges, returns the gaps */
+static ull range_merge(t_rangeset *rs, maxuint_t *gapsz)
+{
+	maxuint_t top = 0;
+	size_t i, n = 0;
+	int byte = 0;
+	ull gaps = 0;
+
+	*gapsz = 0;
+	if (!rs->count)
+		return 0;
+
+	for (i = 0; i < rs->count; ++i)
+		top |= rs->r[i].start;
+
+	while (byte + 1 < (int)sizeof(maxuint_t) && top >> ((byte + 1) << 3))
+		++byte;
+
+	range_sort(rs->r, rs->count, byte);
+
+	for (i = 1; i < rs->count; ++i) {
+		if (rs->r[i].start <= rs->r[n].end) {
+			if (rs->r[i].end > rs->r[n].end)
+				rs->r[n].end = rs->r[i].end;
+			continue;
+		}
+
+		++gaps;
+		*gapsz += rs->r[i].start - rs->r[n].end;
+		rs->r[++n] = rs->r[i];
+	}
+
+	rs->count = n + 1;
+	return gaps;
+}
+
+static void range_out(maxuint_t start, maxuint_t end)
+{
+	out_u128(start);
+	out_char('+');
+	out_u128(end - start);
+	out_char('\n');
+}
+
+/* An address as LBA:OFFSET */
+static void range_lba(const char *label, maxuint_t addr, ulong sectorsz)
+{
+	fprintf(fout, " %-8s%s:", label, getstr_u128(addr / sectorsz, uint_buf));
+	fprintf(fout, "%s\n", getstr_u128(addr % sectorsz, uint_buf));
+}
+
+static void range_size(const char *label, ull count, maxuint_t bytes)
+{
+	char size[64];
+
+	fprintf(fout, " %-8s%llu, %s B (%s)\n", label, count, getstr_u128(bytes, uint_buf),
+		sizestr(bytes, size, sizeof(size)));
+}
+
+static int range_read(t_rangeset *rs, const char *path)
+{
+	int fd, ret;
+
+	if (rs->oom)
+		return -1;
+
+	fd = (!path || !strcmp(path, "-")) ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd == -1) {
+		log(ERROR, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	rs->rec = 0;
+	ret = lines_fd(fd, range_linefn, rs);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	return rs->errors || rs->oom ? -1 : ret;
+}
+
+/*
+ * Merge the ranges in files, or stdin if there are none, and show them with
+ * the coverage and gaps. With intersect, there are two files and the
+ * ranges in both are shown.
+ */
+static int range_files(char **files, int count, ulong sectorsz, bool sectors, bool intersect)
+{
+	t_rangeset rs[2];
+	maxuint_t covered = 0, gapsz;
+	ull gaps, overlaps = 0, input;
+	size_t i, j;
+	int ret = 0, nsets = intersect ? 2 : 1;
+
+	if (intersect && count != 2) {
+		log(ERROR, "--intersect needs 2 files\n");
+		return -1;
+	}
+
+	if (!sectorsz) {
+		log(ERROR, "sector size must be +ve\n");
+		return -1;
+	}
+
+	memset(rs, 0, sizeof(rs));
+	for (int k = 0; k < nsets; ++k) {
+		rs[k].scale = sectors ? sectorsz : 1;
+		for (int f = intersect ? k : 0; f < (intersect ? k + 1 : count ? count : 1); ++f)
+			if (range_read(&rs[k], count ? files[f] : NULL) == -1)
+				ret = -1;
+	}
+
+	input = rs[0].count + rs[0].empty;
+	gaps = range_merge(&rs[0], &gapsz);
+
+	if (!intersect) {
+		for (i = 0; i < rs[0].count; ++i) {
+			range_out(rs[0].r[i].start, rs[0].r[i].end);
+			covered += rs[0].r[i].end - rs[0].r[i].start;
+		}
+	} else {
+		range_merge(&rs[1], &gapsz);
+
+		/* Sweep both sorted sets */
+		for (i = j = 0; i < rs[0].count && j < rs[1].count;) {
+			const t_range *a = &rs[0].r[i], *b = &rs[1].r[j];
+			maxuint_t start = a->start > b->start ? a->start : b->start;
+			maxuint_t end = a->end < b->end ? a->end : b->end;
+
+			if (start < end) {
+				range_out(start, end);
+				covered += end - start;
+				++overlaps;
+			}
+
+			if (a->end < b->end)
+				++i;
+			else
+				++j;
+		}
+	}
+
+	if (out_flush() == -1)
+		ret = -1;
+
+	if (!cfg.minimal) {
+		if (intersect) {
+			fprintf(fout, " ranges  %llu, %llu\n", input, (ull)(rs[1].count + rs[1].empty));
+			range_size("overlap", overlaps, covered);
+		} else {
+			fprintf(fout, " ranges  %llu, %llu merged\n", input, (ull)rs[0].count);
+			range_size("covered", rs[0].count, covered);
+			range_size("gaps", gaps, gapsz);
+			if (rs[0].count) {
+				range_lba("start", rs[0].r[0].start, sectorsz);
+				range_lba("end", rs[0].r[rs[0].count - 1].end, sectorsz);
+			}
+		}
+	}
+
+	free(rs[0].r);
+	free(rs[1].r);
+	return ret;
+}
+
+/*
+ * Sort of lines by size
+ * The size in the field of each line, following the unit rules, is its
+ * 128-bit key, so 1 kB sorts before 1 KiB. (key, line) pairs are sorted with
+ * a stable LSD radix sort which skips the bytes that are the same in all
+ * keys. Lines stay in the mapped or read input and are only copied out.
+ */
+typedef struct {
+	ull lo;
+	ull hi;
+	const char *line;
+} t_sortkey;
+
+typedef struct {
+	char *p;
+	size_t len;
+	bool mapped;
+} t_sortbuf;
+
+typedef struct {
+	t_sortkey *keys;
+	size_t count;
+	size_t cap;
+	const char **bad;   /* lines without a size, in input order */
+	size_t nbad;
+	size_t badcap;
+	t_sortbuf *bufs;
+	size_t nbufs;
+	size_t bufcap;
+	size_t hit;         /* buffer of the last line written */
+	uint field;
+	size_t hist[16][256]; /* counts of each key byte */
+} t_sort;
+
+/* Index the lines of a buffer which ends with a newline */
+static bool sort_index(t_sort *st, const char *buf, size_t len)
+{
+	const char *line = buf, *end = buf + len, *eol;
+	maxuint_t val;
+
+	for (; line < end; line = eol + 1) {
+		eol = (const char *)memchr(line, '\n', (size_t)(end - line));
+		if (agg_field(line, eol, st->field, &val)) {
+			if (st->count == st->cap &&
+			    !sev_grow((void **)&st->keys, &st->cap, sizeof(t_sortkey)))
+				return false;
+
+			st->keys[st->count].lo = (ull)val;
+			st->keys[st->count].hi = (ull)(val >> 32 >> 32);
+			st->keys[st->count++].line = line;
+		} else {
+			if (st->nbad == st->badcap &&
+			    !sev_grow((void **)&st->bad, &st->badcap, sizeof(char *)))
+				return false;
+
+			st->bad[st->nbad++] = line;
+		}
+	}
+
+	return true;
+}
+
+static bool sort_addbuf(t_sort *st, char *p, size_t len, bool mapped)
+{
+	if (st->nbufs == st->bufcap &&
+	    !sev_grow((void **)&st->bufs, &st->bufcap, sizeof(t_sortbuf)))
+		return false;
+
+	st->bufs[st->nbufs].p = p;
+	st->bufs[st->nbufs].len = len;
+	st->bufs[st->nbufs++].mapped = mapped;
+	return true;
+}
+
+/* Read a file, mapped if possible, and index its lines */
+static int sort_fd(t_sort *st, int fd)
+{
+	struct stat sb;
+	size_t len = 0, cap = 0, body;
+	ssize_t n = 0;
+	char *buf = NULL, *tmp;
+	t_in in;
+
+	if (!fstat(fd, &sb) && S_ISREG(sb.st_mode) && sb.st_size) {
+		len = (size_t)sb.st_size;
+		buf = (char *)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED && in_type((uchar *)buf, len) == IN_PLAIN) {
+			if (!sort_addbuf(st, buf, len, true)) {
+				munmap(buf, len);
+				return -1;
+			}
+
+			for (body = len; body && buf[body - 1] != '\n'; --body)
+				;
+
+			if (!sort_index(st, buf, body))
+				return -1;
+
+			if (body == len)
+				return 0;
+
+			/* The last line without a newline gets a copy with one */
+			tmp = (char *)mem_malloc(len - body + 1);
+			if (!tmp || !sort_addbuf(st, tmp, len - body + 1, false)) {
+				free(tmp);
+				log(ERROR, "out of memory\n");
+				return -1;
+			}
+
+			memcpy(tmp, buf + body, len - body);
+			tmp[len - body] = '\n';
+			return sort_index(st, tmp, len - body + 1) ? 0 : -1;
+		}
+
+		/* Compressed, decompress as a stream */
+		if (buf != MAP_FAILED)
+			munmap(buf, len);
+		buf = NULL;
+		len = 0;
+	}
+
+	if (in_open(&in, fd) == -1)
+		return -1;
+
+	for (;;) {
+		/* Room for a newline at the end */
+		if (cap - len < 2) {
+			cap = cap ? cap << 1 : 1 << 20;
+			tmp = (char *)mem_realloc(buf, cap);
+			if (!tmp) {
+				log(ERROR, "out of memory\n");
+				n = -1;
+				break;
+			}
+			buf = tmp;
+		}
+
+		n = in_read(&in, buf + len, cap - len - 1);
+		if (n <= 0)
+			break;
+		len += (size_t)n;
+	}
+
+	in_close(&in);
+	if (n == -1) {
+		if (errno != ENOMEM && !in.failed)
+			log(ERROR, "read()! [%s]\n", strerror(errno));
+		free(buf);
+		return -1;
+	}
+
+	if (!len) {
+		free(buf);
+		return 0;
+	}
+
+	if (buf[len - 1] != '\n')
+		buf[len++] = '\n';
+
+	if (!sort_addbuf(st, buf, len, false)) {
+		free(buf);
+		return -1;
+	}
+
+	return sort_index(st, buf, len) ? 0 : -1;
+}
+
+/* LSD radix sort on bytes of the keys, returns the sorted array */
+static t_sortkey *sort_keys(t_sort *st, t_sortkey *tmp)
+{
+	size_t (*hist)[256] = st->hist;
+	t_sortkey *a = st->keys, *swap;
+	size_t i, sum, cnt, n = st->count;
+	uint d, b;
+
+	memset(st->hist, 0, sizeof(st->hist));
+	for (i = 0; i < n; ++i)
+		for (d = 0; d < 8; ++d) {
+			++hist[d][(a[i].lo >> (d << 3)) & 0xff];
+			++hist[d + 8][(a[i].hi >> (d << 3)) & 0xff];
+		}
+
+	for (d = 0; d < 16; ++d) {
+		ull word = d < 8 ? a[0].lo : a[0].hi;
+		uint shift = (d & 7) << 3;
+
+		/* All keys have the same byte */
+		if (hist[d][(word >> shift) & 0xff] == n)
+			continue;
+
+		for (b = 0, sum = 0; b < 256; ++b) {
+			cnt = hist[d][b];
+			hist[d][b] = sum;
+			sum += cnt;
+		}
+
+		for (i = 0; i < n; ++i) {
+			word = d < 8 ? a[i].lo : a[i].hi;
+			tmp[hist[d][(word >> shift) & 0xff]++] = a[i];
+		}
+
+		swap = a;
+		a = tmp;
+		tmp = swap;
+	}
+
+	return a;
+}
+
+/* Write the line at p, the buffer it is in ends with a newline */
+static void sort_out(t_sort *st, const char *p)
+{
+	const t_sortbuf *b = &st->bufs[st->hit];
+
+	if (p < b->p || p >= b->p + b->len)
+		for (st->hit = 0; st->hit < st->nbufs; ++st->hit) {
+			b = &st->bufs[st->hit];
+			if (p >= b->p && p < b->p + b->len)
+				break;
+		}
+
+	out_mem(p, (size_t)((const char *)memchr(p, '\n', (size_t)(b->p + b->len - p)) - p) + 1);
+}
+
+/* Sort the lines of files, or stdin if there are none */
+static int sort_files(char **files, int count, uint field)
+{
+	t_sort st;
+	t_sortkey *tmp = NULL, *sorted;
+	int fd, ret = 0;
+	size_t i;
+
+	memset(&st, 0, sizeof(st));
+	st.field = field;
+
+	for (int k = 0; k < (count ? count : 1); ++k) {
+		if (!count || !strcmp(files[k], "-"))
+			fd = STDIN_FILENO;
+		else
+			fd = open(files[k], O_RDONLY);
+
+		if (fd == -1) {
+			log(ERROR, "%s: %s\n", files[k], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if (sort_fd(&st, fd) == -1)
+			ret = -1;
+
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	sorted = st.keys;
+	if (!ret && st.count > 1) {
+		tmp = (t_sortkey *)mem_malloc(st.count * sizeof(t_sortkey));
+		if (tmp)
+			sorted = sort_keys(&st, tmp);
+		else {
+			log(ERROR, "out of memory\n");
+			ret = -1;
+		}
+	}
+
+	/* Lines without a size go first, as in sort -h */
+	if (!ret) {
+		for (i = 0; i < st.nbad; ++i)
+			sort_out(&st, st.bad[i]);
+		for (i = 0; i < st.count; ++i)
+			sort_out(&st, sorted[i].line);
+	}
+
+	if (out_flush() == -1)
+		ret = -1;
+
+	for (i = 0; i < st.nbufs; ++i)
+		if (st.bufs[i].mapped)
+			munmap(st.bufs[i].p, st.bufs[i].len);
+		else
+			free(st.bufs[i].p);
+
+	free(st.bufs);
+	free(st.keys);
+	free(tmp);
+	free(st.bad);
+	return ret;
+}
+
+/*
+ * Sequence of offsets
+ * START, END and STEP are expressions. The values are formatted into the
+ * output buffer, which is written a block at a time.
+ */
+enum {
+	SEQ_DEC,
+	SEQ_HEX,
+	SEQ_LBA,
+	SEQ_BIN,
+};
+
+static const char * const seq_formats[] = {"dec", "hex", "lba", "bin"};
+
+/* Value of an expression in bytes */
+static int seq_arg(char *arg, maxuint_t *val)
+{
+	Data d = {"", 0};
+	char *pch;
+
+	if (evalexpr(arg, &d) == -1)
+		return -1;
+
+	*val = strtouquad(d.p, &pch);
+	if (*pch) {
+		log(ERROR, "%s: out of range\n", arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int seq_run(char **args, int count, const char *format, ulong sectorsz)
+{
+	maxuint_t val[3], v;
+	t_divisor dv;
+	int fmt;
+
+	if (count != 3) {
+		log(ERROR, "--seq needs START END STEP\n");
+		return -1;
+	}
+
+	for (fmt = 0; fmt < (int)ARRAY_SIZE(seq_formats); ++fmt)
+		if (!strcmp(format, seq_formats[fmt]))
+			break;
+
+	if (fmt == ARRAY_SIZE(seq_formats)) {
+		log(ERROR, "invalid format\n");
+		return -1;
+	}
+
+	for (int i = 0; i < 3; ++i)
+		if (seq_arg(args[i], &val[i]) == -1)
+			return -1;
+
+	if (!val[2]) {
+		log(ERROR, "step must be +ve\n");
+		return -1;
+	}
+
+	if (fmt == SEQ_LBA) {
+		if (!sectorsz) {
+			log(ERROR, "sector size must be +ve\n");
+			return -1;
+		}
+
+		div_init(&dv, sectorsz);
+	}
+
+	/* 64-bit values, the common case */
+	if (FITS_U64(val[0]) && FITS_U64(val[1]) && FITS_U64(val[2]) && fmt != SEQ_BIN) {
+		ull end = (ull)val[1], step = (ull)val[2], q;
+
+		for (ull u = (ull)val[0]; u <= end; u += step) {
+			if (fmt == SEQ_DEC)
+				out_dec(u);
+			else if (fmt == SEQ_HEX)
+				out_hex(u);
+			else {
+				q = div_q(&dv, u);
+				out_dec(q);
+				out_char(':');
+				out_dec(u - q * sectorsz);
+			}
+			out_char('\n');
+
+			if (end - u < step)
+				break;
+		}
+
+		return out_flush();
+	}
+
+	for (v = val[0]; v <= val[1]; v += val[2]) {
+		if (fmt == SEQ_DEC)
+			out_u128(v);
+		else if (fmt == SEQ_HEX)
+			out_hex(v);
+		else if (fmt == SEQ_BIN)
+			out_bin(v);
+		else {
+			out_u128(div_u(v, sectorsz));
+			out_char(':');
+			out_u128(mod_u(v, sectorsz));
+		}
+		out_char('\n');
+
+		if (val[1] - v < val[2])
+			break;
+	}
+
+	return out_flush();
+}
+
+/*
+ * Partition tables of disk images
+ * The image is mapped and the MBR, its chain of extended boot records and
+ * the GPT entries are read in place. LBAs are in units of the sector size.
+ */
+#define MBR_TABLE 446
+#define EBR_MAX 4096    /* EBRs in a chain */
+#define GPT_ENTRIES_MAX (1 << 20)
+
+typedef struct {
+	const uchar *map;
+	size_t len;
+	ulong secsz;
+	uint count;
+	uint misaligned;
+} t_part;
+
+static const struct {
+	const char *guid;   /* first 4 bytes, little-endian */
+	const char *name;
+} gpt_types[] = {
+	{"\x28\x73\x2a\xc1", "EFI"},
+	{"\x48\x61\x68\x21", "BIOS"},
+	{"\xaf\x3d\xc6\x0f", "Linux"},
+	{"\x6d\xfd\x57\x06", "swap"},
+	{"\x79\xd3\xd6\xe6", "LVM"},
+	{"\x0f\x88\x9d\xa1", "RAID"},
+	{"\xa2\xa0\xd0\xeb", "MS data"},
+	{"\x16\xe3\xc9\xe3", "MS rsvd"},
+};
+
+static inline uint get_le32(const uchar *p)
+{
+	return (uint)p[0] | (uint)p[1] << 8 | (uint)p[2] << 16 | (uint)p[3] << 24;
+}
+
+static uint part_crc32(const uchar *p, size_t len)
+{
+	static uint table[256];
+	uint crc = 0xffffffff;
+
+	if (!table[1])
+		for (uint i = 0; i < 256; ++i) {
+			uint c = i;
+
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/* Print a partition of sectors LBAs from start */
+static void part_show(t_part *pt, uint num, const char *type, ull start, ull sectors,
+		      const char *note)
+{
+	maxuint_t offset = (maxuint_t)start * pt->secsz;
+	maxuint_t end = (maxuint_t)start + sectors - 1;
+	char size[64];
+
+	++pt->count;
+	fprintf(fout, "%4u  %-8s %14s", num, type, getstr_u128(start, uint_buf));
+	fprintf(fout, " %14s", getstr_u128(end, uint_buf));
+	fprintf(fout, " %14llu", sectors);
+	fprintf(fout, " %18s  %-22s %s", getstr_u128(offset, uint_buf),
+		sizestr((maxuint_t)sectors * pt->secsz, size, sizeof(size)), note);
+
+	/* Physical sectors of Advanced Format disks are 4 KiB */
+	if (offset % 4096) {
+		++pt->misaligned;
+		fprintf(fout, " [misaligned]");
+	}
+
+	if ((end + 1) * pt->secsz > pt->len)
+		fprintf(fout, " [beyond image]");
+
+	fprintf(fout, "\n");
+}
+
+static void part_header(const char *scheme, t_part *pt)
+{
+	/* The scheme is kept in minimal output, without escapes */
+	if (!cfg.minimal)
+		fprintf(fout, "\033[1m%s\033[0m (sector size %lu)\n", scheme, pt->secsz);
+	else
+		fprintf(fout, "%s (sector size %lu)\n", scheme, pt->secsz);
+	fprintf(fout, "%4s  %-8s %14s %14s %14s %18s  %-22s %s\n", "#", "type", "start LBA",
+		"end LBA", "sectors", "start byte", "size", "CHS/name");
+}
+
+static bool isextended(uchar type)
+{
+	return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+/* A primary or logical MBR entry with its CHS start and end */
+static void mbr_entry(t_part *pt, uint num, const uchar *e, ull base)
+{
+	char type[8], note[64];
+
+	snprintf(type, sizeof(type), "0x%02x%s", e[4], e[0] == 0x80 ? "*" : "");
+	snprintf(note, sizeof(note), "%u-%u-%u %u-%u-%u",
+		 (e[2] & 0xc0) << 2 | e[3], e[1], e[2] & 0x3f,
+		 (e[6] & 0xc0) << 2 | e[7], e[5], e[6] & 0x3f);
+	part_show(pt, num, type, base + get_le32(e + 8), get_le32(e + 12), note);
+}
+
+/*
+ * Logical partitions in the EBR chain of the extended partition at ext
+ * A loop in the chain is found by comparing with the EBR at the last power
+ * of 2 hops (Brent), empty EBRs are counted too.
+ */
+static int mbr_logical(t_part *pt, ull ext)
+{
+	ull ebr = ext, mark = ext;
+	uint num = 5, hops, lap = 1;
+
+	for (hops = 1; hops <= EBR_MAX; ++hops) {
+		const uchar *p = pt->map + ebr * pt->secsz;
+
+		if ((maxuint_t)(ebr + 1) * pt->secsz > pt->len || p[510] != 0x55 ||
+		    p[511] != 0xaa) {
+			log(WARNING, "invalid EBR at LBA %llu\n", ebr);
+			return 0;
+		}
+
+		if (p[MBR_TABLE + 4] && get_le32(p + MBR_TABLE + 12))
+			mbr_entry(pt, num++, p + MBR_TABLE, ebr);
+
+		/* The second entry links to the next EBR, relative to ext */
+		if (!isextended(p[MBR_TABLE + 20]) || !get_le32(p + MBR_TABLE + 24))
+			return 0;
+
+		ebr = ext + get_le32(p + MBR_TABLE + 24);
+		if (ebr == mark) {
+			log(ERROR, "EBR loop at LBA %llu\n", ebr);
+			return -1;
+		}
+
+		if (hops == lap) {
+			mark = ebr;
+			lap <<= 1;
+		}
+	}
+
+	log(ERROR, "more than %d EBRs\n", EBR_MAX);
+	return -1;
+}
+
+static int mbr_parse(t_part *pt)
+{
+	const uchar *e;
+	ull ext = 0;
+	uint i;
+
+	part_header("MBR", pt);
+	for (i = 0; i < 4; ++i) {
+		e = pt->map + MBR_TABLE + i * 16;
+		if (!e[4] || !get_le32(e + 12))
+			continue;
+
+		mbr_entry(pt, i + 1, e, 0);
+		if (isextended(e[4]) && !ext)
+			ext = get_le32(e + 8);
+	}
+
+	/* Logical partitions follow the primary ones */
+	return ext ? mbr_logical(pt, ext) : 0;
+}
+
+static int gpt_parse(t_part *pt)
+{
+	const uchar *hdr = pt->map + pt->secsz, *e;
+	uchar tmp[512];
+	ull entries;
+	uint count, size, hdrsz, i, k;
+	char name[40];
+	const char *type;
+
+	if (2 * pt->secsz > pt->len || memcmp(hdr, "EFI PART", 8)) {
+		log(ERROR, "GPT header not found, check the sector size\n");
+		return -1;
+	}
+
+	hdrsz = get_le32(hdr + 12);
+	if (hdrsz < 92 || hdrsz > sizeof(tmp) || hdrsz > pt->secsz) {
+		log(ERROR, "invalid GPT header\n");
+		return -1;
+	}
+
+	/* The CRC is computed with its own field zeroed */
+	memcpy(tmp, hdr, hdrsz);
+	memset(tmp + 16, 0, 4);
+	if (part_crc32(tmp, hdrsz) != get_le32(hdr + 16))
+		log(WARNING, "GPT header CRC mismatch\n");
+
+	entries = get_le64(hdr + 72);
+	count = get_le32(hdr + 80);
+	size = get_le32(hdr + 84);
+	if (size < 128 || size % 8 || count > GPT_ENTRIES_MAX ||
+	    (maxuint_t)entries * pt->secsz + (maxuint_t)count * size > pt->len) {
+		log(ERROR, "invalid GPT entries\n");
+		return -1;
+	}
+
+	e = pt->map + entries * pt->secsz;
+	if (part_crc32(e, (size_t)count * size) != get_le32(hdr + 88))
+		log(WARNING, "GPT entries CRC mismatch\n");
+
+	part_header("GPT", pt);
+	for (i = 0; i < count; ++i, e += size) {
+		ull first = get_le64(e + 32), last = get_le64(e + 40);
+
+		/* Unused entries have a zero type GUID */
+		if (!get_le64(e) && !get_le64(e + 8))
+			continue;
+
+		if (last < first) {
+			log(WARNING, "entry %u: end before start\n", i + 1);
+			continue;
+		}
+
+		type = "other";
+		for (k = 0; k < ARRAY_SIZE(gpt_types); ++k)
+			if (!memcmp(e, gpt_types[k].guid, 4)) {
+				type = gpt_types[k].name;
+				break;
+			}
+
+		/* UTF-16LE name, shown as ASCII */
+		for (k = 0; k < 36 && (e[56 + 2 * k] || e[57 + 2 * k]); ++k)
+			name[k] = (e[57 + 2 * k] || e[56 + 2 * k] < ' ' || e[56 + 2 * k] > '~')
+				  ? '?' : (char)e[56 + 2 * k];
+		name[k] = '\0';
+
+		part_show(pt, i + 1, type, first, last - first + 1, name);
+	}
+
+	return 0;
+}
+
+/* Show the partitions of a disk image, after its path if title is set */
+static int part_image(const char *path, ulong sectorsz, bool title)
+{
+	t_part pt = {NULL, 0, sectorsz, 0, 0};
+	off_t end;
+	int fd, ret = -1;
+	bool gpt = false;
+
+	if (sectorsz < 512) {
+		log(ERROR, "sector size must be >= 512\n");
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		log(ERROR, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* The size of block devices is not in st_size */
+	end = lseek(fd, 0, SEEK_END);
+	if (end < 512) {
+		log(ERROR, "%s: no partition table\n", path);
+		close(fd);
+		return -1;
+	}
+
+	pt.len = (size_t)end;
+	pt.map = (const uchar *)mmap(NULL, pt.len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pt.map == MAP_FAILED) {
+		log(ERROR, "mmap()! [%s]\n", strerror(errno));
+		return -1;
+	}
+
+	if (pt.map[510] != 0x55 || pt.map[511] != 0xaa) {
+		log(ERROR, "%s: no partition table\n", path);
+		goto out;
+	}
+
+	/* A protective MBR has a partition of type 0xee */
+	for (int i = 0; i < 4; ++i)
+		if (pt.map[MBR_TABLE + i * 16 + 4] == 0xee)
+			gpt = true;
+
+	if (title)
+		fprintf(fout, "%s\n", path);
+	ret = gpt ? gpt_parse(&pt) : mbr_parse(&pt);
+	if (!ret && pt.misaligned)
+		fprintf(fout, "%u of %u partitions not 4 KiB aligned\n", pt.misaligned, pt.count);
+
+out:
+	munmap((void *)pt.map, pt.len);
+	return ret;
+}
+
+static int part_files(char **files, int count, ulong sectorsz)
+{
+	int ret = 0;
+
+	if (!count) {
+		log(ERROR, "no image\n");
+		return -1;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (i)
+			fprintf(fout, "\n");
+
+		if (part_image(files[i], sectorsz, count > 1) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Convert the values in lines of input, one per line, as -c */
+static size_t convert_linefn(void *arg, const char *buf, size_t len)
+{
+	ull *lineno = (ull *)arg;
+	const char *line = buf, *end = buf + len, *eol, *tok;
+	char num[NUM_LEN], tmp[BIN_BUF_LEN], *pch;
+	size_t toklen;
+	maxuint_t val;
+
+	if (!buf) {
+		++*lineno;
+		out_flush();
+		log(ERROR, "line %llu: line too long\n", *lineno);
+		return 0;
+	}
+
+	for (; (eol = (const char *)memchr(line, '\n', (size_t)(end - line))); line = eol + 1) {
+		++*lineno;
+		for (tok = line; tok < eol && isblank((uchar)*tok); ++tok)
+			;
+		for (pch = (char *)eol; pch > tok && isspace((uchar)pch[-1]); --pch)
+			;
+
+		toklen = (size_t)(pch - tok);
+		if (!toklen)
+			continue;
+
+		if (toklen < NUM_LEN && *tok != '-') {
+			memcpy(num, tok, toklen);
+			num[toklen] = '\0';
+			val = strtouquad(num, &pch);
+		} else
+			pch = FAILED;
+
+		if (*pch) {
+			out_flush();
+			log(ERROR, "line %llu: invalid input\n", *lineno);
+			continue;
+		}
+
+		out_str(" (b) ");
+		out_str(binstr(val, tmp));
+		out_str("\n (d) ");
+		out_u128(val);
+		out_str("\n (h) ");
+		out_str(hexstr(val, tmp));
+		out_str("\n\n");
+	}
+
+	return (size_t)(line - buf);
+}
+
+/* -c - converts the values in stdin */
+static int convertbase_fd(int fd)
+{
+	ull lineno = 0;
+	int ret = lines_fd(fd, convert_linefn, &lineno);
+
+	if (out_flush() == -1)
+		ret = -1;
+
+	return ret;
+}
+#endif
+
+int convertbase(char *arg)
+{
+#ifdef WIDE_BITS
+	return convertbase_wide(arg);
+#endif
+	char *pch;
+
+	strstrip(arg);
+
+	if (*arg == '\0') {
+		log(ERROR, "empty input\n");
+		return -1;
+	}
+
+	if (*arg == '-') {
+		log(ERROR, "N must be >= 0\n");
+		return -1;
+	}
+
+	if (cfg.repl && arg[0] == 'r' && arg[1] == '\0')
+		arg = lastres.p;
+
+	maxuint_t val = strtouquad(arg, &pch);
+	if (*pch) {
+		log(ERROR, "invalid input\n");
+		return -1;
+	}
+
+	fprintf(fout, " (b) ");
+	binprint(val);
+	fprintf(fout, "\n (d) %s\n (h) ",
+		getstr_u128(val, uint_buf));
+	printhex_u128(val);
+	fprintf(fout, "\n");
+
+	return 0;
+}
+
+/* -f loc, c prefixed CHS or l prefixed LBA */
+static int convertchs(char *loc)
+{
+	if (tolower((int)*loc) == 'c') {
+		maxuint_t lba = 0;
+
+		if (!chs2lba(loc + 1, &lba))
+			return -1;
+
+		fprintf(fout, "  LBA: (d) %s, (h) ", getstr_u128(lba, uint_buf));
+		printhex_u128(lba);
+		fprintf(fout, "\n\n");
+		return 0;
+	}
+
+	if (tolower((int)*loc) == 'l') {
+		t_chs chs;
+
+		if (!lba2chs(loc + 1, &chs))
+			return -1;
+
+		fprintf(fout, "  CHS: (d) %lu %lu %lu, ", chs.c, chs.h, chs.s);
+		fprintf(fout, "(h) 0x%lx 0x%lx 0x%lx\n\n", chs.c, chs.h, chs.s);
+		return 0;
+	}
+
+	log(ERROR, "invalid input\n");
+	return -1;
+}
+
+/*
+ * Evaluation server
+ * A request is a line of arguments separated by tabs, evaluated as they
+ * would be on the command line. The response is a "status outlen errlen"
+ * line followed by the output and the messages of the request. Each
+ * connection has its own r register, variables are shared.
+ */
+#define SERVE_REQ_LEN 4096
+#define SERVE_OUT_LEN (1 << 16)
+#ifndef BCAL_BUILTIN
+#define SERVE_OUT_MAX (1 << 20) /* stop reading a connection which doesn't read */
+#define SERVE_ARGS 16
+#define SERVE_EVENTS 256
+
+typedef struct {
+	int fd;
+	bool eof;        /* no more requests, close when sent */
+	Data r;          /* r register of the connection */
+	size_t idx;      /* slot in the poll set */
+	size_t inlen;
+	char *out;       /* responses not sent yet */
+	size_t outlen, outoff, outcap;
+	char in[SERVE_REQ_LEN];
+} t_conn;
+#endif
+
+/* Output and messages of a request */
+typedef struct {
+	FILE *out, *err;
+	FILE *fout, *ferr; /* restored after the request */
+	settings cfg;
+	long outlen, errlen;
+	char outbuf[SERVE_OUT_LEN];
+	char errbuf[SERVE_OUT_LEN];
+} t_capture;
+
+#ifndef BCAL_BUILTIN
+typedef struct {
+	int lfd;
+	t_capture cap;
+#ifdef __linux__
+	int efd;
+#else
+	struct pollfd *fds;
+	t_conn **conns;
+	size_t nfds, maxfds;
+#endif
+} t_server;
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+	serve_stop = 1;
+}
+
+static int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		return -1;
+
+	return 0;
+}
+
+#ifdef __linux__
+static int ev_init(t_server *sv)
+{
+	sv->efd = epoll_create1(EPOLL_CLOEXEC);
+	return sv->efd == -1 ? -1 : 0;
+}
+
+static int ev_add(t_server *sv, int fd, t_conn *c)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+
+	return epoll_ctl(sv->efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int ev_set(t_server *sv, t_conn *c, bool in, bool out)
+{
+	struct epoll_event ev = {.events = 0, .data.ptr = c};
+
+	if (in)
+		ev.events |= EPOLLIN;
+	if (out)
+		ev.events |= EPOLLOUT;
+
+	return epoll_ctl(sv->efd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void ev_del(t_server *sv, t_conn *c)
+{
+	epoll_ctl(sv->efd, EPOLL_CTL_DEL, c->fd, NULL);
+}
+
+/* Ready connections into conns, NULL is the listening socket */
+static int ev_wait(t_server *sv, t_conn **conns, int max)
+{
+	struct epoll_event evs[SERVE_EVENTS];
+	int n = epoll_wait(sv->efd, evs, max < SERVE_EVENTS ? max : SERVE_EVENTS, -1);
+
+	for (int i = 0; i < n; ++i)
+		conns[i] = (t_conn *)evs[i].data.ptr;
+
+	return n;
+}
+#else
+static int ev_init(t_server *sv)
+{
+	return 0;
+}
+
+static int ev_add(t_server *sv, int fd, t_conn *c)
+{
+	if (sv->nfds == sv->maxfds) {
+		size_t cap = sv->maxfds ? sv->maxfds << 1 : 64;
+		struct pollfd *fds = (struct pollfd *)mem_realloc(sv->fds, cap * sizeof(*fds));
+		t_conn **conns;
+
+		if (!fds)
+			return -1;
+		sv->fds = fds;
+
+		conns = (t_conn **)mem_realloc(sv->conns, cap * sizeof(*conns));
+		if (!conns)
+			return -1;
+		sv->conns = conns;
+		sv->maxfds = cap;
+	}
+
+	sv->fds[sv->nfds].fd = fd;
+	sv->fds[sv->nfds].events = POLLIN;
+	sv->conns[sv->nfds] = c;
+	if (c)
+		c->idx = sv->nfds;
+	++sv->nfds;
+	return 0;
+}
+
+static int ev_set(t_server *sv, t_conn *c, bool in, bool out)
+{
+	sv->fds[c->idx].events = (short)((in ? POLLIN : 0) | (out ? POLLOUT : 0));
+	return 0;
+}
+
+static void ev_del(t_server *sv, t_conn *c)
+{
+	size_t last = --sv->nfds;
+
+	sv->fds[c->idx] = sv->fds[last];
+	sv->conns[c->idx] = sv->conns[last];
+	if (sv->conns[c->idx])
+		sv->conns[c->idx]->idx = c->idx;
+}
+
+static int ev_wait(t_server *sv, t_conn **conns, int max)
+{
+	int n = poll(sv->fds, sv->nfds, -1), ready = 0;
+
+	if (n <= 0)
+		return n;
+
+	/* Collected first, ev_del() moves the slots */
+	for (size_t i = 0; i < sv->nfds && ready < max; ++i)
+		if (sv->fds[i].revents)
+			conns[ready++] = sv->conns[i];
+
+	return ready;
+}
+#endif
+#endif
+
+/* Evaluate the arguments of a request like the command line */
+static int serve_args(char **args, int n)
+{
+	ulong sectorsz = SECTOR_SIZE;
+	bool operation = false;
+	int i, ret = 0;
+
+	for (i = 0; i < n && args[i][0] == '-' && args[i][1]; ++i) {
+		char opt = args[i][1];
+
+		if (args[i][2] || (strchr("cfs", opt) && i + 1 == n)) {
+			log(ERROR, "invalid option \'%s\'\n", args[i]);
+			return -1;
+		}
+
+		switch (opt) {
+		case 'm':
+			cfg.minimal = 1;
+			break;
+		case 'b':
+			cfg.bcmode = 1;
+			break;
+		case 's':
+			if (*args[++i] == '-') {
+				log(ERROR, "sector size must be +ve\n");
+				return -1;
+			}
+			sectorsz = strtoul_b(args[i]);
+			break;
+		case 'c':
+			operation = true;
+			if (convertbase(args[++i]) == -1)
+				ret = -1;
+			fprintf(fout, "\n");
+			break;
+		case 'f':
+			operation = true;
+			if (convertchs(args[++i]) == -1)
+				ret = -1;
+			break;
+		default:
+			log(ERROR, "invalid option \'%s\'\n", args[i]);
+			return -1;
+		}
+	}
+
+	args += i;
+	n -= i;
+
+	if (n == 2)
+		return convertunit(args[0], args[1], sectorsz) == -1 ? -1 : ret;
+
+	if (n != 1) {
+		if (!n && operation)
+			return ret;
+
+		log(ERROR, "invalid input\n");
+		return -1;
+	}
+
+	/* A server doesn't quit on request */
+	if (program_exit(args[0])) {
+		log(ERROR, "invalid input\n");
+		return -1;
+	}
+
+	curexpr = args[0];
+	if (cfg.bcmode)
+		ret = try_bc(args[0]);
+	else if (args[0][0] == 'r' && args[0][1] == '\0') {
+		if (lastres.p[0] == '\0') {
+			log(ERROR, "no result stored\n");
+			ret = -1;
+		} else
+			fprintf(fout, "r = %s%s\n", lastres.p, lastres.unit ? " B" : "");
+	} else
+		ret = evaluate(args[0], sectorsz);
+
+	curexpr = NULL;
+	return ret;
+}
+
+#ifndef BCAL_BUILTIN
+static bool conn_append(t_conn *c, const char *buf, size_t len)
+{
+	if (c->outlen + len > c->outcap) {
+		size_t cap = c->outcap ? c->outcap : SERVE_REQ_LEN;
+		char *out;
+
+		while (cap < c->outlen + len)
+			cap <<= 1;
+
+		out = (char *)mem_realloc(c->out, cap);
+		if (!out)
+			return false;
+
+		c->out = out;
+		c->outcap = cap;
+	}
+
+	memcpy(c->out + c->outlen, buf, len);
+	c->outlen += len;
+	return true;
+}
+#endif
+
+static int capture_init(t_capture *cap)
+{
+	cap->out = fmemopen(cap->outbuf, SERVE_OUT_LEN, "w");
+	cap->err = fmemopen(cap->errbuf, SERVE_OUT_LEN, "w");
+	if (!cap->out || !cap->err) {
+		log(ERROR, "fmemopen: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Evaluate arguments with the output captured */
+static int capture_run(t_capture *cap, char **args, int n)
+{
+	int ret;
+
+	rewind(cap->out);
+	rewind(cap->err);
+	cap->fout = fout;
+	cap->ferr = ferr;
+	cap->cfg = cfg;
+	fout = cap->out;
+	ferr = cap->err;
+
+	if (n < 0) {
+		log(ERROR, "too many arguments\n");
+		ret = -1;
+	} else if (n == 1 && !*args[0]) {
+		log(ERROR, "empty request\n");
+		ret = -1;
+	} else
+		ret = serve_args(args, n);
+
+	fflush(fout);
+	fflush(ferr);
+	cap->outlen = ftell(cap->out);
+	cap->errlen = ftell(cap->err);
+
+	fout = cap->fout;
+	ferr = cap->ferr;
+	cfg = cap->cfg;
+	return ret;
+}
+
+#ifndef BCAL_BUILTIN
+/* Evaluate the tab separated arguments in line with the output captured */
+static int capture_args(t_capture *cap, char *line)
+{
+	char *args[SERVE_ARGS], *p = line;
+	int n = 0, ret;
+
+	for (; p && n < SERVE_ARGS; ++n) {
+		args[n] = p;
+		p = strchr(p, '\t');
+		if (p)
+			*p++ = '\0';
+	}
+
+	STATS_TIME(ST_REQUEST, ret = capture_run(cap, args, p ? -1 : n));
+	return ret;
+}
+
+/* Evaluate a request into the response of the connection */
+static bool serve_request(t_server *sv, t_conn *c, char *line)
+{
+	t_capture *cap = &sv->cap;
+	char hdr[64];
+	int ret, len;
+	bool ok;
+
+	lastres = c->r;
+	ret = capture_args(cap, line);
+	c->r = lastres;
+
+	len = snprintf(hdr, sizeof(hdr), "%d %ld %ld\n", ret ? 255 : 0, cap->outlen, cap->errlen);
+	ok = conn_append(c, hdr, (size_t)len)
+	     && conn_append(c, cap->outbuf, (size_t)cap->outlen)
+	     && conn_append(c, cap->errbuf, (size_t)cap->errlen);
+	return ok;
+}
+
+/* Read and answer the complete requests of a connection */
+static int serve_read(t_server *sv, t_conn *c)
+{
+	ssize_t ret;
+	char *line, *nl;
+
+	while (c->outlen - c->outoff < SERVE_OUT_MAX) {
+		ret = read(c->fd, c->in + c->inlen, SERVE_REQ_LEN - 1 - c->inlen);
+		if (ret == 0) {
+			c->eof = true;
+
+			/* The last request may not end with a newline */
+			if (c->inlen) {
+				c->in[c->inlen] = '\0';
+				c->inlen = 0;
+				return serve_request(sv, c, c->in) ? 0 : -1;
+			}
+
+			return 0;
+		}
+
+		if (ret == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+		c->inlen += (size_t)ret;
+
+		for (line = c->in; (nl = memchr(line, '\n', c->inlen - (size_t)(line - c->in)));
+		     line = nl + 1) {
+			*nl = '\0';
+			if (nl > line && nl[-1] == '\r')
+				nl[-1] = '\0';
+
+			if (!serve_request(sv, c, line))
+				return -1;
+		}
+
+		c->inlen -= (size_t)(line - c->in);
+		memmove(c->in, line, c->inlen);
+
+		if (c->inlen == SERVE_REQ_LEN - 1) {
+			static const char toolong[] = "255 0 24\nERROR: request too long\n";
+
+			c->eof = true;
+			return conn_append(c, toolong, sizeof(toolong) - 1) ? 0 : -1;
+		}
+	}
+
+	return 0;
+}
+
+static int serve_write(t_conn *c)
+{
+	ssize_t ret;
+
+	while (c->outoff < c->outlen) {
+		ret = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+		if (ret == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+		c->outoff += (size_t)ret;
+	}
+
+	c->outoff = c->outlen = 0;
+	return 0;
+}
+
+static void serve_close(t_server *sv, t_conn *c)
+{
+	ev_del(sv, c);
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+static void serve_accept(t_server *sv)
+{
+	t_conn *c;
+	int fd;
+
+	while ((fd = accept(sv->lfd, NULL, NULL)) != -1) {
+		c = (t_conn *)mem_calloc(1, sizeof(t_conn));
+		if (!c || set_nonblock(fd) == -1 || ev_add(sv, fd, c) == -1) {
+			log(ERROR, "connection: %s\n", strerror(errno));
+			free(c);
+			close(fd);
+			continue;
+		}
+
+		c->fd = fd;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		log(ERROR, "accept: %s\n", strerror(errno));
+}
+
+/*
+ * The socket is bound to a temporary name and renamed to path once it
+ * listens, so a client which sees path can connect
+ */
+static int serve_listen(const char *path)
+{
+	struct sockaddr_un sa;
+	char tmp[sizeof(sa.sun_path)];
+	int fd, probe;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= sizeof(tmp)) {
+		log(ERROR, "%s: path too long\n", path);
+		return -1;
+	}
+	bstrlcpy(sa.sun_path, path, sizeof(sa.sun_path));
+
+	/* Replace only the socket of a server which is gone */
+	probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe != -1) {
+		int ret = connect(probe, (struct sockaddr *)&sa, sizeof(sa));
+
+		close(probe);
+		if (!ret) {
+			log(ERROR, "%s: %s\n", path, strerror(EADDRINUSE));
+			return -1;
+		}
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || set_nonblock(fd) == -1) {
+		log(ERROR, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	bstrlcpy(sa.sun_path, tmp, sizeof(sa.sun_path));
+	unlink(tmp);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(fd, SOMAXCONN) == -1 ||
+	    rename(tmp, path) == -1) {
+		log(ERROR, "%s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* --serve path, answer requests until SIGINT or SIGTERM */
+static int serve(const char *path)
+{
+	t_server *sv = (t_server *)mem_calloc(1, sizeof(t_server));
+	t_conn *ready[SERVE_EVENTS];
+	struct sigaction sa;
+	int n, ret = 0;
+
+	if (!sv) {
+		log(ERROR, "out of memory\n");
+		return -1;
+	}
+
+	if (capture_init(&sv->cap) == -1)
+		return -1;
+
+	if (ev_init(sv) == -1) {
+		log(ERROR, "server: %s\n", strerror(errno));
+		return -1;
+	}
+
+	sv->lfd = serve_listen(path);
+	if (sv->lfd == -1 || ev_add(sv, sv->lfd, NULL) == -1)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!serve_stop) {
+		stats_poll();
+		n = ev_wait(sv, ready, SERVE_EVENTS);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			log(ERROR, "server: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			t_conn *c = ready[i];
+
+			if (!c) {
+				serve_accept(sv);
+				continue;
+			}
+
+			if ((!c->eof && serve_read(sv, c) == -1) || serve_write(c) == -1 ||
+			    (c->eof && !c->outlen) ||
+			    ev_set(sv, c, !c->eof && c->outlen < SERVE_OUT_MAX, c->outlen != 0) == -1)
+				serve_close(sv, c);
+		}
+	}
+
+	unlink(path);
+	close(sv->lfd);
+	return ret;
+}
+
+/* --client path args..., forward args to a server and show the response */
+static int serve_client(const char *path, char **args, int n)
+{
+	struct sockaddr_un sa;
+	char *buf = NULL, *out, *err;
+	size_t len = 0, cap = SERVE_REQ_LEN;
+	ssize_t ret;
+	int fd, status = -1;
+	long outlen, errlen;
+
+	if (!n) {
+		log(ERROR, "no arguments\n");
+		return -1;
+	}
+
+	buf = (char *)mem_malloc(cap);
+	if (!buf) {
+		log(ERROR, "out of memory\n");
+		return -1;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		size_t arglen = strlen(args[i]);
+
+		if (strpbrk(args[i], "\t\n") || len + arglen + 1 >= SERVE_REQ_LEN) {
+			log(ERROR, "invalid argument\n");
+			goto out;
+		}
+
+		memcpy(buf + len, args[i], arglen);
+		len += arglen;
+		buf[len++] = i + 1 == n ? '\n' : '\t';
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	bstrlcpy(sa.sun_path, path, sizeof(sa.sun_path));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || strlen(path) >= sizeof(sa.sun_path) ||
+	    connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		log(ERROR, "%s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	if (write(fd, buf, len) != (ssize_t)len) {
+		log(ERROR, "write: %s\n", strerror(errno));
+		close(fd);
+		goto out;
+	}
+	shutdown(fd, SHUT_WR);
+
+	/* The server closes after the response to the last request */
+	len = 0;
+	while ((ret = read(fd, buf + len, cap - len - 1)) > 0) {
+		len += (size_t)ret;
+		if (len + 1 == cap) {
+			char *tmp = (char *)mem_realloc(buf, cap << 1);
+
+			if (!tmp) {
+				log(ERROR, "out of memory\n");
+				close(fd);
+				goto out;
+			}
+
+			buf = tmp;
+			cap <<= 1;
+		}
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	out = strchr(buf, '\n');
+	if (ret == -1 || !out || sscanf(buf, "%d %ld %ld", &status, &outlen, &errlen) != 3 ||
+	    outlen < 0 || errlen < 0 || (size_t)(outlen + errlen) != len - (size_t)(++out - buf)) {
+		log(ERROR, "invalid response\n");
+		status = -1;
+		goto out;
+	}
+
+	err = out + outlen;
+	fwrite(out, 1, (size_t)outlen, fout);
+	fflush(fout);
+	fwrite(err, 1, (size_t)errlen, ferr);
+
+out:
+	free(buf);
+	return status;
+}
+
+/*
+ * Coprocess protocol
+ * A request on stdin is "id\targ\targ...\0", the arguments as for --serve.
+ * The response on stdout is "id\tstatus\tunit\tvalue\tmessages\toutput\0",
+ * written at once. unit and value are those of r if the request stored a
+ * result, else empty. The output has no terminal escapes.
+ */
+#define COPROC_RESP_LEN (SERVE_REQ_LEN + (SERVE_OUT_LEN << 1) + NUM_LEN + 16)
+
+/* Copy src without escape sequences and with tabs as spaces, returns the end */
+static char *coproc_text(char *dst, const char *src, size_t len)
+{
+	const char *end = src + len;
+
+	while (src < end) {
+		if (*src == '\033' && src + 1 < end && src[1] == '[') {
+			for (src += 2; src < end && (*src < 0x40 || *src > 0x7e); ++src)
+				;
+			++src;
+			continue;
+		}
+
+		*dst++ = *src == '\t' ? ' ' : *src;
+		++src;
+	}
+
+	return dst;
+}
+
+static int coproc_request(t_capture *cap, char *resp, char *req)
+{
+	char *args = strchr(req, '\t'), *p;
+	ull gen = resgen;
+	int ret;
+
+	if (args)
+		*args++ = '\0';
+	else
+		args = req + strlen(req);
+
+	ret = capture_args(cap, args);
+
+	p = resp + snprintf(resp, SERVE_REQ_LEN + 8, "%s\t%d\t", req, ret ? 255 : 0);
+	if (!ret && resgen != gen)
+		p += snprintf(p, NUM_LEN + 4, "%d\t%s", lastres.unit, lastres.p);
+	else
+		*p++ = '\t';
+
+	*p++ = '\t';
+	p = coproc_text(p, cap->errbuf, (size_t)cap->errlen);
+	*p++ = '\t';
+	p = coproc_text(p, cap->outbuf, (size_t)cap->outlen);
+	*p++ = '\0';
+
+	return write_all(STDOUT_FILENO, resp, (size_t)(p - resp));
+}
+
+/* --coproc, answer requests on stdin until it is closed */
+static int coproc(void)
+{
+	t_capture *cap = (t_capture *)mem_calloc(1, sizeof(t_capture));
+	char *resp = (char *)mem_malloc(COPROC_RESP_LEN), *req, *nul;
+	char in[SERVE_REQ_LEN];
+	struct sigaction sa;
+	size_t len = 0;
+	bool skip = false;
+	ssize_t ret;
+	int status = 0;
+
+	if (!cap || !resp) {
+		log(ERROR, "out of memory\n");
+		return -1;
+	}
+
+	if (capture_init(cap) == -1)
+		return -1;
+
+	/* Waiting for a request, SIGUSR1 interrupts read() to report */
+	if (stats) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = stats_signal;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	while ((ret = read(STDIN_FILENO, in + len, sizeof(in) - len)) != 0) {
+		stats_poll();
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			log(ERROR, "read: %s\n", strerror(errno));
+			status = -1;
+			break;
+		}
+
+		len += (size_t)ret;
+
+		for (req = in; (nul = memchr(req, '\0', len - (size_t)(req - in))); req = nul + 1) {
+			/* The rest of a request which was too long */
+			if (skip) {
+				skip = false;
+				continue;
+			}
+
+			if (coproc_request(cap, resp, req) == -1)
+				return -1;
+		}
+
+		len -= (size_t)(req - in);
+		memmove(in, req, len);
+
+		if (len == sizeof(in)) {
+			static const char toolong[] = "\t255\t\t\tERROR: request too long\n\t";
+
+			if (!skip && write_all(STDOUT_FILENO, toolong, sizeof(toolong)) == -1)
+				return -1;
+
+			skip = true;
+			len = 0;
+		}
+	}
+
+	if (len && !skip) {
+		log(ERROR, "incomplete request\n");
+		status = -1;
+	}
+
+	free(resp);
+	fclose(cap->out);
+	fclose(cap->err);
+	free(cap);
+	return status;
+}
+
+/*
+ * Shared memory rings, the layout is in bcal_shm.h
+ * Requests are polled for, spinning a while before sleeping for a time
+ * which doubles up to a maximum.
+ */
+#define SHM_SLOTS 1024
+
+typedef struct {
+	t_shmhdr *hdr;
+	t_shmreq *req;
+	t_shmresp *resp;
+	t_chsmap *cm;      /* default geometry and the cache */
+	t_capture *cap;
+	ull spins, maxus;  /* backoff */
+} t_shm;
+
+static inline void cpu_relax(void)
+{
+#ifdef __SSE2__
+	_mm_pause();
+#endif
+}
+
+/* One more idle poll */
+static void shm_backoff(const t_shm *sh, ull *idle)
+{
+	struct timespec ts;
+	ull us;
+
+	if (*idle < sh->spins || !sh->maxus) {
+		++*idle;
+		cpu_relax();
+		return;
+	}
+
+	us = *idle - sh->spins < 20 ? 1ULL << (*idle - sh->spins) : sh->maxus;
+	if (us >= sh->maxus)
+		us = sh->maxus;
+	else
+		++*idle;
+
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)(us % 1000000 * 1000);
+	nanosleep(&ts, NULL);
+}
 
-			if (count == -1) {
-				log(ERROR, "unknown unit\n");
-				return -1;
-			}
+static uint32_t shm_expr(t_shm *sh, const t_shmreq *rq, t_shmresp *rs)
+{
+	char expr[BCAL_SHM_EXPR_LEN + 1], *pch;
+	ull gen = resgen;
+	maxuint_t v;
 
-			value[len] = '\0';
-		} else
-			count = 0;
-	} else {
-		strstrip(unit);
+	if (rq->len > BCAL_SHM_EXPR_LEN)
+		return BCAL_SHM_EOP;
 
-		while (--count >= 0)
-			if (!bstricmp(units[count], unit))
-				break;
+	memcpy(expr, rq->expr, rq->len);
+	expr[rq->len] = '\0';
 
-		if (count == -1) {
-			log(ERROR, "unknown unit\n");
-			return -1;
-		}
-	}
+	if (capture_args(sh->cap, expr) || resgen == gen)
+		return BCAL_SHM_EINVAL;
 
-	log(DEBUG, "%s %s\n", value, units[count]);
+	v = strtouquad(lastres.p, &pch);
+	if (*pch)
+		return BCAL_SHM_ERANGE;
 
-	if (!cfg.minimal && unit)
-		printf("\033[1mUNIT CONVERSION\033[0m\n");
+	rs->val[0] = (ull)v;
+	rs->val[1] = (ull)(v >> 32 >> 32);
+	rs->unit = (uint32_t)lastres.unit;
+	return BCAL_SHM_OK;
+}
 
-	switch (count) {
-	case 0:
-		bytes = convertbyte(value, &ret);
-		break;
-	case 1:
-		bytes = convertkib(value, &ret);
-		break;
-	case 2:
-		bytes = convertmib(value, &ret);
-		break;
-	case 3:
-		bytes = convertgib(value, &ret);
-		break;
-	case 4:
-		bytes = converttib(value, &ret);
-		break;
-	case 5:
-		bytes = convertkb(value, &ret);
-		break;
-	case 6:
-		bytes = convertmb(value, &ret);
-		break;
-	case 7:
-		bytes = convertgb(value, &ret);
-		break;
-	case 8:
-		bytes = converttb(value, &ret);
-		break;
-	default:
-		log(ERROR, "unknown unit\n");
-		return -1;
-	}
+static uint32_t shm_chs(t_shm *sh, const t_shmreq *rq, t_shmresp *rs)
+{
+	const t_geom *g = &sh->cm->geom;
+	const uint64_t *a = rq->arg;
+	maxuint_t lba;
+	ull q, c;
 
-	if (ret == -1) {
-		if (cfg.minimal || unit) /* For running python test cases */
-			log(ERROR, "malformed input\n");
-		else
-			return try_bc(NULL);
+	if (a[3]) {
+		if (!(a[3] >> 32) || !(uint32_t)a[3])
+			return BCAL_SHM_EINVAL;
 
-		return -1;
+		g = geom_get(sh->cm, a[3] >> 32, (uint32_t)a[3]);
 	}
 
-	bstrlcpy(lastres.p, getstr_u128(bytes, uint_buf), UINT_BUF_LEN);
-	lastres.unit = 1;
-	log(DEBUG, "result: %s %d\n", lastres.p, lastres.unit);
-
-	if (cfg.minimal)
-		return 0;
+	if (rq->op == BCAL_SHM_LBA2CHS) {
+		q = div_q(&g->ds, a[0]);
+		c = div_q(&g->dh, q);
+		rs->val[0] = c;
+		rs->val[1] = q - c * g->mh;
+		rs->val[2] = a[0] - q * g->ms + 1;
+		return BCAL_SHM_OK;
+	}
 
-	printf("\nADDRESS\n (d) %s\n (h) ",
-		getstr_u128(bytes, uint_buf));
-	printhex_u128(bytes);
+	if (!a[2] || a[1] > g->mh || a[2] > g->ms)
+		return BCAL_SHM_EINVAL;
 
-	/* Calculate LBA and offset */
-	lba = bytes / sectorsz;
-	offset = bytes % sectorsz;
+	if (!mul_u(g->hs, a[0], &lba) || !add_u(lba, (maxuint_t)g->ms * a[1] + a[2] - 1, &lba) ||
+	    !FITS_U64(lba))
+		return BCAL_SHM_ERANGE;
 
-	printf("\n\nLBA:OFFSET (sector size: 0x%lx)\n", sectorsz);
-	/* We use a global buffer, so print decimal lba first, then offset */
-	printf(" (d) %s:", getstr_u128(lba, uint_buf));
-	printf("%s\n (h) ", getstr_u128(offset, uint_buf));
-	printhex_u128(lba);
-	printf(":");
-	printhex_u128(offset);
-	printf("\n");
+	rs->val[0] = (ull)lba;
+	return BCAL_SHM_OK;
+}
 
-	return 0;
+static uint32_t shm_eval(t_shm *sh, const t_shmreq *rq, t_shmresp *rs)
+{
+	const uint64_t *a = rq->arg;
+	ull sz, rem;
+
+	switch (rq->op) {
+	case BCAL_SHM_EXPR:
+		return shm_expr(sh, rq, rs);
+	case BCAL_SHM_LBA:
+		sz = a[1] ? a[1] : SECTOR_SIZE;
+		rs->val[0] = a[0] / sz;
+		rs->val[1] = a[0] % sz;
+		return BCAL_SHM_OK;
+	case BCAL_SHM_CHS2LBA:
+	case BCAL_SHM_LBA2CHS:
+		return shm_chs(sh, rq, rs);
+	case BCAL_SHM_ALIGN:
+		if (!a[1])
+			return BCAL_SHM_EINVAL;
+
+		rem = a[0] % a[1];
+		rs->val[0] = a[0] - rem;
+		rs->val[1] = rem ? rs->val[0] + a[1] : a[0];
+		return rs->val[1] < rs->val[0] ? BCAL_SHM_ERANGE : BCAL_SHM_OK;
+	default:
+		return BCAL_SHM_EOP;
+	}
 }
 
-static int evaluate(char *exp, ulong sectorsz)
+/* Is the segment name served by a running bcal? */
+static bool shm_live(const char *name)
 {
-	int ret = 0;
-	maxuint_t bytes = 0;
-	queue *front = NULL, *rear = NULL;
-	char *expr = fixexpr(exp, &ret);  /* Make parsing compatible */
-	char *ptr;
+	struct stat sb;
+	t_shmhdr *hdr;
+	bool live = false;
+	int fd = shm_open(name, O_RDONLY, 0);
 
-	if (expr)
-		log(DEBUG, "expr: %s\n", expr);
+	if (fd == -1)
+		return false;
 
-	if (expr == NULL) {
-		if (ret)
-			return convertunit(exp, NULL, sectorsz);
+	if (fstat(fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(t_shmhdr)) {
+		hdr = (t_shmhdr *)mmap(NULL, sizeof(t_shmhdr), PROT_READ, MAP_SHARED, fd, 0);
+		if (hdr != MAP_FAILED) {
+			live = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == BCAL_SHM_MAGIC &&
+			       hdr->state == BCAL_SHM_UP && hdr->pid &&
+			       (kill((pid_t)hdr->pid, 0) == 0 || errno == EPERM);
+			munmap(hdr, sizeof(t_shmhdr));
+		}
+	}
+
+	close(fd);
+	return live;
+}
+
+static int shm_map(t_shm *sh, const char *name)
+{
+	size_t size = sizeof(t_shmhdr) + SHM_SLOTS * (sizeof(t_shmreq) + sizeof(t_shmresp));
+	t_shmhdr *hdr;
+	int fd;
 
+	if (*name != '/') {
+		log(ERROR, "%s: name must start with /\n", name);
 		return -1;
 	}
 
-	ret = infix2postfix(expr, &front, &rear);
-	free(expr);
-	if (ret == -1)
+	if (shm_live(name)) {
+		log(ERROR, "%s: %s\n", name, strerror(EADDRINUSE));
 		return -1;
+	}
 
-	bytes = eval(&front, &rear, &ret);  /* Evaluate Expression */
-	if (ret == -1)
+	/* A stale segment is replaced, it can't be resized everywhere */
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd == -1 || ftruncate(fd, (off_t)size) == -1) {
+		log(ERROR, "%s: %s\n", name, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			shm_unlink(name);
+		}
 		return -1;
-
-	if (ret == 1) {
-		ptr = getstr_u128(bytes, uint_buf);
-		printf("%s\n", ptr);
-		bstrlcpy(lastres.p, getstr_u128(bytes, uint_buf), UINT_BUF_LEN);
-		lastres.unit = 0;
-		log(DEBUG, "result1: %s %d\n", lastres.p, lastres.unit);
-		return 0;
 	}
 
-	if (!(cfg.minimal || cfg.repl))
-		printf("\033[1mRESULT\033[0m\n");
-
-	convertbyte(getstr_u128(bytes, uint_buf), &ret);
-	if (ret == -1) {
-		log(ERROR, "malformed input\n");
+	hdr = (t_shmhdr *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		log(ERROR, "%s: %s\n", name, strerror(errno));
+		shm_unlink(name);
 		return -1;
 	}
 
-	ptr = getstr_u128(bytes, uint_buf);
-	bstrlcpy(lastres.p, ptr, UINT_BUF_LEN);
-	lastres.unit = 1;
-	log(DEBUG, "result2: %s %d\n", lastres.p, lastres.unit);
-
-	if (cfg.minimal)
-		return 0;
+	sh->hdr = hdr;
+	sh->req = (t_shmreq *)(hdr + 1);
+	sh->resp = (t_shmresp *)(sh->req + SHM_SLOTS);
 
-	printf("\nADDRESS\n (d) %s\n (h) ", ptr);
-	printhex_u128(bytes);
-	printf("\n");
+	for (uint i = 0; i < SHM_SLOTS; ++i) {
+		sh->req[i].seq = i;
+		sh->resp[i].seq = i;
+	}
 
+	hdr->version = BCAL_SHM_VERSION;
+	hdr->slots = SHM_SLOTS;
+	hdr->reqsz = sizeof(t_shmreq);
+	hdr->respsz = sizeof(t_shmresp);
+	hdr->pid = (uint64_t)getpid();
+	hdr->state = BCAL_SHM_UP;
+	__atomic_store_n(&hdr->magic, BCAL_SHM_MAGIC, __ATOMIC_RELEASE);
 	return 0;
 }
 
-int convertbase(char *arg)
+/* --shm name, answer requests until SIGINT or SIGTERM */
+static int shm_serve(const char *name, const ull *geometry, const ull *backoff)
 {
-	char *pch;
+	t_shm sh;
+	t_shmreq *rq;
+	t_shmresp *rs;
+	struct sigaction sa;
+	ull pos, idle = 0;
+	int ret = 0;
 
-	strstrip(arg);
+	_Static_assert(sizeof(t_shmhdr) == 320 && sizeof(t_shmreq) == 128 &&
+		       sizeof(t_shmresp) == 64, "shared memory layout");
 
-	if (*arg == '\0') {
-		log(ERROR, "empty input\n");
+	memset(&sh, 0, sizeof(sh));
+	sh.spins = backoff[0];
+	sh.maxus = backoff[1];
+	sh.cm = (t_chsmap *)mem_calloc(1, sizeof(t_chsmap));
+	sh.cap = (t_capture *)mem_calloc(1, sizeof(t_capture));
+	if (!sh.cm || !sh.cap) {
+		log(ERROR, "out of memory\n");
 		return -1;
 	}
 
-	if (*arg == '-') {
-		log(ERROR, "N must be >= 0\n");
+	geom_init(&sh.cm->geom, geometry[0], geometry[1]);
+	if (capture_init(sh.cap) == -1 || shm_map(&sh, name) == -1)
 		return -1;
-	}
 
-	if (cfg.repl && arg[0] == 'r' && arg[1] == '\0')
-		arg = lastres.p;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pos = sh.hdr->reqtail.pos;
+	while (!serve_stop) {
+		stats_poll();
+		rq = &sh.req[pos & (SHM_SLOTS - 1)];
+		if (__atomic_load_n(&rq->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+			shm_backoff(&sh, &idle);
+			continue;
+		}
 
-	maxuint_t val = strtouquad(arg, &pch);
-	if (*pch) {
-		log(ERROR, "invalid input\n");
-		return -1;
+		/* Wait for the caller a lap ago to read its response */
+		rs = &sh.resp[pos & (SHM_SLOTS - 1)];
+		if (__atomic_load_n(&rs->seq, __ATOMIC_ACQUIRE) != pos) {
+			shm_backoff(&sh, &idle);
+			continue;
+		}
+
+		idle = 0;
+		memset((char *)rs + sizeof(rs->seq), 0, sizeof(*rs) - sizeof(rs->seq));
+		rs->tag = rq->tag;
+		STATS_TIME(ST_REQUEST, rs->status = shm_eval(&sh, rq, rs));
+
+		__atomic_store_n(&rq->seq, pos + SHM_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&rs->seq, pos + 1, __ATOMIC_RELEASE);
+		++pos;
+		__atomic_store_n(&sh.hdr->reqtail.pos, pos, __ATOMIC_RELEASE);
+		__atomic_store_n(&sh.hdr->resphead.pos, pos, __ATOMIC_RELEASE);
 	}
 
-	printf(" (b) ");
-	binprint(val);
-	printf("\n (d) %s\n (h) ",
-		getstr_u128(val, uint_buf));
-	printhex_u128(val);
-	printf("\n");
+	__atomic_store_n(&sh.hdr->state, BCAL_SHM_DOWN, __ATOMIC_RELEASE);
+	if (shm_unlink(name) == -1) {
+		log(ERROR, "%s: %s\n", name, strerror(errno));
+		ret = -1;
+	}
 
-	return 0;
+	return ret;
 }
 
+/* Options without a short form */
+enum {
+	OPT_STREAM = 256,
+	OPT_AGGREGATE,
+	OPT_QUANTILE,
+	OPT_FIELD,
+	OPT_SCAN,
+	OPT_FILES_FROM,
+	OPT_LBA,
+	OPT_DUAL,
+	OPT_CHS2LBA,
+	OPT_LBA2CHS,
+	OPT_GEOMETRY,
+	OPT_RAW,
+	OPT_PART,
+	OPT_ALIGN,
+	OPT_RANGES,
+	OPT_INTERSECT,
+	OPT_SECTORS,
+	OPT_SORT,
+	OPT_SEQ,
+	OPT_FORMAT,
+	OPT_BINARY,
+	OPT_SERVE,
+	OPT_CLIENT,
+	OPT_COPROC,
+	OPT_SHM,
+	OPT_BACKOFF,
+	OPT_STATS,
+};
+
 int main(int argc, char **argv)
 {
-	int opt = 0, operation = 0;
-	ulong sectorsz = SECTOR_SIZE;
+	int opt = 0, operation = 0, mode = 0;
+	ulong sectorsz = SECTOR_SIZE, field = 1, jobs = 1;
+	ull geometry[2] = {MAX_HEAD, MAX_SECTOR}, backoff[2] = {10000, 1000};
+	maxuint_t alignment = 0;
+	char *pch, *listfile = NULL, *format = "dec", *endpoint = NULL, **files;
+	bool scan = false, dual = false, intersect = false, sectors = false;
+	t_binfmt bf = {0, false};
+	static const struct option longopts[] = {
+		{"stream", no_argument, NULL, OPT_STREAM},
+		{"aggregate", no_argument, NULL, OPT_AGGREGATE},
+		{"quantile", no_argument, NULL, OPT_QUANTILE},
+		{"field", required_argument, NULL, OPT_FIELD},
+		{"scan", no_argument, NULL, OPT_SCAN},
+		{"files-from", required_argument, NULL, OPT_FILES_FROM},
+		{"lba", no_argument, NULL, OPT_LBA},
+		{"dual", no_argument, NULL, OPT_DUAL},
+		{"chs2lba", no_argument, NULL, OPT_CHS2LBA},
+		{"lba2chs", no_argument, NULL, OPT_LBA2CHS},
+		{"geometry", required_argument, NULL, OPT_GEOMETRY},
+		{"raw", no_argument, NULL, OPT_RAW},
+		{"part", no_argument, NULL, OPT_PART},
+		{"align", required_argument, NULL, OPT_ALIGN},
+		{"ranges", no_argument, NULL, OPT_RANGES},
+		{"intersect", no_argument, NULL, OPT_INTERSECT},
+		{"sectors", no_argument, NULL, OPT_SECTORS},
+		{"sort", no_argument, NULL, OPT_SORT},
+		{"seq", no_argument, NULL, OPT_SEQ},
+		{"format", required_argument, NULL, OPT_FORMAT},
+		{"binary", required_argument, NULL, OPT_BINARY},
+		{"serve", required_argument, NULL, OPT_SERVE},
+		{"client", required_argument, NULL, OPT_CLIENT},
+		{"coproc", no_argument, NULL, OPT_COPROC},
+		{"shm", required_argument, NULL, OPT_SHM},
+		{"backoff", required_argument, NULL, OPT_BACKOFF},
+		{"stats", no_argument, NULL, OPT_STATS},
+		{NULL, 0, NULL, 0}
+	};
+
+	fout = stdout;
+	ferr = stderr;
 
 	if (getenv("BCAL_USE_CALC"))
 		cfg.calc = true;
@@ -2096,38 +9052,121 @@ int main(int argc, char **argv)
 	opterr = 0;
 	rl_bind_key('\t', rl_insert);
 
-	while ((opt = getopt(argc, argv, "bc:df:hms:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "bc:df:hj:ms:", longopts, NULL)) != -1) {
 		switch (opt) {
+		case OPT_STREAM:
+		case OPT_AGGREGATE:
+		case OPT_QUANTILE:
+		case OPT_LBA:
+		case OPT_CHS2LBA:
+		case OPT_LBA2CHS:
+		case OPT_PART:
+		case OPT_RANGES:
+		case OPT_SORT:
+		case OPT_SEQ:
+		case OPT_COPROC:
+			mode = opt;
+			break;
+		case OPT_SCAN:
+			scan = true;
+			break;
+		case OPT_DUAL:
+			dual = true;
+			break;
+		case OPT_RAW:
+			bf.width = sizeof(ull);
+			bf.be = false;
+			break;
+		case OPT_BINARY:
+			if (binfmt_parse(optarg, &bf) == -1) {
+				log(ERROR, "invalid binary format\n");
+				return -1;
+			}
+			break;
+		case OPT_INTERSECT:
+			intersect = true;
+			break;
+		case OPT_SECTORS:
+			sectors = true;
+			break;
+		case OPT_FORMAT:
+			format = optarg;
+			break;
+		case OPT_ALIGN:
+		{
+			char unit;
+
+			mode = opt;
+			if (strtosize(optarg, NULL, &alignment, &unit) || !alignment) {
+				log(ERROR, "invalid alignment\n");
+				return -1;
+			}
+			break;
+		}
+		case OPT_GEOMETRY:
+			if (chs_fields(optarg, optarg + strlen(optarg), geometry, 2) != 2 ||
+			    !geometry[0] || !geometry[1]) {
+				log(ERROR, "invalid geometry\n");
+				return -1;
+			}
+			break;
+		case OPT_FILES_FROM:
+			listfile = optarg;
+			break;
+		case OPT_SERVE:
+		case OPT_SHM:
+			mode = opt;
+			endpoint = optarg;
+			break;
+		case OPT_BACKOFF:
+			if (chs_fields(optarg, optarg + strlen(optarg), backoff, 2) != 2) {
+				log(ERROR, "invalid backoff\n");
+				return -1;
+			}
+			break;
+		case OPT_STATS:
+			if (!stats && stats_init() == -1)
+				return -1;
+			break;
+		case OPT_CLIENT:
+			/* The rest of the arguments are for the server */
+			return serve_client(optarg, argv + optind, argc - optind);
+		case 'j':
+			jobs = strtoul(optarg, &pch, 10);
+			if (*optarg == '-' || *pch || jobs > 1024) {
+				log(ERROR, "invalid number of jobs\n");
+				return -1;
+			}
+
+			if (!jobs) {
+				long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+				jobs = ncpu > 0 ? (ulong)ncpu : 1;
+			}
+			break;
+		case OPT_FIELD:
+			field = strtoul(optarg, &pch, 10);
+			if (*optarg == '-' || *pch || !field || field > UINT_MAX) {
+				log(ERROR, "field must be +ve\n");
+				return -1;
+			}
+			break;
 		case 'c':
 		{
 			operation = 1;
+			if (!strcmp(optarg, "-")) {
+				if (convertbase_fd(STDIN_FILENO) == -1)
+					return -1;
+				break;
+			}
+
 			convertbase(optarg);
-			printf("\n");
+			fprintf(fout, "\n");
 			break;
 		}
 		case 'f':
 			operation = 1;
-
-			if (tolower((int)*optarg) == 'c') {
-				maxuint_t lba = 0;
-
-				if (chs2lba(optarg + 1, &lba)) {
-					printf("  LBA: (d) %s, (h) ",
-						getstr_u128(lba, uint_buf));
-					printhex_u128(lba);
-					printf("\n\n");
-				}
-			} else if (tolower((int)*optarg) == 'l') {
-				t_chs chs;
-
-				if (lba2chs(optarg + 1, &chs)) {
-					printf("  CHS: (d) %lu %lu %lu, ",
-						chs.c, chs.h, chs.s);
-					printf("(h) 0x%lx 0x%lx 0x%lx\n\n",
-						chs.c, chs.h, chs.s);
-				}
-			} else
-				log(ERROR, "invalid input\n");
+			convertchs(optarg);
 			break;
 		case 'm':
 			cfg.minimal = 1;
@@ -2150,6 +9189,9 @@ int main(int argc, char **argv)
 			cfg.loglvl = DEBUG;
 			log(DEBUG, "bcal v%s\n", VERSION);
 			log(DEBUG, "maxuint_t is %lu bytes\n", sizeof(maxuint_t));
+#ifdef WIDE_BITS
+			log(DEBUG, "wide mode: %d bits\n", WIDE_BITS);
+#endif
 
 			break;
 		case 'h':
@@ -2164,6 +9206,71 @@ int main(int argc, char **argv)
 
 	log(DEBUG, "argc %d, optind %d\n", argc, optind);
 
+	if (bf.width && mode != OPT_AGGREGATE && mode != OPT_QUANTILE && mode != OPT_ALIGN
+	    && mode != OPT_LBA && mode != OPT_CHS2LBA && mode != OPT_LBA2CHS) {
+		log(ERROR, "binary input needs --aggregate, --quantile, --align, --lba or CHS\n");
+		return -1;
+	}
+
+	files = argv + optind;
+	opt = argc - optind;
+	if (listfile) {
+		if (!(mode || scan)) {
+			log(ERROR, "--files-from requires a bulk mode\n");
+			return -1;
+		}
+
+		files = filelist(listfile, argv + optind, argc - optind, &opt);
+		if (!files)
+			return -1;
+
+		/* An empty list is not stdin */
+		if (!opt) {
+			log(ERROR, "no files\n");
+			return -1;
+		}
+	}
+
+	if (mode == OPT_STREAM)
+		return stream_files(files, opt);
+
+	if (mode == OPT_SERVE)
+		return serve(endpoint);
+
+	if (mode == OPT_COPROC)
+		return coproc();
+
+	if (mode == OPT_SHM)
+		return shm_serve(endpoint, geometry, backoff);
+
+	if (mode == OPT_LBA)
+		return lba_files(files, opt, sectorsz, (uint)field, dual, &bf);
+
+	if (mode == OPT_PART)
+		return part_files(files, opt, sectorsz);
+
+	if (mode == OPT_SEQ)
+		return seq_run(files, opt, format, sectorsz);
+
+	if (mode == OPT_SORT)
+		return sort_files(files, opt, (uint)field);
+
+	if (mode == OPT_RANGES)
+		return range_files(files, opt, sectorsz, sectors, intersect);
+
+	if (mode == OPT_ALIGN)
+		return align_files(files, opt, alignment, (uint)field, &bf);
+
+	if (mode == OPT_CHS2LBA || mode == OPT_LBA2CHS)
+		return chs_files(files, opt, mode == OPT_CHS2LBA, geometry, &bf);
+
+	if (mode == OPT_AGGREGATE || mode == OPT_QUANTILE)
+		return aggregate_files(files, opt, (uint)field, mode == OPT_QUANTILE, scan,
+				       (uint)jobs, &bf);
+
+	if (scan)
+		return ingest_files(files, opt, NULL, 0, true, NULL);
+
 	if (!operation && (argc == optind)) {
 		char *ptr = NULL, *tmp = NULL;
 		cfg.repl = 1;
@@ -2171,11 +9278,13 @@ int main(int argc, char **argv)
 
 		read_history(NULL);
 
-		printf("q/double Enter -> quit, ? -> help\n");
+		fprintf(fout, "q/double Enter -> quit, ? -> help\n");
 		while ((tmp = readline(prompt)) != NULL) {
 			if (!tmp)
 				exit(0);
 
+			stats_poll();
+
 			if (program_exit(tmp)) {
 				free(tmp);
 				exit(0);
@@ -2199,7 +9308,10 @@ int main(int argc, char **argv)
 			ptr = tmp;
 
 			strstrip(tmp);
-			remove_commas(tmp);
+
+			/* Commas separate the values of reductions */
+			if (!findreduction(tmp) && !isassign(tmp))
+				remove_commas(tmp);
 
 			if (tmp[0] == '\0') {
 				free(ptr);
@@ -2216,12 +9328,12 @@ int main(int argc, char **argv)
 				case 'r':
 					/* Show the last stored result */
 					if (lastres.p[0] == '\0')
-						printf("no result stored\n");
+						fprintf(fout, "no result stored\n");
 					else {
-						printf("r = %s ", lastres.p);
+						fprintf(fout, "r = %s ", lastres.p);
 						if (lastres.unit)
-							printf("B");
-						printf("\n");
+							fprintf(fout, "B");
+						fprintf(fout, "\n");
 					}
 
 					free(ptr);
@@ -2232,7 +9344,7 @@ int main(int argc, char **argv)
 						if (cfg.calc)
 							strncpy(prompt, "calc> ", 7);
 						else {
-							printf("bc vars: scale = 10, ibase = 10\n");
+							fprintf(fout, "bc vars: scale = 10, ibase = 10\n");
 							strncpy(prompt, "bc> ", 5);
 						}
 					} else
@@ -2255,13 +9367,17 @@ int main(int argc, char **argv)
 					free(ptr);
 					continue;
 				default:
-					printf("invalid input\n");
+					/* Single letter variables are evaluated */
+					if (isvarref(tmp))
+						break;
+
+					fprintf(fout, "invalid input\n");
 					free(ptr);
 					continue;
 				}
 			}
 
-			if (tmp[0] == 'c') {
+			if (tmp[0] == 'c' && !isassign(tmp) && !isvarref(tmp)) {
 				convertbase(tmp + 1);
 				free(ptr);
 				continue;
@@ -2292,6 +9408,10 @@ int main(int argc, char **argv)
 
 	/*Arithmetic operation*/
 	if (argc - optind == 1) {
+		/* bcal exit or quit, there is nothing to evaluate */
+		if (program_exit(argv[optind]))
+			return 0;
+
 		if (cfg.bcmode)
 			return try_bc(argv[optind]);
 
@@ -2301,3 +9421,74 @@ int main(int argc, char **argv)
 
 	return -1;
 }
+#else
+/*
+ * Evaluator of the bash builtin, see builtin/bcal.c
+ * A call starts with the settings of bcal -m, no r and no variables.
+ */
+static t_capture *bi_cap;
+
+static void bi_reset(void)
+{
+	for (uint i = 0; i < symtab.cap; ++i)
+		free(symtab.slots[i].name);
+
+	if (symtab.cap)
+		memset(symtab.slots, 0, symtab.cap * sizeof(t_var));
+	symtab.count = 0;
+
+	lastres.p[0] = '\0';
+	lastres.unit = 0;
+	curexpr = NULL;
+}
+
+int bcal_eval(char **args, int n, const char **out, size_t *outlen,
+	      const char **err, size_t *errlen)
+{
+	settings saved = cfg;
+	int ret;
+
+	*out = *err = "";
+	*outlen = *errlen = 0;
+
+	/* Messages before the output is captured */
+	if (!ferr) {
+		fout = stdout;
+		ferr = stderr;
+	}
+
+	if (!bi_cap) {
+		bi_cap = (t_capture *)mem_calloc(1, sizeof(t_capture));
+		if (!bi_cap || capture_init(bi_cap) == -1) {
+			free(bi_cap);
+			bi_cap = NULL;
+			return -1;
+		}
+	}
+
+	bi_reset();
+	cfg.minimal = 1;
+	ret = capture_run(bi_cap, args, n);
+	cfg = saved;
+
+	*out = bi_cap->outbuf;
+	*outlen = (size_t)bi_cap->outlen;
+	*err = bi_cap->errbuf;
+	*errlen = (size_t)bi_cap->errlen;
+	return ret;
+}
+
+void bcal_free(void)
+{
+	bi_reset();
+	free(symtab.slots);
+	memset(&symtab, 0, sizeof(symtab));
+
+	if (bi_cap) {
+		fclose(bi_cap->out);
+		fclose(bi_cap->err);
+		free(bi_cap);
+		bi_cap = NULL;
+	}
+}
+#endif
@@ -0,0 +1,13 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+typedef unsigned long long ull; typedef unsigned int uint; typedef __uint128_t maxuint_t;
+#include "dv.inc"
+static ull rng=88172645463325252ULL; static ull xr(void){rng^=rng<<13;rng^=rng>>7;rng^=rng<<17;return rng;}
+int main(){ ull ds[]={3,5,7,520,520*3,1000,4095,4097,(1ULL<<63)+1,~0ULL,~0ULL-1,641,12345678901ULL,6,10,100, 3000000007ULL};
+ long bad=0;
+ for(int k=0;k<2000;k++){ ull d = k<17?ds[k]: (xr()>>(xr()%63)); if(!d) continue; t_divisor dv; div_init(&dv,d);
+  for(int i=0;i<200000;i++){ ull n; switch(i%4){case 0:n=xr();break;case 1:n=~0ULL-i;break;case 2:n=i;break;default:n=(xr()/d)*d-1+(i&3);}
+   if(div_q(&dv,n)!=n/d){ if(bad<5) printf("bad d=%llu n=%llu got %llu want %llu\n",d,n,div_q(&dv,n),n/d); bad++; }}}
+ printf("bad=%ld\n",bad);}
@@ -20,6 +20,87 @@ NOTES:
 import pytest
 import subprocess
 
+# Submits requests to bcal --shm through the rings in bcal_shm.h
+SHM_CLIENT = '''
+import mmap, os, struct, subprocess, sys, time
+try:
+    from _posixshmem import shm_open
+except ImportError:
+    sys.exit(print('SKIP: no POSIX shared memory'))
+name = '/bcal-test-%d' % os.getpid()
+bcal = subprocess.Popen(['./bcal', '--shm', name, '--backoff', '0-100'])
+deadline = time.monotonic() + 10
+while True:
+    try:
+        fd = shm_open(name, os.O_RDWR, 0)
+        m = mmap.mmap(fd, 0)
+        os.close(fd)
+        if struct.unpack_from('I', m)[0] == 0x6c616362:
+            break
+    except (OSError, ValueError):
+        pass
+    if bcal.poll() is not None or time.monotonic() > deadline:
+        bcal.kill()
+        sys.exit(print('segment not ready'))
+    time.sleep(0.01)
+dup = subprocess.run(['./bcal', '--shm', name], stderr=subprocess.PIPE)
+print(dup.returncode, dup.stderr.decode().replace(name, 'name'), end='')
+slots = struct.unpack_from('I', m, 8)[0]
+reqs = [(1, 1, 0, 0, 0, 0, b'2 kib + 1 kib'), (2, 2, 4097, 0, 0, 0, b''),
+        (3, 4, 1070, 0, 0, 16 << 32 | 63, b''), (4, 5, 5000, 4096, 0, 0, b''),
+        (5, 1, 0, 0, 0, 0, b'1 + foo'), (6, 9, 0, 0, 0, 0, b'')]
+for pos, (tag, op, a, b, c, d, expr) in enumerate(reqs):
+    off = 320 + pos * 128
+    struct.pack_into('QQII4Q72s', m, off, 0, tag, op, len(expr), a, b, c, d, expr)
+    struct.pack_into('Q', m, 64, pos + 1)
+    struct.pack_into('Q', m, off, pos + 1)
+for pos in range(len(reqs)):
+    off = 320 + slots * 128 + pos * 64
+    while struct.unpack_from('Q', m, off)[0] != pos + 1:
+        if bcal.poll() is not None or time.monotonic() > deadline:
+            bcal.kill()
+            sys.exit(print('no response', pos))
+        time.sleep(0.001)
+    print(*struct.unpack_from('QII4Q', m, off + 8))
+    struct.pack_into('Q', m, off, pos + slots)
+bcal.terminate()
+bcal.wait()
+'''
+
+# Fails if --coproc requests allocate once the evaluator is warmed up
+ALLOC_CHECK = '''
+import subprocess
+reqs = ['-m\\t(2 kib + 1 kib) * 3 / 2', '-m\\t1 gib / 512', 'x=4 kib', '-m\\tx * 2 + 0x10',
+        '-m\\t(1 + (2 * (3 + 4))) << 2', '-c\\t0x20', '-m\\t10 mib', 'r']
+def calls(rounds):
+    data = ''.join('%d\\t%s\\0' % (i, r) for i in range(rounds) for r in reqs)
+    p = subprocess.run(['./bcal', '--coproc', '--stats'], input=data.encode(), capture_output=True)
+    rows = p.stderr.decode().split('ALLOCATIONS')[1].splitlines()
+    return [l.split()[1] for l in rows if l.split()[:1] == ['request']][0]
+a, b = calls(1), calls(100)
+print('steady' if a == b else 'warm-up %s, 100 rounds %s' % (a, b))
+'''
+
+# Loads bcal.so in bash, r and variables don't outlive a call
+BUILTIN_CHECK = '''
+import os, subprocess, sys
+inc = os.environ.get('BASH_INC', '/usr/include/bash')
+if not os.path.exists(os.path.join(inc, 'loadables.h')):
+    sys.exit(print('SKIP: no bash loadable headers'))
+subprocess.run(['make', '-s', 'builtin', 'BASH_INC=' + inc], check=True)
+script = """
+enable -f ./bcal.so bcal || exit
+bcal "2 kib + 1 kib"; echo "$? $REPLY"
+bcal r; echo "$? [$REPLY]"
+bcal "x = 4 kib"; echo "$? [$REPLY]"
+bcal "x * 2"; echo "$? [$REPLY]"
+bcal -v out 10 mib; echo "$? $out"
+"""
+sys.stdout.flush()
+subprocess.run(['bash', '-c', script], stderr=subprocess.STDOUT)
+os.remove('bcal.so')
+'''
+
 test = [
     ('./bcal', '-m', '10', 'mb'),                                      # 0
     ('./bcal', '-m', '10', 'TiB'),                                     # 1
@@ -95,6 +176,74 @@ test = [
     ('./bcal', '-m', "0xbb b * 2"),                                    # 70
     ('./bcal', '-m', "0xbb * 2"),                                      # 71
     ('./bcal', '-b', "(50,000 - 2,000) * 1,500"),                      # 72
+    ('./bcal', '-m', "0xffffffffffffffffffffffffffffffff + 1"),        # 73
+    ('./bcal', '-m', "18446744073709551616 * 18446744073709551615"),   # 74
+    ('./bcal', '-m', "0xffffffffffffffff b * 0xffffffffffffffff"),     # 75
+    ('./bcal', '-m', "1 << 127"),                                      # 76
+    ('./bcal', '-m', "2 << 127"),                                      # 77
+    ('./bcal', '-m', "18446744073709551617 kib + 1b"),                 # 78
+    ('./bcal', '-m', "0x100000000000000000000000000000000 b"),         # 79
+    ('sh', '-c', "printf '1+2\\n(2giB*2)/2kib\\n2mb-3mib; 5 tb / 12\\n' | ./bcal -m --stream"),  # 80
+    ('sh', '-c', "printf '(1 +\\n 2) * 3 kib\\n2 >>> 2\\nr + 1 kib' | ./bcal -m --stream"),     # 81
+    ('sh', '-c', "printf '0x10 b + 2\\n10 TiB;0xbb b * 2' | ./bcal -m --stream"),                # 82
+    ('sh', '-c', "printf 'disk = 4TiB\\nstripe = 256KiB\\ndisk / stripe' | ./bcal -m --stream"),  # 83
+    ('sh', '-c', "printf '5*2\\nn_1 = 0x3; r + n_1\\nn_1 = n_1 << 2; n_1 * 1 kib' | ./bcal -m --stream"),  # 84
+    ('sh', '-c', "printf 'kb = 1\\nr = 2\\nsz = 2 tb\\nsz * sz' | ./bcal -m --stream"),  # 85
+    ('./bcal', '-m', "sum(1GiB, 512 MiB, 0x10 b)"),                   # 86
+    ('./bcal', '-m', "avg(1, 2, 4)"),                                 # 87
+    ('sh', '-c', "t=$(mktemp) && printf '7\\n0x1f, 3\\n\\n12\\n' > $t && ./bcal -m \"max(@$t)\"; rm -f $t"),  # 88
+    ('./bcal', '-m', "sum(1, 2 kib)"),                                # 89
+    ('./bcal', '-m', "sum(340282366920938463463374607431768211455, 1)"),  # 90
+    ('sh', '-c', "printf '4096 a\\n1GiB b\\n\\nfoo bar\\n0x10 c\\n0' | ./bcal -m --aggregate"),  # 91
+    ('sh', '-c', "printf 'a 4096\\nb 1kib\\n' | ./bcal -m --aggregate --field 2"),  # 92
+    ('sh', '-c', "printf '340282366920938463463374607431768211455\\n1\\n' | ./bcal -m --aggregate"),  # 93
+    ('sh', '-c', "seq 1 100000 | ./bcal -m --quantile | tail -4"),     # 94
+    ('sh', '-c', "seq 0 255 | ./bcal -m --quantile | tail -4"),        # 95
+    ('sh', '-c', "printf 'size=1.5GiB x86 v1.5GiB 4096 B 0x1000, 12 pids\\n0x10 kib 7kb. 10bar 3 TB' | ./bcal --scan"),  # 96
+    ('sh', '-c', "printf 'a 4KiB b 2 KiB\\nlen 0x400 at 2026-10-18T12:00' | ./bcal -m --aggregate --scan | head -2"),  # 97
+    ('sh', '-c', "t=$(mktemp) && seq 1 1200000 > $t && ./bcal -m -j 3 --quantile $t $t | sed -n '1,3p;$p'; rm -f $t"),  # 98
+    ('sh', '-c', "t=$(mktemp) && printf '1 MiB\\n' > $t && echo $t | ./bcal -m -j 2 --scan --aggregate --files-from - | head -1; rm -f $t"),  # 99
+    ('sh', '-c', "printf '0\\n511\\n4097\\nfoo\\n0x1000\\n' | ./bcal --lba"),  # 100
+    ('sh', '-c', "printf 'w 4097\\nr 18446744073709551615\\n' | ./bcal --lba --field 2 --dual"),  # 101
+    ('sh', '-c', "printf '1040\\n1099511627776000000000\\n' | ./bcal --lba -s 520"),  # 102
+    ('sh', '-c', "printf '1,2,3\\n0-16-63\\n5 0 0\\n1,2,3,255,63\\n' | ./bcal --chs2lba"),  # 103
+    ('sh', '-c', "printf '20000,255,63\\n1008\\n5,4\\n' | ./bcal --lba2chs"),  # 104
+    ('sh', '-c', "printf '\\360\\003\\0\\0\\0\\0\\0\\0\\040\\116\\0\\0\\0\\0\\0\\0' | ./bcal --lba2chs --raw --geometry 255-63"),  # 105
+    ('sh', '-c', "f=$(mktemp) && { head -c 446 /dev/zero; printf '\\200\\040\\041\\000\\203\\376\\377\\377\\000\\010\\000\\000\\000\\000\\001\\000\\000\\040\\041\\000\\007\\376\\377\\377\\077\\000\\000\\000\\144\\000\\000\\000'; head -c 32 /dev/zero; printf '\\125\\252'; } > $f && ./bcal --part $f; rm -f $f"),  # 106
+    ('./bcal', '--part', '/dev/null'),  # 107
+    ('sh', '-c', "printf '0\\n4097\\nfoo\\n0x3000\\n1.5KiB\\n' | ./bcal --align 4KiB"),  # 108
+    ('sh', '-c', "printf '\\0\\040\\0\\0\\0\\0\\0\\0\\001\\020\\0\\0\\0\\0\\0\\0' | ./bcal --align 3kib --raw"),  # 109
+    ('sh', '-c', "printf '8192 4096\\n0+4096\\n4096+1KiB\\n100000+0\\nfoo\\n1MiB+1MiB\\n' | ./bcal --ranges"),  # 110
+    ('sh', '-c', "t=$(mktemp) && printf '0+10\\n20+10\\n' > $t && printf '5+20\\n28+100\\n' | ./bcal --ranges --intersect $t -; rm -f $t"),  # 111
+    ('sh', '-c', "printf '1KiB a\\nfoo\\n1kb b\\n2\\n1.5GiB\\n0x10\\n1kb c\\n3' | ./bcal --sort"),  # 112
+    ('sh', '-c', "printf 'a 2MB\\nb 1MiB\\nc\\n' | ./bcal --sort --field 2"),  # 113
+    ('./bcal', '--seq', '1 mib', '2 mib', '256 kib', '--format', 'hex'),  # 114
+    ('./bcal', '--seq', '0', '2kib', '1000', '--format', 'lba', '-s', '512'),  # 115
+    ('./bcal', '--seq', '0', '0x10000', '0x3fff', '--format', 'bin'),  # 116
+    ('./bcal', '-c', '0x10000000000000001'),  # 117
+    ('sh', '-c', "printf '10\\n\\nfoo\\n0b101\\n' | ./bcal -c -"),  # 118
+    ('sh', '-c', "printf '\\0\\0\\20\\0\\0\\0\\40\\0' | ./bcal --quantile --binary u32be | tail -5"),  # 119
+    ('sh', '-c', "printf '\\0\\20\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\5\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0\\0' | ./bcal --align 4KiB --binary u128"),  # 120
+    ('sh', '-c', "printf '\\0\\0\\4\\0\\0' | ./bcal --lba --binary u32be 2>&1"),  # 121
+    ('sh', '-c', "s=/tmp/bcal-test.$$; ./bcal --serve $s & n=0; while [ ! -S $s ] && [ $n -lt 500 ] && kill -0 $! 2>/dev/null; do sleep 0.01; n=$((n + 1)); done; ./bcal --client $s -m '2 kib + 1 kib' && ./bcal --client $s -c 0x10; ./bcal --client $s r; echo $?; kill $!; wait"),  # 122
+    ('sh', '-c', "printf '1\\t-m\\t2 kib + 1 kib\\0002\\t-c\\t0x10\\0003\\t1 + foo\\0004\\tr\\0' | ./bcal --coproc | tr '\\0\\t' '\\n|'"),  # 123
+    ('python3', '-c', SHM_CLIENT),                                     # 124
+    ('sh', '-c', "./bcal --stats -m '2 kib * 3' 2>&1 | awk 'NF == 8 {print $1, $2}'; printf '1+2\\nx=4\\n' | ./bcal -m --stream --stats 2>&1 | awk 'NF == 8 {print $1, $2}'"),  # 125
+    ('python3', '-c', ALLOC_CHECK),                                    # 126
+    ('sh', '-c', "f=$(mktemp) && { head -c 446 /dev/zero; printf '\\200\\040\\041\\000\\203\\376\\377\\377\\000\\010\\000\\000\\000\\000\\001\\000\\000\\040\\041\\000\\007\\376\\377\\377\\077\\000\\000\\000\\144\\000\\000\\000'; head -c 32 /dev/zero; printf '\\125\\252'; } > $f && ./bcal -m --part $f | head -1; rm -f $f"),  # 127
+    ('sh', '-c', "printf '1MiB+1MiB\\n8+8\\n0+10 garbage\\n0+10 \\n' | ./bcal -m --ranges --sectors"),  # 128
+    ('sh', '-c', "printf '1\\t-b\\t1+1\\0002\\t-m\\t2+2\\0' | PATH=/nonexistent ./bcal --coproc | tr '\\0\\t' '\\n|'"),  # 129
+    ('python3', '-c', BUILTIN_CHECK),                                  # 130
+    ('sh', '-c', "PATH=/nonexistent ./bcal --stats -b 1+1 2>&1 | grep -c STATS"),  # 131
+    ('sh', '-c', "f=$(mktemp) && { head -c 446 /dev/zero; printf '\\000\\000\\000\\000\\005\\000\\000\\000\\010\\000\\000\\000\\003\\000\\000\\000'; head -c 48 /dev/zero; printf '\\125\\252'; head -c 3584 /dev/zero; for l in 1 2 1; do head -c 462 /dev/zero; printf \"\\000\\000\\000\\000\\005\\000\\000\\000\\00$l\\000\\000\\000\\001\\000\\000\\000\"; head -c 32 /dev/zero; printf '\\125\\252'; done; } > $f && ./bcal -m --part $f; rm -f $f"),  # 132
+    ('./bcal', '--seq', '0', '3', '0x10000000000000001'),  # 133
+    ('./bcal', '--seq', '0x10000000000000001', '3', '1'),  # 134
+    ('sh', '-c', "printf '1,024 KiB, 1,2 KiB\\n' | ./bcal --scan"),  # 135
+    ('./bcal', '-m', "2 * max(1 GiB, 3 GiB) + avg(1 GiB, 0 b)"),  # 136
+    ('./bcal', '-m', "sum(1, 2) + 1 kib"),  # 137
+    ('sh', '-c', "if printf '\\037\\213' | ./bcal -m --aggregate 2>&1 | grep -q 'not supported'; then echo 'SKIP: no gzip support'; else { printf '1\\n2\\n' | gzip; printf 3 | gzip | head -c 10; } | ./bcal -m --aggregate 2>&1; fi"),  # 138
+    ('sh', '-c', "printf '10 kib 1 kib\\n1 kib+2\\n' | ./bcal -m --ranges --sectors"),  # 139
+    ('sh', '-c', "printf '1+2\\n3+4\\n' | ./bcal -m --stream --stats 2>&1 >/dev/null | grep -v '^ '"),  # 140
 ]
 
 res = [
@@ -172,6 +321,74 @@ res = [
     b'374 B\n',                                      # 70
     b'374\n',                                        # 71
     b'72000000\n',                                   # 72
+    b'ERROR: overflow in +\n',                       # 73
+    b'340282366920938463444927863358058659840\n',    # 74
+    b'340282366920938463426481119284349108225 B\n',  # 75
+    b'170141183460469231731687303715884105728\n',    # 76
+    b'ERROR: overflow in <<\n',                      # 77
+    b'18889465931478580855809 B\n',                  # 78
+    b'ERROR: token overflow\n',                      # 79
+    b'3\n2097152\nERROR: negative result\nWARNING: result truncated\n416666666666 B\n',  # 80
+    b'9216 B\nERROR: invalid sequence >>>\n10240 B\n',  # 81
+    b'ERROR: unit mismatch in +\n10995116277760 B\n374 B\n',  # 82
+    b'16777216\n',                                   # 83
+    b'10\n13\n12288 B\n',                            # 84
+    b'ERROR: invalid variable name\nERROR: invalid variable name\nERROR: unit mismatch in *\n',  # 85
+    b'1610612752 B\n',                               # 86
+    b'2\n',                                          # 87
+    b'31\n',                                         # 88
+    b'ERROR: unit mismatch in sum\n',                # 89
+    b'ERROR: overflow in sum\n',                     # 90
+    b'1073745936 B\n count 4\n min   0 B\n max   1073741824 B\n mean  268436484 B\n skip  1\n       0 B             1\n      16 B - 32 B      1\n     4 KiB - 8 KiB     1\n     1 GiB - 2 GiB     1\n',  # 91
+    b'5120 B\n count 2\n min   1024 B\n max   4096 B\n mean  2560 B\n     1 KiB - 2 KiB     1\n     4 KiB - 8 KiB     1\n',  # 92
+    b'ERROR: overflow in total\n',                   # 93
+    b' p50   50048 B\n p90   89856 B\n p99   99072 B\n p999  100000 B\n',  # 94
+    b' p50   127 B\n p90   230 B\n p99   253 B\n p999  255 B\n',  # 95
+    b'1610612736\n4096\n4096\n16384\n7000\n3000000000000\n',  # 96
+    b'7168 B\n count 3\n',                           # 97
+    b'1440001200000 B\n count 2400000\n min   1 B\n p999  1200000 B\n',  # 98
+    b'1048576 B\n',                                   # 99
+    b'0:0\n0:511\n8:1\nERROR: line 4: invalid address\n8:0\n',  # 100
+    b'8:1 1:1\n36028797018963967:511 4503599627370495:4095\n',  # 101
+    b'2:0\n2114445438030769230:400\n',              # 102
+    b'1136\n1070\nERROR: line 3: S = 0\n16193\n',   # 103
+    b'1,62,30\n1,0,1\nERROR: line 3: invalid record\n',  # 104
+    b'0,16,1\n1,62,30\n',                            # 105
+    b'\x1b[1mMBR\x1b[0m (sector size 512)\n   #  type          start LBA        end LBA        sectors         start byte  size                   CHS/name\n   1  0x83*              2048          67583          65536            1048576  32 MiB, 33.55 MB       0-32-33 1023-254-63 [beyond image]\n   2  0x07                 63            162            100              32256  50 KiB, 51.20 kB       0-32-33 1023-254-63 [misaligned] [beyond image]\n1 of 2 partitions not 4 KiB aligned\n',  # 106
+    b'ERROR: /dev/null: no partition table\n',       # 107
+    b'line 2: 4097 down 4096 up 8192\nline 5: 1536 down 0 up 4096\n count      4\n aligned    2\n misaligned 2\n skip       1\n',  # 108
+    b'record 1: 8192 down 6144 up 9216\nrecord 2: 4097 down 3072 up 6144\n count      2\n aligned    0\n misaligned 2\n',  # 109
+    b'ERROR: line 5: invalid range\n0+5120\n8192+4096\n1048576+1048576\n ranges  5, 3 merged\n covered 3, 1057792 B (1.01 MiB, 1.06 MB)\n gaps    2, 1039360 B (1015 KiB, 1.04 MB)\n start   0:0\n end     4096:0\n',  # 110
+    b'5+5\n20+5\n28+2\n ranges  2, 2\n overlap 3, 12 B (12 B, 12 B)\n',  # 111
+    b'foo\n2\n3\n0x10\n1kb b\n1kb c\n1KiB a\n1.5GiB\n',  # 112
+    b'c\nb 1MiB\na 2MB\n',                         # 113
+    b'0x100000\n0x140000\n0x180000\n0x1c0000\n0x200000\n',  # 114
+    b'0:0\n1:488\n3:464\n',                          # 115
+    b'0\n111111 11111111\n1111111 11111110\n10111111 11111101\n11111111 11111100\n',  # 116
+    b' (b) 1 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000001\n (d) 18446744073709551617\n (h) 0x10000000000000001\n\n',  # 117
+    b' (b) 1010\n (d) 10\n (h) 0xa\n\nERROR: line 3: invalid input\n (b) 101\n (d) 5\n (h) 0x5\n\n',  # 118
+    b'\x1b[1mQUANTILES\x1b[0m\n p50   4112 B\n p90   8192 B\n p99   8192 B\n p999  8192 B\n',  # 119
+    b'record 2: 5 down 0 up 4096\n count      2\n aligned    1\n misaligned 1\n',  # 120
+    b'2:0\nERROR: record 2: truncated\n',            # 121
+    b'3072 B\n (b) 10000\n (d) 16\n (h) 0x10\n\nERROR: no result stored\n255\n',  # 122
+    b'1|0|1|3072||3072 B\n\n2|0|||| (b) 10000\n (d) 16\n (h) 0x10\n\n\n3|255|||ERROR: invalid expression\n|\n4|0||||r = 3072 B\n\n',  # 123
+    b'255 ERROR: name: Address already in use\n1 0 1 3072 0 0 0\n2 0 0 8 1 0 0\n3 0 0 1 0 63 0\n4 0 0 4096 8192 0 0\n5 2 0 0 0 0 0\n6 1 0 0 0 0 0\n',  # 124
+    b'phase count\nfixexpr 1\ninfix2postfix 1\neval 1\nunitconv 2\noutput 1\nphase count\noutput 1\nrequest 2\n',  # 125
+    b'steady\n',                                     # 126
+    b'MBR (sector size 512)\n',                      # 127
+    b'ERROR: line 3: invalid range\n0+8192\n1048576+1048576\n',  # 128
+    b'1|255|||ERROR: bc failed\n|\n2|0|0|4||4\n\n',  # 129
+    b'0 3072 B\nERROR: no result stored\n1 []\n0 []\nERROR: invalid token\n1 []\n0 10485760 B\n',  # 130
+    b'1\n',  # 131
+    b'MBR (sector size 512)\n   #  type          start LBA        end LBA        sectors         start byte  size                   CHS/name\n   1  0x05                  8             10              3               4096  1.50 KiB, 1.54 kB      0-0-0 0-0-0\nERROR: EBR loop at LBA 10\n',  # 132
+    b'0\n',  # 133
+    b'',  # 134
+    b'1048576\n',  # 135
+    b'6979321856 B\n',  # 136
+    b'ERROR: unit mismatch in +\n',  # 137
+    b'ERROR: truncated gzip input\n3 B\n count 2\n min   1 B\n max   2 B\n mean  1 B\n       1 B - 2 B       1\n       2 B - 4 B       1\n',  # 138
+    b'1024+1024\n10240+1024\n',  # 139
+    b'STATS (us)\n\nALLOCATIONS (peak: bytes of one pass)\n\nREQUEST LATENCY\n',  # 140
 ]
 
 
@@ -181,6 +398,7 @@ def test_output(item, res):
         out = subprocess.check_output(item, stderr=subprocess.STDOUT)
     except subprocess.CalledProcessError as e:
         # print(e.output)
-        assert e.output == res
-    else:
-        assert out == res
+        out = e.output
+    if out.startswith(b'SKIP'):
+        pytest.skip(out.decode().strip())
+    assert out == res